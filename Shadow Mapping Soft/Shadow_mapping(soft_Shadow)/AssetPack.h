@@ -0,0 +1,420 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: AssetPack.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+A pack file that holds all of our assets (shaders, textures and generated data)
+in one file. Opening many small files is slow on some file systems, so instead
+we open one file and map it into memory. The assets are then just pointers into
+that memory, nothing is copied.
+
+The file looks like this:
+
+	+--------+------------------+--------+--------+-----+
+	| Header | Entry[count]     | blob 0 | blob 1 | ... |
+	+--------+------------------+--------+--------+-----+
+
+The header says how many entries there are, and each entry has the name of the
+asset and where its blob is in the file. Blobs are aligned to 16 bytes.
+A blob can be compressed with a small LZ77 style compressor. Compressed blobs
+are unpacked the first time they are asked for and kept in memory, so only
+those cost a copy. Data that doesn't get smaller is stored as it is.
+*/
+
+#ifndef _ASSET_PACK_H
+#define _ASSET_PACK_H
+
+#include "GLIncludes.h"
+#include <cstring>
+#include <cstdint>
+#include <map>
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define ASSET_PACK_VERSION 1
+#define ASSET_COMPRESSED 1
+
+// A pointer to some bytes and how many there are. It doesn't own the memory.
+struct AssetView
+{
+	const char* data;
+	size_t size;
+};
+
+struct AssetPackHeader
+{
+	char magic[4];			// "SMPK"
+	uint32_t version;
+	uint32_t count;			// Number of entries
+	uint32_t reserved;
+};
+
+struct AssetPackEntry
+{
+	char name[48];
+	uint64_t offset;		// From the start of the file
+	uint32_t size;			// Size stored in the file
+	uint32_t rawSize;		// Size after unpacking. Same as size if the blob isn't compressed.
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+#pragma region compression
+
+// The compressed stream is a list of tokens:
+// 0LLLLLLL						literal run of L+1 bytes (1 to 128), followed by the bytes
+// 1LLLLLLL OOOOOOOO OOOOOOOO	copy L+4 bytes (4 to 131) from O bytes back (1 to 65535)
+void lzCompress(const char* src, size_t size, std::vector<char>& out)
+{
+	const int hashSize = 1 << 14;
+	std::vector<int> table(hashSize, -1);	// Last position where each 4 byte sequence was seen
+	size_t literalStart = 0;
+	size_t i = 0;
+
+	while (i + 4 <= size)
+	{
+		uint32_t sequence;
+		memcpy(&sequence, src + i, 4);
+		uint32_t hash = (sequence * 2654435761u) >> 18;
+		int candidate = table[hash];
+		table[hash] = (int)i;
+
+		if (candidate < 0 || i - candidate > 65535 || memcmp(src + candidate, src + i, 4) != 0)
+		{
+			i++;
+			continue;
+		}
+
+		// Found a match. First write out the literals that came before it.
+		for (size_t l = literalStart; l < i; l += 128)
+		{
+			size_t run = std::min<size_t>(128, i - l);
+			out.push_back((char)(run - 1));
+			out.insert(out.end(), src + l, src + l + run);
+		}
+
+		size_t length = 4;
+		while (i + length < size && length < 131 && src[candidate + length] == src[i + length])
+			length++;
+
+		size_t distance = i - candidate;
+		out.push_back((char)(0x80 | (length - 4)));
+		out.push_back((char)(distance & 0xFF));
+		out.push_back((char)(distance >> 8));
+
+		i += length;
+		literalStart = i;
+	}
+
+	for (size_t l = literalStart; l < size; l += 128)
+	{
+		size_t run = std::min<size_t>(128, size - l);
+		out.push_back((char)(run - 1));
+		out.insert(out.end(), src + l, src + l + run);
+	}
+}
+
+// Returns false if the stream is broken.
+bool lzDecompress(const char* src, size_t size, char* dst, size_t rawSize)
+{
+	size_t in = 0, out = 0;
+	while (in < size)
+	{
+		unsigned char token = (unsigned char)src[in++];
+		if ((token & 0x80) == 0)
+		{
+			size_t run = token + 1;
+			if (in + run > size || out + run > rawSize)
+				return false;
+			memcpy(dst + out, src + in, run);
+			in += run;
+			out += run;
+		}
+		else
+		{
+			if (in + 2 > size)
+				return false;
+			size_t length = (token & 0x7F) + 4;
+			size_t distance = (unsigned char)src[in] | ((unsigned char)src[in + 1] << 8);
+			in += 2;
+			if (distance == 0 || distance > out || out + length > rawSize)
+				return false;
+			// The copy can overlap itself (e.g. a run of the same byte), so it goes one byte at a time.
+			for (size_t k = 0; k < length; k++, out++)
+				dst[out] = dst[out - distance];
+		}
+	}
+	return out == rawSize;
+}
+
+#pragma endregion compression
+
+// A read-only file mapped into memory
+struct MappedFile
+{
+	const char* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int file;
+#endif
+
+	bool open(const char* fileName)
+	{
+		data = nullptr;
+		size = 0;
+#ifdef _WIN32
+		file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		size = (size_t)fileSize.QuadPart;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping != nullptr)
+			data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		file = ::open(fileName, O_RDONLY);
+		if (file < 0)
+			return false;
+		struct stat info;
+		fstat(file, &info);
+		size = (size_t)info.st_size;
+		void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (address != MAP_FAILED)
+			data = (const char*)address;
+#endif
+		if (data == nullptr)
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (data != nullptr)
+			UnmapViewOfFile(data);
+		if (mapping != nullptr)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data != nullptr)
+			munmap((void*)data, size);
+		if (file >= 0)
+			::close(file);
+		file = -1;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+};
+
+struct AssetPack
+{
+	MappedFile file;
+	const AssetPackHeader* header;
+	const AssetPackEntry* entries;
+	std::map<std::string, std::vector<char> > unpacked;	// Compressed blobs, once they have been unpacked
+
+	bool open(const char* fileName)
+	{
+		header = nullptr;
+		entries = nullptr;
+		if (!file.open(fileName))
+			return false;
+
+		header = (const AssetPackHeader*)file.data;
+		if (file.size < sizeof(AssetPackHeader) || memcmp(header->magic, "SMPK", 4) != 0 || header->version != ASSET_PACK_VERSION
+			|| file.size < sizeof(AssetPackHeader) + header->count * sizeof(AssetPackEntry))
+		{
+			std::cout << fileName << " is not a valid asset pack.\n";
+			close();
+			return false;
+		}
+		entries = (const AssetPackEntry*)(file.data + sizeof(AssetPackHeader));
+		return true;
+	}
+
+	void close()
+	{
+		if (file.data != nullptr)
+			file.close();
+		header = nullptr;
+		entries = nullptr;
+		unpacked.clear();
+	}
+
+	bool isOpen()
+	{
+		return header != nullptr;
+	}
+
+	// Returns the asset with the given name. data is nullptr if the pack doesn't have it.
+	AssetView find(const std::string& name)
+	{
+		AssetView view = { nullptr, 0 };
+		if (!isOpen())
+			return view;
+
+		// There are only a handful of entries, so a linear search is fine.
+		for (uint32_t i = 0; i < header->count; i++)
+		{
+			const AssetPackEntry& e = entries[i];
+			if (strncmp(e.name, name.c_str(), sizeof(e.name)) != 0)
+				continue;
+			if (e.offset + e.size > file.size)
+				return view;
+
+			if ((e.flags & ASSET_COMPRESSED) == 0)
+			{
+				view.data = file.data + e.offset;
+				view.size = e.size;
+				return view;
+			}
+
+			// An empty asset has nothing to unpack, and an empty buffer has no &buffer[0] to point at.
+			if (e.rawSize == 0)
+			{
+				view.data = file.data + e.offset;
+				return view;
+			}
+
+			std::vector<char>& buffer = unpacked[name];
+			if (buffer.empty())
+			{
+				buffer.resize(e.rawSize);
+				if (!lzDecompress(file.data + e.offset, e.size, &buffer[0], e.rawSize))
+				{
+					std::cout << "Asset " << name << " is corrupted.\n";
+					unpacked.erase(name);
+					return view;
+				}
+			}
+			view.data = &buffer[0];
+			view.size = buffer.size();
+			return view;
+		}
+		return view;
+	}
+
+}assetPack;
+
+// An asset to be written into a new pack
+struct AssetSource
+{
+	std::string name;
+	std::vector<char> data;
+	bool tryCompress;
+};
+
+// Writes all of the assets into one pack file. Returns false if the file couldn't be written.
+bool writeAssetPack(const char* fileName, std::vector<AssetSource>& assets)
+{
+	std::vector<AssetPackEntry> entries(assets.size());
+	std::vector<std::vector<char> > blobs(assets.size());
+
+	uint64_t offset = sizeof(AssetPackHeader) + assets.size() * sizeof(AssetPackEntry);
+	for (unsigned int i = 0; i < assets.size(); i++)
+	{
+		AssetPackEntry& e = entries[i];
+		memset(&e, 0, sizeof(e));
+		strncpy(e.name, assets[i].name.c_str(), sizeof(e.name) - 1);
+		e.rawSize = (uint32_t)assets[i].data.size();
+
+		// Only keep the compressed version if it saves at least 10%.
+		if (assets[i].tryCompress && !assets[i].data.empty())
+		{
+			lzCompress(&assets[i].data[0], assets[i].data.size(), blobs[i]);
+			if (blobs[i].size() < assets[i].data.size() * 9 / 10)
+				e.flags |= ASSET_COMPRESSED;
+			else
+				blobs[i].clear();
+		}
+		if ((e.flags & ASSET_COMPRESSED) == 0)
+			blobs[i] = assets[i].data;
+
+		offset = (offset + 15) & ~(uint64_t)15;
+		e.offset = offset;
+		e.size = (uint32_t)blobs[i].size();
+		offset += e.size;
+	}
+
+	std::ofstream out(fileName, std::ios::out | std::ios::binary);
+	if (!out.good())
+		return false;
+
+	AssetPackHeader header;
+	memcpy(header.magic, "SMPK", 4);
+	header.version = ASSET_PACK_VERSION;
+	header.count = (uint32_t)entries.size();
+	header.reserved = 0;
+	out.write((const char*)&header, sizeof(header));
+	if (!entries.empty())
+		out.write((const char*)&entries[0], entries.size() * sizeof(AssetPackEntry));
+
+	const char padding[16] = { 0 };
+	for (unsigned int i = 0; i < entries.size(); i++)
+	{
+		out.write(padding, entries[i].offset - (uint64_t)out.tellp());
+		if (!blobs[i].empty())
+			out.write(&blobs[i][0], blobs[i].size());
+	}
+
+	return out.good();
+}
+
+// Reads a whole loose file into an asset to be packed.
+bool loadAssetSource(const std::string& fileName, bool tryCompress, AssetSource& asset)
+{
+	std::ifstream file(fileName, std::ios::in | std::ios::binary);
+	if (!file.good())
+	{
+		std::cout << "Can't read file: " << fileName << std::endl;
+		return false;
+	}
+	asset.name = fileName;
+	asset.tryCompress = tryCompress;
+	file.seekg(0, std::ios::end);
+	asset.data.resize((size_t)file.tellg());
+	file.seekg(0, std::ios::beg);
+	if (!asset.data.empty())
+		file.read(&asset.data[0], asset.data.size());
+	return true;
+}
+
+#endif _ASSET_PACK_H
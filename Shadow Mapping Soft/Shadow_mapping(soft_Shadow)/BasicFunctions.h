@@ -63,6 +63,8 @@ OpenGL 4 Shading language Cookbook
 */
 
 #include "GLIncludes.h"
+#include "AssetPack.h"
+#include "GLStateCache.h"
 
 GLuint renderProgram;		//This program contains the shader which are used to render the final image and do the final calculations
 
@@ -77,11 +79,41 @@ GLuint program;
 GLuint vertex_shader;
 GLuint fragment_shader;
 
-// This is a reference to your uniform MVP matrix in your vertex shader
-GLuint uniMVP;
-
 // Reference to the window object being created by GLFW.
 GLFWwindow* window;
+
+// GL_KHR_parallel_shader_compile and GL_ARB_parallel_shader_compile are newer than our copy of GLEW,
+// so we define the enums and load the function ourselves.
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+typedef void (GLAPIENTRY * PFNMAXSHADERCOMPILERTHREADSPROC)(GLuint count);
+
+// True if the driver compiles shaders on its own threads and lets us ask if it is done without waiting.
+bool parallelShaderCompile;
+
+// GL_ARB_gl_spirv (core in 4.6) is also newer than our GLEW.
+#ifndef GL_SHADER_BINARY_FORMAT_SPIR_V_ARB
+#define GL_SHADER_BINARY_FORMAT_SPIR_V_ARB 0x9551
+#endif
+typedef void (GLAPIENTRY * PFNSPECIALIZESHADERPROC)(GLuint shader, const GLchar* pEntryPoint, GLuint numSpecializationConstants, const GLuint* pConstantIndex, const GLuint* pConstantValue);
+PFNSPECIALIZESHADERPROC specializeShader;
+
+// True if the shaders are loaded from the precompiled .spv files instead of the GLSL sources.
+// Set it before init(); init() turns it off again if the driver can't load SPIR-V.
+bool spirvShaders;
+
+// A program that has been sent to the driver, but whose compile and link status hasn't been checked yet.
+struct PendingProgram
+{
+	GLuint program;
+	GLuint shaders[3];		// Vertex and fragment, or a compute shader alone, or with a geometry shader in the middle
+	int shaderCount;
+	std::string name;
+	GLuint* handle;			// If not nullptr, set to 0 when the program fails to link, so its owner can tell
+};
+std::vector<PendingProgram> pendingPrograms;
 #pragma endregion Base_data								  
 
 //This struct consists of the basic stuff needed for getting the shape on the screen.
@@ -95,6 +127,9 @@ struct stuff_for_drawing{
 	//This will be used to tell the GPU, how many vertices will be needed to draw during drawcall.
 	int numberOfVertices;
 
+	// A copy of the vertices on the CPU side, for the CPU rasterizer. Filled before initBuffer() is called.
+	std::vector<VertexFormat> vertices;
+
 	//This function gets the number of vertices and all the vertex values and stores them in the buffer.
 	void initBuffer(int numVertices, VertexFormat* vertices)
 	{
@@ -137,6 +172,29 @@ struct stuff_for_drawing{
 
 		glBindVertexArray(0);
 	}
+
+	// Same as initBuffer(), but the vertices are already in a buffer shared with other meshes, starting at firstVertex.
+	void initSharedBuffer(GLuint sharedVbo, int firstVertex, int numVertices)
+	{
+		numberOfVertices = numVertices;
+		vbo = sharedVbo;
+		size_t start = (size_t)firstVertex * sizeof(VertexFormat);
+
+		glGenVertexArrays(1, &vao);
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexFormat), (void*)(start + 16));
+
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexFormat), (void*)(start + 28));
+
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(VertexFormat), (void*)(start + 0));
+
+		glBindVertexArray(0);
+	}
 };
 
 
@@ -144,9 +202,6 @@ struct Sphere
 {
 	glm::vec3 origin;
 	float radius;
-	glm::mat4 MVP;
-	glm::mat4 ModelView;
-	glm::mat3 NormalMatrix;
 	stuff_for_drawing base;
 }sphere1, sphere2;
 
@@ -156,15 +211,11 @@ struct Plane
 	//Construct the plane here 
 	stuff_for_drawing base;
 	unsigned int numberOfVertices;
-	glm::mat4 MVP;
-	glm::mat4 ModelView;
-	glm::mat3 NormalMatrix;
 	glm::vec3 origin;
 
-	void initBuffer()
+	// Builds the vertices on the CPU. This needs no OpenGL, so the CPU rasterizer can use it without a window.
+	void buildVertices()
 	{
-		numberOfVertices = 6;
-
 		VertexFormat A, B, C, D;
 
 		/*
@@ -192,7 +243,9 @@ struct Plane
 		D.normal = glm::vec3(0.0f, 1.0f, 0.0f);
 		D.color = glm::vec4(0.75f, 0.75f, 0.75f, 1.0f);
 
-		std::vector<VertexFormat> planeVerts;
+		std::vector<VertexFormat>& planeVerts = base.vertices;
+		planeVerts.clear();
+		planeVerts.reserve(6);
 		
 		planeVerts.push_back(A);
 		planeVerts.push_back(B);
@@ -203,11 +256,15 @@ struct Plane
 		planeVerts.push_back(C);
 
 		numberOfVertices = 6;
-		base.initBuffer(numberOfVertices, &planeVerts[0]);
 
 		origin = glm::vec3(0.0f, -0.5f, 0.0f);
 	}
 
+	void initBuffer()
+	{
+		base.initBuffer(numberOfVertices, &base.vertices[0]);
+	}
+
 }plane;
 
 
@@ -250,14 +307,28 @@ std::string readShader(std::string fileName)
 	return shaderCode;
 }
 
-// This method will consolidate some of the shader code we've written to return a GLuint to the compiled shader.
-// It only requires the shader source code and the shader type.
-GLuint createShader(std::string sourceCode, GLenum shaderType)
+// Looks for the shader in the asset pack first. If it is there, we get a pointer straight into the mapped file.
+// Otherwise the loose file is read into storage, which has to stay alive as long as the returned view is used.
+AssetView loadShaderSource(std::string fileName, std::string& storage)
+{
+	AssetView view = assetPack.find(fileName);
+	if (view.data == nullptr)
+	{
+		storage = readShader(fileName);
+		view.data = storage.c_str();
+		view.size = storage.size();
+	}
+	return view;
+}
+
+// Sends the shader to the driver to be compiled, but doesn't wait for the result.
+// Asking for the compile status right away would force the driver to finish this shader before we can send the next one.
+GLuint submitShader(AssetView sourceCode, GLenum shaderType)
 {
 	// glCreateShader, creates a shader given a type (such as GL_VERTEX_SHADER) and returns a GLuint reference to that shader.
 	GLuint shader = glCreateShader(shaderType);
-	const char *shader_code_ptr = sourceCode.c_str(); // We establish a pointer to our shader code string
-	const int shader_code_size = sourceCode.size();   // And we get the size of that string.
+	const char *shader_code_ptr = sourceCode.data;				// We establish a pointer to our shader code
+	const int shader_code_size = (int)sourceCode.size;		// And we get the size of it. The code doesn't need to end with a 0, since we pass the size.
 
 	// glShaderSource replaces the source code in a shader object
 	// It takes the reference to the shader (a GLuint), a count of the number of elements in the string array (in case you're passing in multiple strings), a pointer to the string array 
@@ -265,6 +336,19 @@ GLuint createShader(std::string sourceCode, GLenum shaderType)
 	glShaderSource(shader, 1, &shader_code_ptr, &shader_code_size);
 	glCompileShader(shader); // This just compiles the shader, given the source code.
 
+	return shader;
+}
+
+GLuint submitShader(std::string sourceCode, GLenum shaderType)
+{
+	AssetView view = { sourceCode.c_str(), sourceCode.size() };
+	return submitShader(view, shaderType);
+}
+
+// Checks the compile status of a submitted shader. This waits for the compile to finish if it hasn't yet.
+// Returns 0 if the shader failed to compile.
+GLuint checkShader(GLuint shader)
+{
 	GLint isCompiled = 0;
 
 	// Check the compile status to see if the shader compiled correctly.
@@ -281,6 +365,7 @@ GLuint createShader(std::string sourceCode, GLenum shaderType)
 		// Provide the infolog in whatever manor you deem best.
 		// Exit with failure.
 		glDeleteShader(shader); // Don't leak the shader.
+		shader = 0;
 
 		// NOTE: I almost always put a break point here, so that instead of the program continuing with a deleted/failed shader, it stops and gives me a chance to look at what may 
 		// have gone wrong. You can check the console output to see what the error was, and usually that will point you in the right direction.
@@ -289,46 +374,204 @@ GLuint createShader(std::string sourceCode, GLenum shaderType)
 	return shader;
 }
 
-// Initialization code
-void init()
+// This method will consolidate some of the shader code we've written to return a GLuint to the compiled shader.
+// It only requires the shader source code and the shader type. Returns 0 if the shader failed to compile.
+GLuint createShader(std::string sourceCode, GLenum shaderType)
 {
-	// Initializes the glew library
-	glewInit();
+	return checkShader(submitShader(sourceCode, shaderType));
+}
 
-	// Enables the depth test, which you will want in most cases. You can disable this in the render loop if you need to.
-	glEnable(GL_DEPTH_TEST);
+// Loads a precompiled SPIR-V shader and specializes it, which is where the driver actually compiles it.
+// The constant values are the raw 32 bits of each constant, so floats have to be passed bit for bit.
+// Returns 0 if the file is neither in the asset pack nor on disk.
+GLuint submitSpirvShader(std::string fileName, GLenum shaderType, GLuint numConstants, const GLuint* constantIds, const GLuint* constantValues)
+{
+	// SPIR-V is binary, so it is read in binary mode (readShader would mangle it on Windows).
+	AssetView code = assetPack.find(fileName);
+	AssetSource loose;
+	if (code.data == nullptr)
+	{
+		if (!loadAssetSource(fileName, false, loose) || loose.data.empty())
+			return 0;
+		code.data = &loose.data[0];
+		code.size = loose.data.size();
+	}
 
-	// Read in the shader code from a file.
-	std::string vertShader = readShader("VertexShader.glsl");
-	std::string fragShader = readShader("FragmentShader.glsl");
+	GLuint shader = glCreateShader(shaderType);
+	glShaderBinary(1, &shader, GL_SHADER_BINARY_FORMAT_SPIR_V_ARB, code.data, (GLsizei)code.size);
+	specializeShader(shader, "main", numConstants, constantIds, constantValues);
+	return shader;
+}
 
-	// createShader consolidates all of the shader compilation code
-	vertex_shader = createShader(vertShader, GL_VERTEX_SHADER);
-	fragment_shader = createShader(fragShader, GL_FRAGMENT_SHADER);
+// Reads a GLSL file, from the asset pack if it is there, and submits it without waiting for the compile.
+GLuint submitShaderFile(std::string fileName, GLenum shaderType)
+{
+	// glShaderSource makes its own copy of the code, so the storage only has to live until then.
+	std::string storage;
+	return submitShader(loadShaderSource(fileName, storage), shaderType);
+}
+
+// Links submitted shaders into a program without waiting for any of them, and adds it to the pending list.
+// A shader can be in several programs, finishPrograms() checks it only once. The shaders still belong to the caller.
+// If handle is given, finishPrograms() deletes the program and sets *handle to 0 when it fails to link.
+GLuint submitLinkedProgram(std::string name, const GLuint* shaders, int count, GLuint* handle)
+{
+	PendingProgram p;
+	p.name = name;
+	p.shaderCount = count;
+	p.handle = handle;
+	p.program = glCreateProgram();
+	for (int i = 0; i < count; i++)
+	{
+		p.shaders[i] = shaders[i];
+		glAttachShader(p.program, shaders[i]);
+	}
+	glLinkProgram(p.program);
+
+	pendingPrograms.push_back(p);
+	return p.program;
+}
+
+// FragmentShader.glsl writes nothing but depth, so every depth-only program can share one compile of it.
+// With the GLSL programs it is the one of program, otherwise it is submitted the first time it is asked for.
+GLuint depthFragmentShader;
+
+GLuint sharedDepthFragmentShader()
+{
+	if (depthFragmentShader == 0)
+		depthFragmentShader = submitShaderFile("FragmentShader.glsl", GL_FRAGMENT_SHADER);
+	return depthFragmentShader;
+}
+
+// Same as submitProgram, for SPIR-V. The specialization constants only go to the fragment shader.
+// Returns 0, and adds nothing to the pending list, if either file can't be found.
+GLuint submitSpirvProgram(std::string vertexFile, std::string fragmentFile, GLuint numConstants, const GLuint* constantIds, const GLuint* constantValues)
+{
+	GLuint shaders[2];
+	shaders[0] = submitSpirvShader(vertexFile, GL_VERTEX_SHADER, 0, nullptr, nullptr);
+	shaders[1] = submitSpirvShader(fragmentFile, GL_FRAGMENT_SHADER, numConstants, constantIds, constantValues);
+	if (shaders[0] == 0 || shaders[1] == 0)
+	{
+		std::cout << "Can't find " << (shaders[0] == 0 ? vertexFile : fragmentFile) << std::endl;
+		glDeleteShader(shaders[0]);
+		glDeleteShader(shaders[1]);
+		return 0;
+	}
+	return submitLinkedProgram(vertexFile + " + " + fragmentFile, shaders, 2, nullptr);
+}
+
+// Reads, compiles and links a program without checking any of the results, and adds it to the pending list.
+// The driver can keep working on it while we set up the rest of the scene.
+GLuint submitProgram(std::string vertexFile, std::string fragmentFile)
+{
+	GLuint shaders[2];
+	shaders[0] = submitShaderFile(vertexFile, GL_VERTEX_SHADER);
+	shaders[1] = submitShaderFile(fragmentFile, GL_FRAGMENT_SHADER);
 
 	// A shader is a program that runs on your GPU instead of your CPU. In this sense, OpenGL refers to your groups of shaders as "programs".
-	// Using glCreateProgram creates a shader program and returns a GLuint reference to it.
-	program = glCreateProgram();
-	glAttachShader(program, vertex_shader);		// This attaches our vertex shader to our program.
-	glAttachShader(program, fragment_shader);	// This attaches our fragment shader to our program.
+	// submitLinkedProgram attaches both shaders to a new program and links it, which creates the executables to run on the GPU.
+	// Linking before the shaders are known to be compiled is fine, the driver just queues it behind them.
+	return submitLinkedProgram(vertexFile + " + " + fragmentFile, shaders, 2, nullptr);
+}
+
+// Submits the programs from the GLSL sources. Used unless the shaders come from SPIR-V.
+void submitGlslPrograms()
+{
+	program = submitProgram("VertexShader.glsl", "FragmentShader.glsl");
+	depthFragmentShader = pendingPrograms.back().shaders[1];
+	renderProgram = submitProgram("LightVertexShader.glsl", "LightFragShader.glsl");
+	vertex_shader = pendingPrograms.back().shaders[0];
+	fragment_shader = pendingPrograms.back().shaders[1];
+}
+
+// Returns true once the driver has finished every pending program. Never waits.
+// Without the parallel compile extension there is no way to ask, so we just say yes and let finishPrograms() wait.
+bool pendingProgramsReady()
+{
+	if (!parallelShaderCompile)
+		return true;
+
+	for (unsigned int i = 0; i < pendingPrograms.size(); i++)
+	{
+		GLint done = GL_FALSE;
+		glGetProgramiv(pendingPrograms[i].program, GL_COMPLETION_STATUS_KHR, &done);
+		if (done == GL_FALSE)
+			return false;
+	}
+	return true;
+}
 
-	// This links the program, using the vertex and fragment shaders to create executables to run on the GPU.
-	glLinkProgram(program);
+// Checks the compile and link status of every pending program, and prints the errors, if any.
+// Since all of them were submitted together, this only waits as long as the slowest one takes.
+void finishPrograms()
+{
+	// The shaders that were already checked for an earlier program.
+	std::vector<GLuint> checked;
+	for (unsigned int i = 0; i < pendingPrograms.size(); i++)
+	{
+		PendingProgram& p = pendingPrograms[i];
+		for (int s = 0; s < p.shaderCount; s++)
+		{
+			if (std::find(checked.begin(), checked.end(), p.shaders[s]) != checked.end())
+				continue;
+			checked.push_back(p.shaders[s]);
+			if (checkShader(p.shaders[s]) == 0)
+				std::cout << "in " << p.name << std::endl;
+		}
+
+		GLint isLinked = 0;
+		glGetProgramiv(p.program, GL_LINK_STATUS, &isLinked);
+		if (isLinked == GL_FALSE)
+		{
+			char infolog[1024];
+			glGetProgramInfoLog(p.program, 1024, NULL, infolog);
+			std::cout << "The program " << p.name << " failed to link with the error:" << std::endl << infolog << std::endl;
+			if (p.handle != nullptr)
+			{
+				glDeleteProgram(p.program);
+				*p.handle = 0;
+			}
+		}
+	}
+	pendingPrograms.clear();
+}
 
-	uniMVP = glGetUniformLocation(program, "MVP");
+// Initialization code
+void init()
+{
+	// Initializes the glew library
+	glewInit();
 
+	// Enables the depth test, which you will want in most cases. You can disable this in the render loop if you need to.
+	glEnable(GL_DEPTH_TEST);
 
+	// If the driver supports it, let it compile on as many threads as it likes.
+	// Then the compile status can be polled with GL_COMPLETION_STATUS_KHR without blocking.
+	PFNMAXSHADERCOMPILERTHREADSPROC maxShaderCompilerThreads = nullptr;
+	if (glfwExtensionSupported("GL_KHR_parallel_shader_compile"))
+		maxShaderCompilerThreads = (PFNMAXSHADERCOMPILERTHREADSPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+	else if (glfwExtensionSupported("GL_ARB_parallel_shader_compile"))
+		maxShaderCompilerThreads = (PFNMAXSHADERCOMPILERTHREADSPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsARB");
 
-	vertShader = readShader("LightVertexShader.glsl");
-	fragShader = readShader("LightFragShader.glsl");
+	parallelShaderCompile = (maxShaderCompilerThreads != nullptr);
+	if (parallelShaderCompile)
+		maxShaderCompilerThreads(0xFFFFFFFF);
 
-	vertex_shader = createShader(vertShader, GL_VERTEX_SHADER);
-	fragment_shader = createShader(fragShader, GL_FRAGMENT_SHADER);
+	// The SPIR-V programs are submitted by the caller, since their specialization constants depend on the scene setup.
+	if (spirvShaders)
+	{
+		if (glfwExtensionSupported("GL_ARB_gl_spirv"))
+			specializeShader = (PFNSPECIALIZESHADERPROC)glfwGetProcAddress("glSpecializeShaderARB");
+		if (specializeShader == nullptr)
+		{
+			std::cout << "SPIR-V shaders are not supported by this driver, using GLSL instead.\n";
+			spirvShaders = false;
+		}
+	}
 
-	renderProgram = glCreateProgram();
-	glAttachShader(renderProgram, vertex_shader);
-	glAttachShader(renderProgram, fragment_shader);
-	glLinkProgram(renderProgram);
+	// Send every shader to the driver first. Their status is checked in finishPrograms(), once the rest of setup is done.
+	if (!spirvShaders)
+		submitGlslPrograms();
 
 	glFrontFace(GL_CW);
 	glEnable(GL_CULL_FACE);
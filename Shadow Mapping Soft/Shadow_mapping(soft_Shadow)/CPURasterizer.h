@@ -0,0 +1,459 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: CPURasterizer.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+A software version of the first draw pass. It takes the same triangles and
+matrices that firstDrawPass() sends to OpenGL, and fills a depth buffer the
+same way the GPU fills depthTex, polygon offset and face culling included.
+It works in two steps:
+
+Binning: The screen is cut into tiles of 32x32 pixels. Every triangle is
+transformed, clipped against the near plane, culled, and then added to the
+list of each tile its bounding box touches. The triangles are split into
+chunks, and every chunk is binned by a different thread into its own lists,
+so the threads never write to the same list.
+
+Rasterization: Every tile is then filled by one thread, going through the
+triangles in its lists. A pixel is inside a triangle if it is on the inner
+side of all three edges. The "edge function" for each edge is a plane
+equation in x and y, so we can evaluate it for 4 pixels at once with SSE,
+together with the depth and the depth test. Since no two threads work on the
+same tile, no locking is needed here either.
+
+The camera pass of the CPU renderer uses the same rasterizer. There, every pixel
+that passes the depth test also remembers which triangle it came from and where
+inside that triangle it is, so it can be shaded once the tile is done.
+*/
+
+#ifndef _CPU_RASTERIZER_H
+#define _CPU_RASTERIZER_H
+
+#include "GLIncludes.h"
+#include "ThreadPool.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define RASTER_SSE
+#include <emmintrin.h>
+#endif
+
+#define RASTER_TILE_SIZE 32
+
+// One draw call: the vertices and the matrix that takes them to clip space.
+struct RasterMesh
+{
+	const VertexFormat* vertices;
+	int numberOfVertices;
+	glm::mat4 MVP;
+};
+
+// A triangle after setup, in window coordinates.
+struct RasterTriangle
+{
+	float edgeA[3], edgeB[3], edgeC[3];		// Edge functions: E(x, y) = A*x + B*y + C, positive inside
+	float zA, zB, zC;						// Depth as a plane equation in x and y
+	float offset;							// Polygon offset, added to the depth before the test
+	int minX, minY, maxX, maxY;				// Bounding box in pixels, clamped to the screen
+
+	// Where the triangle came from, for the passes that need more than depth.
+	int mesh, primitive;
+	float invArea;
+	float invW[3];							// 1 / w of each corner, for perspective correct interpolation
+	glm::vec3 bary[3];						// Each corner as a blend of the original triangle's corners. Differs only if it was clipped.
+};
+
+// Does nothing with the pixels that pass the depth test, for when only the depth is needed.
+struct DepthOnly
+{
+	static const bool enabled = false;
+	void operator()(const RasterTriangle&, int, int, float, float) {}
+};
+
+struct CPURasterizer
+{
+	int width, height;
+	int tilesX, tilesY;
+	int stride;								// Row length of the depth buffer, padded to whole tiles
+
+	// Same as glPolygonOffset(factor, units).
+	float offsetFactor, offsetUnits;
+	// GL_FRONT, GL_BACK or GL_NONE, with glFrontFace(GL_CW) like in init().
+	GLenum cullFace;
+
+	// The result, with the bottom row first like glGetTexImage returns it. Values are in [0, 1].
+	std::vector<float> depth;
+
+	// Per chunk: the triangles after setup, and for every tile the triangles that touch it.
+	std::vector<std::vector<RasterTriangle>> chunkTriangles;
+	std::vector<std::vector<std::vector<int>>> chunkBins;
+
+	struct Stats
+	{
+		long long triangles;				// Triangles submitted
+		long long trianglesDrawn;			// Triangles left after clipping and culling
+		long long pixelsCovered;			// Pixels inside a triangle (the fill rate)
+		long long pixelsWritten;			// Pixels that also passed the depth test
+		double seconds;
+	}stats;
+
+	void init(int w, int h)
+	{
+		width = w;
+		height = h;
+		tilesX = (w + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+		tilesY = (h + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+		stride = tilesX * RASTER_TILE_SIZE;
+		depth.assign(stride * tilesY * RASTER_TILE_SIZE, 1.0f);
+		offsetFactor = 0.0f;
+		offsetUnits = 0.0f;
+		cullFace = GL_FRONT;		// What firstDrawPass() uses
+	}
+
+	float at(int x, int y)
+	{
+		return depth[y * stride + x];
+	}
+
+	// Draws the depth of the meshes, like a depth only pass on the GPU.
+	void render(const std::vector<RasterMesh>& meshes)
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+
+		binTriangles(meshes);
+
+		std::atomic<long long> covered(0), written(0);
+
+		threadPool.parallelFor(tilesX * tilesY, [&](int tile)
+		{
+			long long tileCovered = 0, tileWritten = 0;
+			rasterizeTile(tile, DepthOnly(), tileCovered, tileWritten);
+			covered += tileCovered;
+			written += tileWritten;
+		});
+
+		stats.pixelsCovered = covered;
+		stats.pixelsWritten = written;
+		stats.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+	}
+
+	// Transforms, clips and culls the triangles, and sorts them into the tiles.
+	void binTriangles(const std::vector<RasterMesh>& meshes)
+	{
+		int totalTriangles = 0;
+		for (unsigned int i = 0; i < meshes.size(); i++)
+			totalTriangles += meshes[i].numberOfVertices / 3;
+
+		// A few chunks per thread, so a thread that gets the big triangles doesn't hold up the others.
+		int chunks = std::max(1, std::min(threadPool.size() * 4, totalTriangles / 64));
+		int perChunk = (totalTriangles + chunks - 1) / chunks;
+		if (chunkTriangles.size() != (size_t)chunks)
+		{
+			chunkTriangles.resize(chunks);
+			chunkBins.resize(chunks);
+		}
+
+		std::atomic<long long> drawn(0);
+
+		threadPool.parallelFor(chunks, [&](int c)
+		{
+			std::vector<RasterTriangle>& triangles = chunkTriangles[c];
+			std::vector<std::vector<int>>& bins = chunkBins[c];
+			triangles.clear();
+			bins.resize(tilesX * tilesY);
+			for (unsigned int t = 0; t < bins.size(); t++)
+				bins[t].clear();
+
+			int first = c * perChunk;
+			int last = std::min(first + perChunk, totalTriangles);
+			if (first >= last)
+				return;
+
+			// Find the mesh the first triangle of this chunk is in.
+			int mesh = 0;
+			int meshStart = 0;
+			while (first >= meshStart + meshes[mesh].numberOfVertices / 3)
+			{
+				meshStart += meshes[mesh].numberOfVertices / 3;
+				mesh++;
+			}
+
+			for (int t = first; t < last; t++)
+			{
+				while (t >= meshStart + meshes[mesh].numberOfVertices / 3)
+				{
+					meshStart += meshes[mesh].numberOfVertices / 3;
+					mesh++;
+				}
+				const VertexFormat* v = meshes[mesh].vertices + (t - meshStart) * 3;
+				setupTriangle(mesh, t - meshStart, meshes[mesh].MVP, v[0].position, v[1].position, v[2].position, triangles);
+			}
+
+			for (unsigned int i = 0; i < triangles.size(); i++)
+			{
+				const RasterTriangle& tri = triangles[i];
+				for (int ty = tri.minY / RASTER_TILE_SIZE; ty <= tri.maxY / RASTER_TILE_SIZE; ty++)
+					for (int tx = tri.minX / RASTER_TILE_SIZE; tx <= tri.maxX / RASTER_TILE_SIZE; tx++)
+						bins[ty * tilesX + tx].push_back(i);
+			}
+			drawn += triangles.size();
+		});
+
+		stats.triangles = totalTriangles;
+		stats.trianglesDrawn = drawn;
+	}
+
+	// Clears one tile and draws all the triangles binned to it. Call after binTriangles().
+	template <class Visitor>
+	void rasterizeTile(int tile, Visitor visit, long long& covered, long long& written)
+	{
+		int tileX = (tile % tilesX) * RASTER_TILE_SIZE;
+		int tileY = (tile / tilesX) * RASTER_TILE_SIZE;
+
+		for (int y = tileY; y < tileY + RASTER_TILE_SIZE; y++)
+			std::fill(depth.begin() + y * stride + tileX, depth.begin() + y * stride + tileX + RASTER_TILE_SIZE, 1.0f);
+
+		// Going through the chunks in order keeps the triangles in the order they were submitted.
+		for (unsigned int c = 0; c < chunkBins.size(); c++)
+		{
+			const std::vector<int>& bin = chunkBins[c][tile];
+			for (unsigned int i = 0; i < bin.size(); i++)
+				rasterizeInTile(chunkTriangles[c][bin[i]], tileX, tileY, visit, covered, written);
+		}
+	}
+
+	// Clips the triangle against the near plane, and adds what is left (0, 1 or 2 triangles) to the list.
+	void setupTriangle(int mesh, int primitive, const glm::mat4& MVP, const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, std::vector<RasterTriangle>& out)
+	{
+		glm::vec4 clip[3] = { MVP * glm::vec4(p0, 1.0f), MVP * glm::vec4(p1, 1.0f), MVP * glm::vec4(p2, 1.0f) };
+
+		// If all three points are outside the same side of the view volume, the triangle can't be seen.
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (clip[0][axis] > clip[0].w && clip[1][axis] > clip[1].w && clip[2][axis] > clip[2].w)
+				return;
+			if (clip[0][axis] < -clip[0].w && clip[1][axis] < -clip[1].w && clip[2][axis] < -clip[2].w)
+				return;
+		}
+
+		// Only the near plane has to be clipped for real, since the perspective divide breaks down behind the eye.
+		// The sides are handled by clamping the bounding box to the screen, and the far plane by the depth test.
+		// Every corner of the clipped polygon also keeps its position inside the original triangle.
+		glm::vec4 polygon[4];
+		glm::vec3 polygonBary[4];
+		const glm::vec3 corners[3] = { glm::vec3(1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, 0, 1) };
+		int count = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			int j = (i + 1) % 3;
+			const glm::vec4& a = clip[i];
+			const glm::vec4& b = clip[j];
+			float da = a.z + a.w;
+			float db = b.z + b.w;
+			if (da >= 0.0f)
+			{
+				polygonBary[count] = corners[i];
+				polygon[count++] = a;
+			}
+			if ((da >= 0.0f) != (db >= 0.0f))
+			{
+				float t = da / (da - db);
+				polygonBary[count] = corners[i] + (corners[j] - corners[i]) * t;
+				polygon[count++] = a + (b - a) * t;
+			}
+		}
+
+		for (int i = 2; i < count; i++)
+		{
+			RasterTriangle tri;
+			tri.mesh = mesh;
+			tri.primitive = primitive;
+			tri.bary[0] = polygonBary[0];
+			tri.bary[1] = polygonBary[i - 1];
+			tri.bary[2] = polygonBary[i];
+			setupClipped(polygon[0], polygon[i - 1], polygon[i], tri, out);
+		}
+	}
+
+	void setupClipped(const glm::vec4& c0, const glm::vec4& c1, const glm::vec4& c2, RasterTriangle& tri, std::vector<RasterTriangle>& out)
+	{
+		// To window coordinates, the same way glViewport and glDepthRange(0, 1) do it.
+		glm::vec3 w[3];
+		const glm::vec4* c[3] = { &c0, &c1, &c2 };
+		for (int i = 0; i < 3; i++)
+		{
+			tri.invW[i] = 1.0f / c[i]->w;
+			w[i] = glm::vec3((c[i]->x * tri.invW[i] * 0.5f + 0.5f) * width,
+							(c[i]->y * tri.invW[i] * 0.5f + 0.5f) * height,
+							c[i]->z * tri.invW[i] * 0.5f + 0.5f);
+		}
+
+		// Twice the signed area. Positive means counter-clockwise on screen, which is a back face with glFrontFace(GL_CW).
+		float area = (w[1].x - w[0].x) * (w[2].y - w[0].y) - (w[2].x - w[0].x) * (w[1].y - w[0].y);
+		if (area == 0.0f)
+			return;
+		if ((cullFace == GL_FRONT && area < 0.0f) || (cullFace == GL_BACK && area > 0.0f))
+			return;
+		// The edge functions below expect counter-clockwise corners.
+		if (area < 0.0f)
+		{
+			std::swap(w[1], w[2]);
+			std::swap(tri.invW[1], tri.invW[2]);
+			std::swap(tri.bary[1], tri.bary[2]);
+			area = -area;
+		}
+		tri.invArea = 1.0f / area;
+
+		tri.minX = std::max(0, (int)floor(std::min(w[0].x, std::min(w[1].x, w[2].x))));
+		tri.minY = std::max(0, (int)floor(std::min(w[0].y, std::min(w[1].y, w[2].y))));
+		tri.maxX = std::min(width - 1, (int)ceil(std::max(w[0].x, std::max(w[1].x, w[2].x))));
+		tri.maxY = std::min(height - 1, (int)ceil(std::max(w[0].y, std::max(w[1].y, w[2].y))));
+		if (tri.minX > tri.maxX || tri.minY > tri.maxY)
+			return;
+
+		for (int i = 0; i < 3; i++)
+		{
+			const glm::vec3& a = w[i];
+			const glm::vec3& b = w[(i + 1) % 3];
+			tri.edgeA[i] = a.y - b.y;
+			tri.edgeB[i] = b.x - a.x;
+			tri.edgeC[i] = -(tri.edgeA[i] * a.x + tri.edgeB[i] * a.y);
+		}
+
+		float dzdx = ((w[1].z - w[0].z) * (w[2].y - w[0].y) - (w[2].z - w[0].z) * (w[1].y - w[0].y)) / area;
+		float dzdy = ((w[2].z - w[0].z) * (w[1].x - w[0].x) - (w[1].z - w[0].z) * (w[2].x - w[0].x)) / area;
+		tri.zA = dzdx;
+		tri.zB = dzdy;
+		tri.zC = w[0].z - dzdx * w[0].x - dzdy * w[0].y;
+
+		// glPolygonOffset: factor * the steepest depth slope + units * the smallest resolvable depth difference.
+		// That last value is up to the driver. We use 2^-24, which is what a 24 bit depth buffer has.
+		tri.offset = offsetFactor * std::max(fabs(dzdx), fabs(dzdy)) + offsetUnits * (1.0f / 16777216.0f);
+
+		out.push_back(tri);
+	}
+
+	// Fills the part of the triangle that is inside the tile. Pixels are sampled at their centers.
+	// Pixels exactly on an edge shared by two triangles get drawn by both; for depth only, that makes no difference.
+	// Every pixel that passes the depth test is handed to visit, with the edge functions e1 and e2 of that pixel.
+	// e1 * invArea is the weight of corner 0, and e2 * invArea the weight of corner 1.
+	template <class Visitor>
+	void rasterizeInTile(const RasterTriangle& tri, int tileX, int tileY, Visitor& visit, long long& covered, long long& written)
+	{
+		int x0 = std::max(tileX, tri.minX) & ~3;		// Start on a multiple of 4, so the 4 pixels are in the same tile
+		int x1 = std::min(tileX + RASTER_TILE_SIZE - 1, tri.maxX);
+		int y0 = std::max(tileY, tri.minY);
+		int y1 = std::min(tileY + RASTER_TILE_SIZE - 1, tri.maxY);
+		if (x0 > x1 || y0 > y1)
+			return;
+
+#ifdef RASTER_SSE
+		static const int bitCount[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+		__m128 zero = _mm_setzero_ps();
+		__m128 one = _mm_set1_ps(1.0f);
+		__m128 offset = _mm_set1_ps(tri.offset);
+		__m128 startX = _mm_add_ps(_mm_set1_ps((float)x0), _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f));
+
+		__m128 a0 = _mm_set1_ps(tri.edgeA[0]), a1 = _mm_set1_ps(tri.edgeA[1]), a2 = _mm_set1_ps(tri.edgeA[2]);
+		__m128 za = _mm_set1_ps(tri.zA);
+		__m128 step0 = _mm_set1_ps(tri.edgeA[0] * 4.0f);
+		__m128 step1 = _mm_set1_ps(tri.edgeA[1] * 4.0f);
+		__m128 step2 = _mm_set1_ps(tri.edgeA[2] * 4.0f);
+		__m128 zStep = _mm_set1_ps(tri.zA * 4.0f);
+
+		for (int y = y0; y <= y1; y++)
+		{
+			float py = y + 0.5f;
+			__m128 e0 = _mm_add_ps(_mm_mul_ps(a0, startX), _mm_set1_ps(tri.edgeB[0] * py + tri.edgeC[0]));
+			__m128 e1 = _mm_add_ps(_mm_mul_ps(a1, startX), _mm_set1_ps(tri.edgeB[1] * py + tri.edgeC[1]));
+			__m128 e2 = _mm_add_ps(_mm_mul_ps(a2, startX), _mm_set1_ps(tri.edgeB[2] * py + tri.edgeC[2]));
+			__m128 z = _mm_add_ps(_mm_mul_ps(za, startX), _mm_set1_ps(tri.zB * py + tri.zC));
+			float* row = &depth[y * stride];
+
+			for (int x = x0; x <= x1; x += 4)
+			{
+				// Inside all three edges, and not behind the far plane.
+				__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)),
+										   _mm_and_ps(_mm_cmpge_ps(e2, zero), _mm_cmple_ps(z, one)));
+				int insideMask = _mm_movemask_ps(inside);
+				if (insideMask != 0)
+				{
+					__m128 stored = _mm_loadu_ps(row + x);
+					__m128 newDepth = _mm_min_ps(_mm_max_ps(_mm_add_ps(z, offset), zero), one);
+					__m128 pass = _mm_and_ps(inside, _mm_cmplt_ps(newDepth, stored));
+					_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(pass, newDepth), _mm_andnot_ps(pass, stored)));
+
+					int passMask = _mm_movemask_ps(pass);
+					covered += bitCount[insideMask];
+					written += bitCount[passMask];
+
+					if (Visitor::enabled && passMask != 0)
+					{
+						float lane1[4], lane2[4];
+						_mm_storeu_ps(lane1, e1);
+						_mm_storeu_ps(lane2, e2);
+						for (int lane = 0; lane < 4; lane++)
+						{
+							if (passMask & (1 << lane))
+								visit(tri, x + lane, y, lane1[lane], lane2[lane]);
+						}
+					}
+				}
+
+				e0 = _mm_add_ps(e0, step0);
+				e1 = _mm_add_ps(e1, step1);
+				e2 = _mm_add_ps(e2, step2);
+				z = _mm_add_ps(z, zStep);
+			}
+		}
+#else
+		for (int y = y0; y <= y1; y++)
+		{
+			float py = y + 0.5f;
+			float* row = &depth[y * stride];
+			for (int x = x0; x <= x1; x++)
+			{
+				float px = x + 0.5f;
+				float e0 = tri.edgeA[0] * px + tri.edgeB[0] * py + tri.edgeC[0];
+				float e1 = tri.edgeA[1] * px + tri.edgeB[1] * py + tri.edgeC[1];
+				float e2 = tri.edgeA[2] * px + tri.edgeB[2] * py + tri.edgeC[2];
+				float z = tri.zA * px + tri.zB * py + tri.zC;
+				if (e0 < 0.0f || e1 < 0.0f || e2 < 0.0f || z > 1.0f)
+					continue;
+
+				covered++;
+				float newDepth = std::min(std::max(z + tri.offset, 0.0f), 1.0f);
+				if (newDepth < row[x])
+				{
+					row[x] = newDepth;
+					written++;
+					if (Visitor::enabled)
+						visit(tri, x, y, e1, e2);
+				}
+			}
+		}
+#endif
+	}
+
+}cpuRasterizer;		// The shadow map
+
+#endif _CPU_RASTERIZER_H
@@ -0,0 +1,258 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: CPURenderer.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+The second draw pass on the CPU, so a whole frame can be rendered on a machine
+without a GPU. Together with the CPU rasterizer for the shadow map, it does what
+secondDrawPass() and the light shaders do, and writes the frame to an image file.
+
+The screen is split into the same 32x32 tiles the rasterizer uses, and the tiles
+are handed to the thread pool, which balances them between the threads by work
+stealing. Each tile is done in two steps:
+First all the triangles in the tile are rasterized with the depth test. For each
+pixel we only remember the triangle that ended up in front, and where in it the
+pixel is.
+Then every covered pixel is shaded once: its attributes are interpolated (with
+perspective correction, like the GPU does), and the shadow coordinates of the
+whole tile are run through one of the SIMD shadow filters together. The final
+color is the same diffuse plus ambient as in LightFragShader.glsl.
+*/
+
+#ifndef _CPU_RENDERER_H
+#define _CPU_RENDERER_H
+
+#include "GLIncludes.h"
+#include "CPURasterizer.h"
+#include "CPUShadowFilters.h"
+
+// One object in the camera pass, with the same matrices secondDrawPass() sends as uniforms.
+struct CPUDrawCall
+{
+	const VertexFormat* vertices;
+	int numberOfVertices;
+	glm::mat4 MVP;
+	glm::mat4 ModelView;
+	glm::mat3 NormalMatrix;
+	glm::mat4 ShadowMatrix;
+};
+
+// The triangle that is in front in a pixel, and the pixel's edge functions for it.
+struct PixelRecord
+{
+	const RasterTriangle* tri;
+	float e1, e2;
+};
+
+// Keeps the front-most triangle of every pixel in the tile.
+struct RecordPixels
+{
+	static const bool enabled = true;
+	PixelRecord* records;
+	int tileX, tileY;
+
+	void operator()(const RasterTriangle& tri, int x, int y, float e1, float e2)
+	{
+		PixelRecord& record = records[(y - tileY) * RASTER_TILE_SIZE + (x - tileX)];
+		record.tri = &tri;
+		record.e1 = e1;
+		record.e2 = e2;
+	}
+};
+
+struct CPURenderer
+{
+	int width, height;
+	CPURasterizer camera;
+
+	// The frame, 3 bytes per pixel with the bottom row first.
+	std::vector<unsigned char> color;
+	glm::vec3 clearColor;
+	// The shadow value of every pixel, -1 where nothing was drawn. Used to compare the filters.
+	std::vector<float> shadowValues;
+
+	glm::vec3 lightPosition;
+	glm::vec3 lightIntensity;
+
+	// 0 basic, 1 PCF, 2 random sampling. The temporal filter needs the frames before, so it is drawn as random sampling.
+	int filter;
+	ShadowDepthImage shadowMap;
+	RandomSamplingParams randomSampling;
+
+	double seconds;
+	long long pixelsShaded;
+
+	void init(int w, int h)
+	{
+		width = w;
+		height = h;
+		camera.init(w, h);
+		camera.cullFace = GL_BACK;			// What secondDrawPass() uses
+		color.assign(w * h * 3, 0);
+		shadowValues.assign(w * h, -1.0f);
+		clearColor = glm::vec3(1.0f);		// Same as glClearColor in renderScene()
+		filter = 0;
+	}
+
+	// diffuseModel() from LightFragShader.glsl.
+	// The shader is given the light's world position and compares it with positions in view space. We do the same,
+	// so the two images match.
+	glm::vec3 diffuseModel(const glm::vec3& pos, const glm::vec3& norm, const glm::vec3& diff)
+	{
+		glm::vec3 s = glm::normalize(lightPosition - pos);
+		float nDotL = std::max(glm::dot(s, norm), 0.0f);
+		return lightIntensity * (diff * nDotL);
+	}
+
+	void render(const std::vector<CPUDrawCall>& drawCalls)
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+
+		std::vector<RasterMesh> meshes(drawCalls.size());
+		for (unsigned int i = 0; i < drawCalls.size(); i++)
+		{
+			meshes[i].vertices = drawCalls[i].vertices;
+			meshes[i].numberOfVertices = drawCalls[i].numberOfVertices;
+			meshes[i].MVP = drawCalls[i].MVP;
+		}
+		camera.binTriangles(meshes);
+
+		std::atomic<long long> shaded(0);
+		threadPool.parallelFor(camera.tilesX * camera.tilesY, [&](int tile)
+		{
+			shaded += renderTile(tile, drawCalls);
+		});
+
+		pixelsShaded = shaded;
+		seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+	}
+
+	// Returns the number of pixels shaded.
+	int renderTile(int tile, const std::vector<CPUDrawCall>& drawCalls)
+	{
+		PixelRecord records[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+		for (int i = 0; i < RASTER_TILE_SIZE * RASTER_TILE_SIZE; i++)
+			records[i].tri = nullptr;
+
+		RecordPixels visit;
+		visit.records = records;
+		visit.tileX = (tile % camera.tilesX) * RASTER_TILE_SIZE;
+		visit.tileY = (tile / camera.tilesX) * RASTER_TILE_SIZE;
+
+		long long covered = 0, written = 0;
+		camera.rasterizeTile(tile, visit, covered, written);
+
+		// Interpolate the attributes of every covered pixel. These are the outputs of LightVertexShader.glsl.
+		ShadowQueries queries;
+		queries.resize(RASTER_TILE_SIZE * RASTER_TILE_SIZE);
+		glm::vec3 position[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+		glm::vec3 normal[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+		glm::vec3 albedo[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+		int pixel[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+		int count = 0;
+
+		for (int i = 0; i < RASTER_TILE_SIZE * RASTER_TILE_SIZE; i++)
+		{
+			const RasterTriangle* tri = records[i].tri;
+			if (tri == nullptr)
+				continue;
+
+			// The weights on screen, corrected for perspective by dividing by w.
+			float l0 = records[i].e1 * tri->invArea * tri->invW[0];
+			float l1 = records[i].e2 * tri->invArea * tri->invW[1];
+			float l2 = (1.0f - records[i].e1 * tri->invArea - records[i].e2 * tri->invArea) * tri->invW[2];
+			float sum = l0 + l1 + l2;
+			glm::vec3 b = (tri->bary[0] * l0 + tri->bary[1] * l1 + tri->bary[2] * l2) / sum;
+
+			// Everything the vertex shader outputs is a linear function of the vertex, so we can
+			// interpolate the vertex and run the vertex shader on the result.
+			const CPUDrawCall& draw = drawCalls[tri->mesh];
+			const VertexFormat* v = draw.vertices + tri->primitive * 3;
+			glm::vec4 p = glm::vec4(v[0].position * b.x + v[1].position * b.y + v[2].position * b.z, 1.0f);
+			glm::vec3 n = v[0].normal * b.x + v[1].normal * b.y + v[2].normal * b.z;
+			glm::vec4 c = v[0].color * b.x + v[1].color * b.y + v[2].color * b.z;
+
+			int x = visit.tileX + i % RASTER_TILE_SIZE;
+			int y = visit.tileY + i / RASTER_TILE_SIZE;
+
+			position[count] = glm::vec3(draw.ModelView * p);
+			normal[count] = draw.NormalMatrix * n;
+			albedo[count] = glm::vec3(c);
+			queries.set(count, draw.ShadowMatrix * p, x, y);
+			pixel[count] = i;
+			count++;
+		}
+
+		// All the shadow lookups of the tile in one go.
+		float shadow[RASTER_TILE_SIZE * RASTER_TILE_SIZE];
+		if (filter == 1)
+			PCFshadowCPU(shadowMap, queries, 0, count, shadow);
+		else if (filter >= 2)
+			randomSamplingShadowCPU(shadowMap, randomSampling, queries, 0, count, shadow);
+		else
+			basicShadowCPU(shadowMap, queries, 0, count, shadow);
+
+		// Clear the tile, then write the shaded pixels.
+		for (int i = 0; i < RASTER_TILE_SIZE * RASTER_TILE_SIZE; i++)
+			writePixel(visit.tileX + i % RASTER_TILE_SIZE, visit.tileY + i / RASTER_TILE_SIZE, clearColor, -1.0f);
+
+		for (int k = 0; k < count; k++)
+		{
+			glm::vec3 ambient = albedo[k] * 0.2f;
+			glm::vec3 result = diffuseModel(position[k], normal[k], albedo[k]) * shadow[k] + ambient;
+			writePixel(visit.tileX + pixel[k] % RASTER_TILE_SIZE, visit.tileY + pixel[k] / RASTER_TILE_SIZE, result, shadow[k]);
+		}
+
+		return count;
+	}
+
+	// Clamps to [0, 1] and stores the color as bytes, like a normal 8 bit framebuffer.
+	void writePixel(int x, int y, const glm::vec3& value, float shadow)
+	{
+		if (x >= width || y >= height)
+			return;
+		shadowValues[y * width + x] = shadow;
+		unsigned char* out = &color[(y * width + x) * 3];
+		for (int i = 0; i < 3; i++)
+			out[i] = (unsigned char)(std::min(std::max(value[i], 0.0f), 1.0f) * 255.0f + 0.5f);
+	}
+
+	// Writes the frame as a binary PPM, which almost every image viewer can open.
+	bool writePPM(const char* fileName)
+	{
+		std::ofstream file(fileName, std::ios::binary);
+		if (!file.good())
+		{
+			std::cout << "Could not write " << fileName << "\n";
+			return false;
+		}
+
+		file << "P6\n" << width << " " << height << "\n255\n";
+		// PPM starts with the top row.
+		for (int y = height - 1; y >= 0; y--)
+			file.write((const char*)&color[y * width * 3], width * 3);
+		return true;
+	}
+
+}cpuRenderer;
+
+#endif _CPU_RENDERER_H
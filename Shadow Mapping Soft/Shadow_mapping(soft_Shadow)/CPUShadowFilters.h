@@ -0,0 +1,344 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: CPUShadowFilters.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+The three shadow filters from LightFragShader.glsl (basicShadow, PCFshadow and
+randomSamplingShadow), written in C++ so they can run without a GPU.
+
+The important part is doing what the texture unit does for textureProj() on a
+sampler2DShadow, with linear filtering and GL_COMPARE_REF_TO_TEXTURE:
+divide the coordinate by w, find the 4 texels around it, compare the depth with
+each of them (GL_LESS: 1 if the depth is less than the texel, 0 if not), and then
+blend the 4 results bilinearly. Texels outside the texture return the border
+depth, which is 1.0. Note that the results are blended, not the depths, which is
+why even the basic shadow has a soft edge one texel wide.
+
+There are two versions of each filter. The reference version handles one
+fragment at a time and is written to read like the shader. The other version
+handles 4 fragments at once with SSE and is the one to use for real work.
+The fragments are stored as a structure of arrays, so 4 of them can be loaded
+at once. Only the texel reads are done one by one, since SSE can't gather.
+*/
+
+#ifndef _CPU_SHADOW_FILTERS_H
+#define _CPU_SHADOW_FILTERS_H
+
+#include "GLIncludes.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define SHADOW_FILTERS_SSE
+#include <emmintrin.h>
+#endif
+
+// The shadow map, as it comes from the CPU rasterizer or from glGetTexImage.
+struct ShadowDepthImage
+{
+	const float* depth;		// Bottom row first
+	int width, height;
+	int stride;				// Floats per row
+
+	// A texel, or the border depth if it is outside the texture (GL_CLAMP_TO_BORDER with a border of 1.0).
+	float fetch(int x, int y) const
+	{
+		if (x < 0 || y < 0 || x >= width || y >= height)
+			return 1.0f;
+		return depth[y * stride + x];
+	}
+};
+
+// What randomSamplingShadow reads from its uniforms and the offset texture.
+struct RandomSamplingParams
+{
+	const float* offsets;	// The offset texture data, 4 floats per texel
+	int size;				// Width and height of the offset texture
+	int samplesDiv2;		// Number of slices used, same as OffsetTexsize.z
+	float radius;			// Same as KernelRadius in the shader
+};
+
+// The fragments to shade. One entry per fragment, with each value in its own array.
+struct ShadowQueries
+{
+	std::vector<float> x, y, z, w;			// ShadowCoord
+	std::vector<int> pixelX, pixelY;		// gl_FragCoord, which picks the offsets in randomSamplingShadow
+
+	void resize(int n)
+	{
+		x.resize(n);
+		y.resize(n);
+		z.resize(n);
+		w.resize(n);
+		pixelX.resize(n);
+		pixelY.resize(n);
+	}
+
+	int size() const
+	{
+		return (int)x.size();
+	}
+
+	void set(int i, const glm::vec4& shadowCoord, int px, int py)
+	{
+		x[i] = shadowCoord.x;
+		y[i] = shadowCoord.y;
+		z[i] = shadowCoord.z;
+		w[i] = shadowCoord.w;
+		pixelX[i] = px;
+		pixelY[i] = py;
+	}
+};
+
+#pragma region Reference
+
+// textureProj(ShadowMap, coord), or textureProjOffset() if an offset is given.
+inline float textureProjCPU(const ShadowDepthImage& image, const glm::vec4& coord, int offsetX = 0, int offsetY = 0)
+{
+	// A DEPTH_COMPONENT32 texture holds values between 0 and 1, so the depth we compare with is clamped to that too.
+	float ref = std::min(std::max(coord.z / coord.w, 0.0f), 1.0f);
+
+	// Texel centers are at +0.5, so we subtract that to find the texel to the bottom left.
+	float u = coord.x / coord.w * image.width - 0.5f + offsetX;
+	float v = coord.y / coord.w * image.height - 0.5f + offsetY;
+	float u0 = floor(u);
+	float v0 = floor(v);
+	float fu = u - u0;
+	float fv = v - v0;
+	int x = (int)u0;
+	int y = (int)v0;
+
+	float c00 = ref < image.fetch(x, y) ? 1.0f : 0.0f;
+	float c10 = ref < image.fetch(x + 1, y) ? 1.0f : 0.0f;
+	float c01 = ref < image.fetch(x, y + 1) ? 1.0f : 0.0f;
+	float c11 = ref < image.fetch(x + 1, y + 1) ? 1.0f : 0.0f;
+
+	return glm::mix(glm::mix(c00, c10, fu), glm::mix(c01, c11, fu), fv);
+}
+
+inline float basicShadowReference(const ShadowDepthImage& image, const glm::vec4& shadowCoord)
+{
+	return textureProjCPU(image, shadowCoord);
+}
+
+inline float PCFshadowReference(const ShadowDepthImage& image, const glm::vec4& shadowCoord)
+{
+	float sum = 0;
+
+	sum += textureProjCPU(image, shadowCoord, -1, -1);
+	sum += textureProjCPU(image, shadowCoord, 1, -1);
+	sum += textureProjCPU(image, shadowCoord, -1, 1);
+	sum += textureProjCPU(image, shadowCoord, 1, 1);
+
+	return sum * 0.25f;
+}
+
+inline float randomSamplingShadowReference(const ShadowDepthImage& image, const RandomSamplingParams& params, const glm::vec4& shadowCoord, int pixelX, int pixelY)
+{
+	// mod(gl_FragCoord.xy, OffsetTexsize.xy), where gl_FragCoord is the center of the pixel
+	int offsetX = pixelX % params.size;
+	int offsetY = pixelY % params.size;
+
+	// The shader takes 4 slices first to test for an early exit, but its test (shadow == 1 && shadow == 0)
+	// is never true, so it always ends up taking all of them. We do the same, to give the same result.
+	float sum = 0;
+	glm::vec4 sc = shadowCoord;
+	for (int i = 0; i < params.samplesDiv2; i++)
+	{
+		const float* texel = params.offsets + ((i * params.size + offsetY) * params.size + offsetX) * 4;
+		glm::vec4 offsets = glm::vec4(texel[0], texel[1], texel[2], texel[3]) * params.radius * shadowCoord.w;
+
+		sc.x = shadowCoord.x + offsets.x;
+		sc.y = shadowCoord.y + offsets.y;
+		sum += textureProjCPU(image, sc);
+		sc.x = shadowCoord.x + offsets.z;
+		sc.y = shadowCoord.y + offsets.w;
+		sum += textureProjCPU(image, sc);
+	}
+
+	return sum / float(params.samplesDiv2 * 2.0f);
+}
+
+#pragma endregion Reference
+
+#pragma region SIMD
+
+#ifdef SHADOW_FILTERS_SSE
+
+// Loads 4 values starting at i. Past the end, the last value is repeated, so the lanes hold something valid.
+inline __m128 loadQueries(const std::vector<float>& values, int i, int end)
+{
+	if (i + 4 <= end)
+		return _mm_loadu_ps(&values[i]);
+	float padded[4];
+	for (int lane = 0; lane < 4; lane++)
+		padded[lane] = values[std::min(i + lane, end - 1)];
+	return _mm_loadu_ps(padded);
+}
+
+inline void storeResults(float* out, int i, int end, __m128 result)
+{
+	if (i + 4 <= end)
+	{
+		_mm_storeu_ps(out + i, result);
+		return;
+	}
+	float padded[4];
+	_mm_storeu_ps(padded, result);
+	for (int lane = 0; i + lane < end; lane++)
+		out[i + lane] = padded[lane];
+}
+
+// textureProj for 4 fragments. s, t and ref have already been divided by w.
+inline __m128 textureProjSSE(const ShadowDepthImage& image, __m128 s, __m128 t, __m128 ref, float offsetX, float offsetY)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+
+	__m128 u = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(s, _mm_set1_ps((float)image.width)), half), _mm_set1_ps(offsetX));
+	__m128 v = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps((float)image.height)), half), _mm_set1_ps(offsetY));
+
+	// SSE2 has no floor, so we truncate and step down by one where that rounded up (the negative values).
+	__m128 u0 = _mm_cvtepi32_ps(_mm_cvttps_epi32(u));
+	__m128 v0 = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+	u0 = _mm_sub_ps(u0, _mm_and_ps(_mm_cmpgt_ps(u0, u), one));
+	v0 = _mm_sub_ps(v0, _mm_and_ps(_mm_cmpgt_ps(v0, v), one));
+	__m128 fu = _mm_sub_ps(u, u0);
+	__m128 fv = _mm_sub_ps(v, v0);
+
+	int x[4], y[4];
+	_mm_storeu_si128((__m128i*)x, _mm_cvttps_epi32(u0));
+	_mm_storeu_si128((__m128i*)y, _mm_cvttps_epi32(v0));
+
+	float t00[4], t10[4], t01[4], t11[4];
+	for (int lane = 0; lane < 4; lane++)
+	{
+		t00[lane] = image.fetch(x[lane], y[lane]);
+		t10[lane] = image.fetch(x[lane] + 1, y[lane]);
+		t01[lane] = image.fetch(x[lane], y[lane] + 1);
+		t11[lane] = image.fetch(x[lane] + 1, y[lane] + 1);
+	}
+
+	__m128 c00 = _mm_and_ps(_mm_cmplt_ps(ref, _mm_loadu_ps(t00)), one);
+	__m128 c10 = _mm_and_ps(_mm_cmplt_ps(ref, _mm_loadu_ps(t10)), one);
+	__m128 c01 = _mm_and_ps(_mm_cmplt_ps(ref, _mm_loadu_ps(t01)), one);
+	__m128 c11 = _mm_and_ps(_mm_cmplt_ps(ref, _mm_loadu_ps(t11)), one);
+
+	// mix(a, b, f) = a + (b - a) * f
+	__m128 bottom = _mm_add_ps(c00, _mm_mul_ps(_mm_sub_ps(c10, c00), fu));
+	__m128 top = _mm_add_ps(c01, _mm_mul_ps(_mm_sub_ps(c11, c01), fu));
+	return _mm_add_ps(bottom, _mm_mul_ps(_mm_sub_ps(top, bottom), fv));
+}
+
+// The divide by w and the clamp of the depth, which are the same for every tap.
+inline void projectQueries(const ShadowQueries& q, int i, int end, __m128& s, __m128& t, __m128& ref, __m128& w)
+{
+	w = loadQueries(q.w, i, end);
+	__m128 invW = _mm_div_ps(_mm_set1_ps(1.0f), w);
+	s = _mm_mul_ps(loadQueries(q.x, i, end), invW);
+	t = _mm_mul_ps(loadQueries(q.y, i, end), invW);
+	ref = _mm_mul_ps(loadQueries(q.z, i, end), invW);
+	ref = _mm_min_ps(_mm_max_ps(ref, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+}
+
+#endif
+
+// Shades the fragments from first to first + count - 1, and writes the results to out at the same index.
+inline void basicShadowCPU(const ShadowDepthImage& image, const ShadowQueries& q, int first, int count, float* out)
+{
+	int end = first + count;
+#ifdef SHADOW_FILTERS_SSE
+	for (int i = first; i < end; i += 4)
+	{
+		__m128 s, t, ref, w;
+		projectQueries(q, i, end, s, t, ref, w);
+		storeResults(out, i, end, textureProjSSE(image, s, t, ref, 0.0f, 0.0f));
+	}
+#else
+	for (int i = first; i < end; i++)
+		out[i] = basicShadowReference(image, glm::vec4(q.x[i], q.y[i], q.z[i], q.w[i]));
+#endif
+}
+
+inline void PCFshadowCPU(const ShadowDepthImage& image, const ShadowQueries& q, int first, int count, float* out)
+{
+	int end = first + count;
+#ifdef SHADOW_FILTERS_SSE
+	for (int i = first; i < end; i += 4)
+	{
+		__m128 s, t, ref, w;
+		projectQueries(q, i, end, s, t, ref, w);
+		__m128 sum = textureProjSSE(image, s, t, ref, -1.0f, -1.0f);
+		sum = _mm_add_ps(sum, textureProjSSE(image, s, t, ref, 1.0f, -1.0f));
+		sum = _mm_add_ps(sum, textureProjSSE(image, s, t, ref, -1.0f, 1.0f));
+		sum = _mm_add_ps(sum, textureProjSSE(image, s, t, ref, 1.0f, 1.0f));
+		storeResults(out, i, end, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+	}
+#else
+	for (int i = first; i < end; i++)
+		out[i] = PCFshadowReference(image, glm::vec4(q.x[i], q.y[i], q.z[i], q.w[i]));
+#endif
+}
+
+inline void randomSamplingShadowCPU(const ShadowDepthImage& image, const RandomSamplingParams& params, const ShadowQueries& q, int first, int count, float* out)
+{
+	int end = first + count;
+#ifdef SHADOW_FILTERS_SSE
+	__m128 radius = _mm_set1_ps(params.radius);
+	for (int i = first; i < end; i += 4)
+	{
+		__m128 s, t, ref, w;
+		projectQueries(q, i, end, s, t, ref, w);
+
+		// Each fragment reads its offsets from a different texel of the offset texture.
+		int cell[4];
+		for (int lane = 0; lane < 4; lane++)
+		{
+			int j = std::min(i + lane, end - 1);
+			cell[lane] = (q.pixelY[j] % params.size) * params.size + (q.pixelX[j] % params.size);
+		}
+
+		__m128 sum = _mm_setzero_ps();
+		for (int slice = 0; slice < params.samplesDiv2; slice++)
+		{
+			// Transpose the 4 offset texels so each component is in its own register.
+			const float* base = params.offsets + slice * params.size * params.size * 4;
+			__m128 o0 = _mm_loadu_ps(base + cell[0] * 4);
+			__m128 o1 = _mm_loadu_ps(base + cell[1] * 4);
+			__m128 o2 = _mm_loadu_ps(base + cell[2] * 4);
+			__m128 o3 = _mm_loadu_ps(base + cell[3] * 4);
+			_MM_TRANSPOSE4_PS(o0, o1, o2, o3);
+
+			// The shader adds offset * radius * w and then divides by w, so we can skip the w.
+			sum = _mm_add_ps(sum, textureProjSSE(image, _mm_add_ps(s, _mm_mul_ps(o0, radius)), _mm_add_ps(t, _mm_mul_ps(o1, radius)), ref, 0.0f, 0.0f));
+			sum = _mm_add_ps(sum, textureProjSSE(image, _mm_add_ps(s, _mm_mul_ps(o2, radius)), _mm_add_ps(t, _mm_mul_ps(o3, radius)), ref, 0.0f, 0.0f));
+		}
+
+		storeResults(out, i, end, _mm_div_ps(sum, _mm_set1_ps(float(params.samplesDiv2 * 2))));
+	}
+#else
+	for (int i = first; i < end; i++)
+		out[i] = randomSamplingShadowReference(image, params, glm::vec4(q.x[i], q.y[i], q.z[i], q.w[i]), q.pixelX[i], q.pixelY[i]);
+#endif
+}
+
+#pragma endregion SIMD
+
+#endif _CPU_SHADOW_FILTERS_H
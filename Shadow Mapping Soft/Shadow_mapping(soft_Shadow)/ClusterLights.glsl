@@ -0,0 +1,119 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: ClusterLights.glsl
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+Sorts the lights into the clusters of the view volume (see ClusteredLights.h).
+Every invocation is one cluster. It works out the cluster's box in view space,
+tests the sphere of every light against it, and writes the indices of the lights
+that touch it into the cluster's list.
+All the invocations of a group need every light, so the group loads them into
+shared memory 64 at a time, each invocation one light, and then all of them test
+that batch.
+*/
+
+#version 430 core
+
+// Match ClusteredLights.h.
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 16
+#define CLUSTERS_Z 24
+#define CLUSTER_COUNT (CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z)
+#define MAX_LIGHTS_PER_CLUSTER 128
+#define CLUSTER_NEAR 0.1f
+#define CLUSTER_FAR 100.0f
+
+layout(local_size_x = 64) in;
+
+struct ClusterLight
+{
+	vec4 PositionRange;
+	vec4 ColorShadow;
+	vec4 DirectionCos;
+};
+
+layout(std430, binding = 0) readonly buffer LightBuffer
+{
+	ClusterLight Lights[];
+};
+
+layout(std430, binding = 1) writeonly buffer ClusterCountBuffer
+{
+	uint ClusterCounts[];
+};
+
+layout(std430, binding = 2) writeonly buffer ClusterIndexBuffer
+{
+	uint ClusterIndices[];
+};
+
+layout(location = 0) uniform int LightCount;
+layout(location = 1) uniform float ProjectionX;		// [0][0] and [1][1] of the camera's projection
+layout(location = 2) uniform float ProjectionY;
+
+shared vec4 batch[64];
+
+void main()
+{
+	uint cluster = gl_GlobalInvocationID.x;
+	bool active = cluster < CLUSTER_COUNT;
+	uvec3 cell = uvec3(cluster % CLUSTERS_X, (cluster / CLUSTERS_X) % CLUSTERS_Y, cluster / (CLUSTERS_X * CLUSTERS_Y));
+
+	// The slice's depths, evenly spaced in log(depth).
+	float sliceNear = CLUSTER_NEAR * pow(CLUSTER_FAR / CLUSTER_NEAR, float(cell.z) / CLUSTERS_Z);
+	float sliceFar = CLUSTER_NEAR * pow(CLUSTER_FAR / CLUSTER_NEAR, float(cell.z + 1) / CLUSTERS_Z);
+
+	// A point at depth d that lands on ndc on the screen is at ndc / projection * d in view space.
+	vec2 projection = vec2(ProjectionX, ProjectionY);
+	vec2 low = (vec2(cell.xy) / vec2(CLUSTERS_X, CLUSTERS_Y) * 2.0f - 1.0f) / projection;
+	vec2 high = (vec2(cell.xy + 1) / vec2(CLUSTERS_X, CLUSTERS_Y) * 2.0f - 1.0f) / projection;
+	vec2 cornerMin = min(min(low * sliceNear, low * sliceFar), min(high * sliceNear, high * sliceFar));
+	vec2 cornerMax = max(max(low * sliceNear, low * sliceFar), max(high * sliceNear, high * sliceFar));
+	vec3 boxMin = vec3(cornerMin, -sliceFar);
+	vec3 boxMax = vec3(cornerMax, -sliceNear);
+
+	uint count = 0;
+	for (int start = 0; start < LightCount; start += 64)
+	{
+		int load = start + int(gl_LocalInvocationIndex);
+		if (load < LightCount)
+			batch[gl_LocalInvocationIndex] = Lights[load].PositionRange;
+		barrier();
+
+		int batchSize = min(64, LightCount - start);
+		for (int j = 0; j < batchSize; j++)
+		{
+			// The distance from the center of the sphere to the closest point of the box.
+			vec4 light = batch[j];
+			vec3 gap = clamp(light.xyz, boxMin, boxMax) - light.xyz;
+			if (active && count < MAX_LIGHTS_PER_CLUSTER && dot(gap, gap) <= light.w * light.w)
+			{
+				ClusterIndices[cluster * MAX_LIGHTS_PER_CLUSTER + count] = uint(start + j);
+				count++;
+			}
+		}
+		barrier();
+	}
+
+	if (active)
+		ClusterCounts[cluster] = count;
+}
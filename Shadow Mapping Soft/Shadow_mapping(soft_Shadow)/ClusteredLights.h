@@ -0,0 +1,183 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: ClusteredLights.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+Lots of lights in the second pass, with the cost of a pixel depending on how many
+lights reach it rather than on how many there are in total.
+
+Looping over every light in every fragment costs the same for a pixel no light
+reaches as for one in the middle of all of them. So before the second pass, the
+lights are sorted into clusters: the view volume is cut into 16x16 tiles on the
+screen, and every tile into 24 slices along the depth. The slices get thicker
+further away (they are evenly spaced in log(depth)), so near and far clusters
+have about the same shape. A compute shader (ClusterLights.glsl) runs once per
+cluster, tests every light's sphere against the cluster's box in view space, and
+writes the indices of the ones that touch it into the cluster's list. The
+fragment shader finds its cluster from its pixel and depth, and only loops over
+that list.
+
+The lights themselves are put in view space on the update thread, and only the
+ones the camera can see at all, so the compute shader sees up to
+MAX_CLUSTER_LIGHTS of them. All the buffers have a fixed size. A cluster keeps at
+most MAX_LIGHTS_PER_CLUSTER lights, the rest are dropped.
+
+Shadows cost far more than the lighting, so only some lights have them: the spot
+lights that got a tile in the shadow atlas this frame (ShadowAtlas.h). How many
+of them can is the shadow budget (--shadow-budget), and it goes to the lights
+that cover the most of the screen. The other lights still light the scene, just
+without shadows. Every light in the list has the index of its atlas tile, or -1.
+*/
+
+#ifndef _CLUSTERED_LIGHTS_H
+#define _CLUSTERED_LIGHTS_H
+
+#include "GLIncludes.h"
+
+// Match the defines in ClusterLights.glsl and LightFragShader.glsl.
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 16
+#define CLUSTERS_Z 24
+#define CLUSTER_COUNT (CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z)
+#define MAX_CLUSTER_LIGHTS 1024
+#define MAX_LIGHTS_PER_CLUSTER 128
+// The depth range the slices cover. The same near and far planes as the camera.
+#define CLUSTER_NEAR 0.1f
+#define CLUSTER_FAR 100.0f
+// Shader storage buffer bindings.
+#define CLUSTER_LIGHT_BINDING 0
+#define CLUSTER_COUNT_BINDING 1
+#define CLUSTER_INDEX_BINDING 2
+
+// A light without a shadow map of its own.
+struct PointLightSource
+{
+	glm::vec3 position;
+	glm::vec3 color;
+	float range;
+};
+
+// One light in the std430 light buffer, in the camera's view space.
+struct ClusterLight
+{
+	glm::vec4 PositionRange;		// The range in w
+	glm::vec4 ColorShadow;			// The index of its atlas tile in w, -1 if it has none
+	glm::vec4 DirectionCos;			// Spot lights: where it points and the cosine of half its cone. w is -2 for a point light.
+};
+
+struct ClusteredLights
+{
+	GLuint lightBuffer;
+	GLuint countBuffer;				// The number of lights in every cluster
+	GLuint indexBuffer;				// MAX_LIGHTS_PER_CLUSTER light indices per cluster
+	GLuint program;					// Set to 0 by finishPrograms() if it fails to link
+
+	// Only the update thread uses this.
+	std::vector<PointLightSource> pointLights;
+
+	void init()
+	{
+		glGenBuffers(1, &lightBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(ClusterLight) * MAX_CLUSTER_LIGHTS, nullptr, GL_DYNAMIC_DRAW);
+
+		// Starts out with no lights anywhere, in case the first frame has none to bin.
+		std::vector<GLuint> zero(CLUSTER_COUNT, 0);
+		glGenBuffers(1, &countBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, countBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * CLUSTER_COUNT, &zero[0], GL_DYNAMIC_COPY);
+
+		glGenBuffers(1, &indexBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, indexBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * CLUSTER_COUNT * MAX_LIGHTS_PER_CLUSTER, nullptr, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+		// Checked in finishPrograms() with the others. Without it the clusters stay empty.
+		GLuint shader = submitShaderFile("ClusterLights.glsl", GL_COMPUTE_SHADER);
+		program = submitLinkedProgram("ClusterLights.glsl", &shader, 1, &program);
+		glDeleteShader(shader);		// Only flagged, the program keeps it alive as long as it needs it.
+	}
+
+	void release()
+	{
+		glDeleteProgram(program);
+		glDeleteBuffers(1, &lightBuffer);
+		glDeleteBuffers(1, &countBuffer);
+		glDeleteBuffers(1, &indexBuffer);
+		program = 0;
+	}
+
+	// Sorts the lights into the clusters and binds the buffers for the second pass.
+	// projection is the camera's projection matrix.
+	void build(const ClusterLight* lights, int count, const glm::mat4& projection)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHT_BINDING, lightBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_COUNT_BINDING, countBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_INDEX_BINDING, indexBuffer);
+		if (program == 0)
+			return;
+
+		if (count > 0)
+		{
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightBuffer);
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(ClusterLight) * count, lights);
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		}
+
+		glState.useProgram(program);
+		glState.uniform1i(0, count);
+		glState.uniform1f(1, projection[0][0]);
+		glState.uniform1f(2, projection[1][1]);
+		glDispatchCompute((CLUSTER_COUNT + 63) / 64, 1, 1);
+
+		// The second pass reads the lists.
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+
+	// Puts a light in view space for the light buffer.
+	static void pointLight(const PointLightSource& source, const glm::mat4& view, ClusterLight& out)
+	{
+		out.PositionRange = glm::vec4(glm::vec3(view * glm::vec4(source.position, 1.0f)), source.range);
+		out.ColorShadow = glm::vec4(source.color, -1.0f);
+		out.DirectionCos = glm::vec4(0.0f, 0.0f, 0.0f, -2.0f);
+	}
+
+	// The same for a spot light from the atlas. tile is the index of its tile this frame, -1 if it has none.
+	static void spotLight(const glm::vec3& position, const glm::vec3& target, const glm::vec3& color, float range, float fov,
+		int tile, const glm::mat4& view, ClusterLight& out)
+	{
+		glm::vec3 direction = glm::normalize(glm::vec3(view * glm::vec4(target - position, 0.0f)));
+		out.PositionRange = glm::vec4(glm::vec3(view * glm::vec4(position, 1.0f)), range);
+		out.ColorShadow = glm::vec4(color, (float)tile);
+		out.DirectionCos = glm::vec4(direction, cosf(fov * 0.5f));
+	}
+
+	// The number of clusters per pixel in x and y, and the slice of a view depth d is log(d) * z + w.
+	static glm::vec4 scale(int screenSize)
+	{
+		float slices = CLUSTERS_Z / logf(CLUSTER_FAR / CLUSTER_NEAR);
+		return glm::vec4((float)CLUSTERS_X / screenSize, (float)CLUSTERS_Y / screenSize, slices, -logf(CLUSTER_NEAR) * slices);
+	}
+
+}clusteredLights;
+
+#endif _CLUSTERED_LIGHTS_H
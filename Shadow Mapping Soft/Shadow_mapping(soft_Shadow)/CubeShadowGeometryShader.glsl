@@ -0,0 +1,78 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: CubeShadowGeometryShader.glsl
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+Draws every triangle into the faces of the cube shadow map it can be seen in, all
+in one pass (see CubeShadowMap.h). The shader is instanced six times, and
+instance f works on face f: it takes the triangle through the face's
+view-projection matrix and writes gl_Layer = f, which sends it to that face of the
+cube attached to the framebuffer.
+Most triangles are only in one face, so the instances throw away what they don't
+need as early as they can: first the whole object, if the update thread found
+that it isn't in the face, then the triangle, if all three corners are outside
+the same side of the face's frustum.
+*/
+
+#version 430 core
+
+layout(triangles, invocations = 6) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+layout(std140, binding = 3) uniform CubeBlock
+{
+	mat4 FacePV[6];
+};
+
+layout(std140, binding = 1) uniform ObjectBlock
+{
+	mat4 Model;
+	int FaceMask;
+};
+
+void main(void)
+{
+	int face = gl_InvocationID;
+	if ((FaceMask & (1 << face)) == 0)
+		return;
+
+	vec4 corners[3];
+	for (int i = 0; i < 3; i++)
+		corners[i] = FacePV[face] * gl_in[i].gl_Position;
+
+	// Outside if all three are past the same one of the planes -w <= x, y, z <= w.
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (corners[0][axis] < -corners[0].w && corners[1][axis] < -corners[1].w && corners[2][axis] < -corners[2].w)
+			return;
+		if (corners[0][axis] > corners[0].w && corners[1][axis] > corners[1].w && corners[2][axis] > corners[2].w)
+			return;
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		gl_Layer = face;
+		gl_Position = corners[i];
+		EmitVertex();
+	}
+	EndPrimitive();
+}
@@ -0,0 +1,260 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: CubeShadowMap.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+Shadows in every direction around the main light, for when it really is a point
+light and not a spot light.
+
+The light's shadow map only covers the 45 degree frustum of LightParams, and
+everything outside it is lit whether it should be or not. A point light needs a
+shadow map in every direction, which is a cube map: six square faces, each seen
+through a 90 degree frustum looking down one axis. The shader looks the cube up
+with the direction from the light to the fragment, and gets the depth from the
+face that direction goes through.
+
+Drawing the cube the obvious way means six passes, each drawing every caster of
+its face. Here all six are drawn in one pass instead. The framebuffer has the
+whole cube attached, and the geometry shader is instanced six times per triangle,
+once per face. Each instance writes gl_Layer to pick its face, and drops the
+triangle if the object isn't in that face or the triangle is outside it. So every
+caster is only one draw call, whatever the number of faces it is in.
+
+Which faces an object is in is worked out on the update thread (Scene::cubeFaces)
+and sent with its model matrix, so most objects only go through one or two of the
+instances. The six pass version is kept to compare with: "i" switches between
+them. The GPU time of the pass is measured with a timer query (OmniShadowTimer)
+and shown in the window title.
+
+The depth stored in a face is the usual perspective depth of the distance along
+that face's axis. The shader gets the same value from the biggest component of
+the direction, which is that distance, with the two numbers in depthParams().
+*/
+
+#ifndef _CUBE_SHADOW_MAP_H
+#define _CUBE_SHADOW_MAP_H
+
+#include "GLIncludes.h"
+
+#define CUBE_SHADOW_SIZE 1024
+#define CUBE_NEAR 0.1f
+#define CUBE_FAR 50.0f				// How far the light's shadows reach
+#define CUBE_TEXTURE_UNIT 5
+#define CUBE_BLOCK_BINDING 3
+
+// The ways of drawing the shadows all around the light that OmniShadowTimer keeps apart.
+#define OMNI_CUBE_SINGLE_PASS 0
+#define OMNI_CUBE_SIX_PASSES 1
+#define OMNI_PARABOLOID 2
+#define OMNI_TIMED_MODES 3
+
+// The GPU time of the pass that draws the shadows all around the light, for each way of drawing them.
+// There are two queries, so we read the one from the frame before while this frame's is still running.
+struct OmniShadowTimer
+{
+	GLuint queries[2];
+	int queryMode[2];				// Which mode each query timed, -1 if it has no result coming
+	int currentQuery;
+	double milliseconds[OMNI_TIMED_MODES];		// Total over all the frames timed
+	int timedFrames[OMNI_TIMED_MODES];
+	double lastMilliseconds;
+
+	void init()
+	{
+		currentQuery = 0;
+		lastMilliseconds = 0.0;
+		for (int i = 0; i < 2; i++)
+			queryMode[i] = -1;
+		for (int mode = 0; mode < OMNI_TIMED_MODES; mode++)
+		{
+			milliseconds[mode] = 0.0;
+			timedFrames[mode] = 0;
+		}
+		glGenQueries(2, queries);
+	}
+
+	void release()
+	{
+		glDeleteQueries(2, queries);
+	}
+
+	// Put around the draws of the pass.
+	void begin(int mode)
+	{
+		// Collect the result of the last time this query was used, if the GPU has it by now.
+		GLuint query = queries[currentQuery];
+		if (queryMode[currentQuery] >= 0)
+		{
+			GLint available = 0;
+			glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available)
+			{
+				GLuint64 nanoseconds = 0;
+				glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+				lastMilliseconds = nanoseconds / 1e6;
+				milliseconds[queryMode[currentQuery]] += lastMilliseconds;
+				timedFrames[queryMode[currentQuery]]++;
+			}
+		}
+
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		queryMode[currentQuery] = mode;
+	}
+
+	void end()
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		currentQuery = 1 - currentQuery;
+	}
+
+	// The average time of each mode, over every frame that was timed.
+	void printTimes()
+	{
+		const char* names[OMNI_TIMED_MODES] = { "cube shadow map in one layered pass", "cube shadow map in six passes",
+			"dual paraboloid shadow map" };
+		for (int mode = 0; mode < OMNI_TIMED_MODES; mode++)
+		{
+			if (timedFrames[mode] > 0)
+				std::cout << "Shadows all around the light, " << names[mode] << ": " << milliseconds[mode] / timedFrames[mode]
+					<< "ms on the GPU, average of " << timedFrames[mode] << " frames\n";
+		}
+	}
+
+}omniTimer;
+
+// CubeBlock in CubeShadowGeometryShader.glsl.
+struct CubeUniforms
+{
+	glm::mat4 FacePV[6];
+};
+
+// ObjectBlock in CubeShadowVertexShader.glsl and CubeShadowGeometryShader.glsl.
+struct CubeObjectUniforms
+{
+	glm::mat4 Model;
+	int FaceMask;					// Bit f is set if the object is in face f
+	int padding[3];
+};
+
+struct CubeShadowMap
+{
+	GLuint texture;
+	GLuint layeredFbo;				// The whole cube, the geometry shader picks the face
+	GLuint faceFbos[6];				// One face each, for the six pass version
+	GLuint layeredProgram;			// Set to 0 by finishPrograms() if it fails to link
+	GLuint vertexShader;			// Also used by the dual paraboloid map
+	GLuint geometryShader;
+	bool usable;					// False if the framebuffers couldn't be made
+
+	void init()
+	{
+		usable = true;
+
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+		glTexStorage2D(GL_TEXTURE_CUBE_MAP, 1, GL_DEPTH_COMPONENT24, CUBE_SHADOW_SIZE, CUBE_SHADOW_SIZE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LESS);
+		// Lets the filter blend across the edge of two faces.
+		glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+		GLenum drawbuf[] = { GL_NONE };
+		glGenFramebuffers(1, &layeredFbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, layeredFbo);
+		glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0);
+		glDrawBuffers(1, drawbuf);
+		glReadBuffer(GL_NONE);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			usable = false;
+
+		glGenFramebuffers(6, faceFbos);
+		for (int f = 0; f < 6; f++)
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, faceFbos[f]);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + f, texture, 0);
+			glDrawBuffers(1, drawbuf);
+			glReadBuffer(GL_NONE);
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+				usable = false;
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		// The fragment shader is the one of the light's shadow map, which does nothing. It is compiled only once.
+		// Nothing waits for the compile here, finishPrograms() checks it with the other programs.
+		vertexShader = submitShaderFile("CubeShadowVertexShader.glsl", GL_VERTEX_SHADER);
+		geometryShader = submitShaderFile("CubeShadowGeometryShader.glsl", GL_GEOMETRY_SHADER);
+		GLuint shaders[] = { vertexShader, geometryShader, sharedDepthFragmentShader() };
+		layeredProgram = submitLinkedProgram("CubeShadowVertexShader.glsl + CubeShadowGeometryShader.glsl + FragmentShader.glsl",
+			shaders, 3, &layeredProgram);
+
+		if (!usable)
+			std::cout << "Cube shadow map not created, the light only casts shadows in front of it.\n";
+	}
+
+	// Whether the cube map can be drawn: it has its framebuffers, and its program linked. Only known after finishPrograms().
+	bool ready() const
+	{
+		return usable && layeredProgram != 0;
+	}
+
+	void release()
+	{
+		glDeleteProgram(layeredProgram);
+		glDeleteShader(vertexShader);
+		glDeleteShader(geometryShader);
+		glDeleteFramebuffers(6, faceFbos);
+		glDeleteFramebuffers(1, &layeredFbo);
+		glDeleteTextures(1, &texture);
+		layeredProgram = 0;
+		layeredFbo = 0;
+		texture = 0;
+	}
+
+	// The view-projection matrices of the six faces, in the order of GL_TEXTURE_CUBE_MAP_POSITIVE_X and the five after it.
+	// The up vectors are the ones the cube map lookup expects, so what is drawn into a face is what the shader reads from it.
+	static void faceMatrices(const glm::vec3& position, glm::mat4 PV[6])
+	{
+		static const glm::vec3 directions[6] = { glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0),
+			glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1) };
+		static const glm::vec3 ups[6] = { glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1),
+			glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0) };
+
+		// 90 degrees, so the six frustums meet without gaps. glm takes the angle in radians here.
+		glm::mat4 projection = glm::perspective(1.5707963f, 1.0f, CUBE_NEAR, CUBE_FAR);
+		for (int f = 0; f < 6; f++)
+			PV[f] = projection * glm::lookAt(position, position + directions[f], ups[f]);
+	}
+
+	// The depth a face stores for a point at distance d along its axis is x - y / d, in [0, 1].
+	static glm::vec2 depthParams()
+	{
+		return glm::vec2(CUBE_FAR / (CUBE_FAR - CUBE_NEAR), CUBE_FAR * CUBE_NEAR / (CUBE_FAR - CUBE_NEAR));
+	}
+
+}cubeShadow;
+
+#endif _CUBE_SHADOW_MAP_H
@@ -0,0 +1,44 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: CubeShadowVertexShader.glsl
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+The vertex shader of the single pass cube shadow map (CubeShadowMap.h). It only
+takes the vertex to world space. Which of the six faces it goes to is up to the
+geometry shader, so the face matrices are applied there.
+*/
+
+#version 430 core
+
+layout(location = 0) in vec3 in_position;
+
+// Every draw binds its own copy from the frame data ring.
+layout(std140, binding = 1) uniform ObjectBlock
+{
+	mat4 Model;
+	int FaceMask;			// Bit f is set if the object is in face f
+};
+
+void main(void)
+{
+	gl_Position = Model * vec4(in_position, 1.0);
+}
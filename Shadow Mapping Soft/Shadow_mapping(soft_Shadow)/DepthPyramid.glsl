@@ -0,0 +1,74 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: DepthPyramid.glsl
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+Builds one level of the min/max depth pyramid of the shadow map.
+Every texel of a level holds the smallest (r) and the largest (g) depth of the
+2x2 texels below it, so a texel of level n covers 2^(n+1) x 2^(n+1) texels of
+the shadow map. The first level is built from the shadow map itself, every
+other level from the one before it.
+When the level below has an odd size, the last row or column has no partner.
+The texels at that edge then take in three texels instead of two, so nothing
+of the shadow map is left out.
+*/
+
+#version 430 core
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+// The shadow map (read through a sampler with the comparison turned off) or the pyramid itself.
+layout(binding = 3) uniform sampler2D Source;
+layout(binding = 0, rg32f) uniform writeonly image2D Destination;
+
+layout(location = 0) uniform int SourceLevel;
+layout(location = 1) uniform int FromDepth;		// 1 when Source is the shadow map, which only has one depth per texel
+
+void main()
+{
+	ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 size = imageSize(Destination);
+	if (any(greaterThanEqual(texel, size)))
+		return;
+
+	ivec2 sourceSize = textureSize(Source, SourceLevel);
+	// Take in the odd row or column at the edge.
+	ivec2 count = ivec2(2);
+	if (texel.x == size.x - 1 && (sourceSize.x & 1) == 1)
+		count.x = 3;
+	if (texel.y == size.y - 1 && (sourceSize.y & 1) == 1)
+		count.y = 3;
+
+	vec2 minMax = vec2(1.0f, 0.0f);
+	for (int y = 0; y < count.y; y++)
+	{
+		for (int x = 0; x < count.x; x++)
+		{
+			ivec2 sourceTexel = min(texel * 2 + ivec2(x, y), sourceSize - 1);
+			vec4 value = texelFetch(Source, sourceTexel, SourceLevel);
+			vec2 range = (FromDepth == 1) ? value.rr : value.rg;
+			minMax = vec2(min(minMax.x, range.x), max(minMax.y, range.y));
+		}
+	}
+
+	imageStore(Destination, texel, vec4(minMax, 0.0f, 0.0f));
+}
@@ -0,0 +1,183 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: DepthPyramid.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+A min/max depth pyramid of the shadow map, built on the GPU after the first pass.
+Each level is half the size of the one below, and every texel stores the closest
+and the farthest depth of the area of the shadow map it covers.
+
+The random sampling filter takes its taps from a small circle around the fragment.
+Before taking any of them, it looks up the coarse texels that cover the whole
+circle. If the fragment is closer to the light than even the closest depth there,
+every tap would say "lit", and if it is behind the farthest depth, every tap would
+say "shadow". Either way the answer is known after one or two fetches, and the taps
+are skipped. Only fragments near the edge of a shadow take all the samples.
+
+The levels are built by DepthPyramid.glsl, a compute shader that runs once per
+level. The shadow map has its comparison mode on, so we read it through a sampler
+object that turns the comparison off, which gives us the stored depths.
+
+To see how much this saves, the shader counts the fragments that took the fast
+path and the ones that didn't, in an atomic counter buffer. Reading the counters
+right after the frame would wait for the GPU, so there are a few buffers that are
+used in turn, and each one is only read back once its fence says the GPU is done.
+*/
+
+#ifndef _DEPTH_PYRAMID_H
+#define _DEPTH_PYRAMID_H
+
+#include "GLIncludes.h"
+#include "GLStateCache.h"
+
+// Uses submitShaderFile() and submitLinkedProgram() from BasicFunctions.h, so include this after it.
+
+// Texture unit of the pyramid, and of the source while it is being built. Matches the binding in the shaders.
+#define PYRAMID_TEXTURE_UNIT 3
+#define PYRAMID_COUNTER_BUFFERS 3
+
+struct DepthPyramid
+{
+	GLuint program;
+	GLuint texture;				// GL_RG32F, the closest depth in r and the farthest in g
+	GLuint depthSampler;		// Reads the shadow map without the comparison
+	int width, height;			// Size of level 0, half the shadow map
+	int levels;
+	bool enabled;				// Turned on and off with "h", to compare
+
+	// Number of fragments that skipped the taps and that took them. Index 0 is the fast path, index 1 the rest.
+	GLuint counters[PYRAMID_COUNTER_BUFFERS];
+	GLsync fences[PYRAMID_COUNTER_BUFFERS];
+	int current;
+
+	// The counts of the newest frame the GPU has finished.
+	GLuint fastFragments;
+	GLuint fullFragments;
+
+	void init(int shadowWidth, int shadowHeight)
+	{
+		width = std::max(1, shadowWidth / 2);
+		height = std::max(1, shadowHeight / 2);
+		levels = 1;
+		while ((std::max(width, height) >> levels) > 0)
+			levels++;
+		enabled = true;
+		current = 0;
+		fastFragments = 0;
+		fullFragments = 0;
+
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexStorage2D(GL_TEXTURE_2D, levels, GL_RG32F, width, height);
+		// Only ever read with texelFetch, but the filters have to allow mipmaps for the texture to be complete.
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+
+		// Sampler objects override the sampling state of whatever texture is bound to the same unit.
+		glGenSamplers(1, &depthSampler);
+		glSamplerParameteri(depthSampler, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+		glSamplerParameteri(depthSampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glSamplerParameteri(depthSampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+
+		// Checked in finishPrograms() with the others, which sets program to 0 if it fails, so active() turns it off.
+		GLuint shader = submitShaderFile("DepthPyramid.glsl", GL_COMPUTE_SHADER);
+		program = submitLinkedProgram("DepthPyramid.glsl", &shader, 1, &program);
+		glDeleteShader(shader);		// Only flagged, the program keeps it alive as long as it needs it.
+
+		GLuint zero[2] = { 0, 0 };
+		glGenBuffers(PYRAMID_COUNTER_BUFFERS, counters);
+		for (int i = 0; i < PYRAMID_COUNTER_BUFFERS; i++)
+		{
+			glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, counters[i]);
+			glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(zero), zero, GL_DYNAMIC_READ);
+			fences[i] = 0;
+		}
+		glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+	}
+
+	// The filters only use the pyramid if this is true.
+	bool active()
+	{
+		return enabled && program != 0;
+	}
+
+	// Builds every level from the shadow map. Call after the first pass.
+	void build(GLuint depthTex)
+	{
+		glState.useProgram(program);
+		glBindSampler(PYRAMID_TEXTURE_UNIT, depthSampler);
+
+		for (int level = 0; level < levels; level++)
+		{
+			// Level 0 comes from the shadow map, the others from the level before.
+			glState.bindTexture(PYRAMID_TEXTURE_UNIT, GL_TEXTURE_2D, level == 0 ? depthTex : texture);
+			glState.uniform1i(0, level == 0 ? 0 : level - 1);
+			glState.uniform1i(1, level == 0 ? 1 : 0);
+			glBindImageTexture(0, texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG32F);
+
+			int levelWidth = std::max(1, width >> level);
+			int levelHeight = std::max(1, height >> level);
+			glDispatchCompute((levelWidth + 7) / 8, (levelHeight + 7) / 8, 1);
+
+			// The next level (and the second pass) reads what this one wrote.
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+		}
+
+		// Leave the pyramid on its unit for the second pass, sampled with its own state.
+		glBindSampler(PYRAMID_TEXTURE_UNIT, 0);
+	}
+
+	// Clears this frame's counters and binds them for the second pass.
+	void beginFrame()
+	{
+		GLuint zero[2] = { 0, 0 };
+		glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, counters[current]);
+		glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(zero), zero);
+	}
+
+	// Call after the second pass. Reads back the oldest counters if the GPU is done with them.
+	void endFrame()
+	{
+		// Make the atomic writes visible to glGetBufferSubData.
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		current = (current + 1) % PYRAMID_COUNTER_BUFFERS;
+
+		// The buffer we use next frame is the oldest one. If it is not done yet, we skip its counts rather than wait.
+		if (fences[current] == 0)
+			return;
+		GLenum result = glClientWaitSync(fences[current], 0, 0);
+		if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+		{
+			GLuint counts[2];
+			glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, counters[current]);
+			glGetBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(counts), counts);
+			fastFragments = counts[0];
+			fullFragments = counts[1];
+		}
+		glDeleteSync(fences[current]);
+		fences[current] = 0;
+	}
+
+}depthPyramid;
+
+#endif _DEPTH_PYRAMID_H
@@ -0,0 +1,243 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: FrameArena.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+Description:
+A linear ("bump") allocator for the data that only lives for one frame, like the
+draw lists and the scratch arrays of the culling. Going to the heap for these
+every frame costs a lock or two inside malloc, and the memory ends up scattered.
+
+The arena keeps a few big blocks of memory. Allocating just moves a pointer
+forward in the current block, and when it is full we go on to the next block.
+Nothing is freed on its own. Instead the whole arena is reset when the frame is
+over, which just moves the pointer back to the start of the first block. The
+blocks are kept, so once the arena has seen the biggest frame, it never goes to
+the heap again.
+
+The arena is used from the thread pool, so every thread has a sub-arena of its
+own, with its own blocks and its own pointer. A thread only ever touches its own,
+so there are no locks. Each allocation says which thread it is for, which is
+threadPool.threadIndex() inside a task, or 0 on the thread that called the pool.
+
+ArenaAllocator lets the standard containers take their memory from an arena.
+Freeing does nothing, the memory comes back when the arena is reset. So a
+container must give up its memory (see forgetArenaMemory) before that, or it
+would keep using memory the arena hands out again. Only the elements come from
+the arena. What a container allocates for itself, like the proxy the debug
+iterators of MSVC keep, lives as long as the container, so it goes to the heap.
+
+--bench-jobs checks that a frame doesn't make the arenas grow. To count every
+allocation of a frame, build with COUNT_HEAP_ALLOCATIONS defined (see main.cpp).
+*/
+
+#ifndef _FRAME_ARENA_H
+#define _FRAME_ARENA_H
+
+#include "GLIncludes.h"
+#include "ThreadPool.h"
+#include <new>
+#include <cstdlib>
+#include <cstdint>
+#include <type_traits>
+
+// Smallest block a sub-arena asks the heap for. Bigger requests get a block of their own size.
+#define ARENA_BLOCK_SIZE (256 * 1024)
+
+struct ArenaBlock
+{
+	char* memory;
+	size_t size;
+};
+
+struct SubArena
+{
+	std::vector<ArenaBlock> blocks;		// Kept from frame to frame
+	int current;						// The block being filled
+	size_t used;						// Bytes used in the current block
+	char padding[64];					// So two threads' pointers are not on the same cache line
+};
+
+struct FrameArena
+{
+	std::vector<SubArena> threads;		// One per thread of the pool
+
+	// There is always a sub-arena for thread 0, so the arena can be used before the first reset().
+	FrameArena()
+	{
+		addThreads(1);
+	}
+
+	void addThreads(int count)
+	{
+		if ((int)threads.size() < count)
+		{
+			SubArena empty;
+			empty.current = 0;
+			empty.used = 0;
+			threads.resize(count, empty);
+		}
+	}
+
+	// Frees all the blocks. Only at the end, the arena is meant to keep them.
+	void release()
+	{
+		for (unsigned int t = 0; t < threads.size(); t++)
+		{
+			for (unsigned int b = 0; b < threads[t].blocks.size(); b++)
+				free(threads[t].blocks[b].memory);
+		}
+		threads.clear();
+		addThreads(1);
+	}
+
+	// Everything allocated so far is free again. Sets up a sub-arena for every thread the pool has now,
+	// so it has to be called before the first allocation, and not while the pool is running a task.
+	void reset()
+	{
+		addThreads(threadPool.size());
+		for (unsigned int t = 0; t < threads.size(); t++)
+		{
+			threads[t].current = 0;
+			threads[t].used = 0;
+		}
+	}
+
+	// Returns size bytes with the given alignment (a power of 2) from the thread's sub-arena.
+	void* allocate(size_t size, size_t alignment, int thread)
+	{
+		SubArena& arena = threads[thread];
+
+		while (arena.current < (int)arena.blocks.size())
+		{
+			ArenaBlock& block = arena.blocks[arena.current];
+			size_t start = (size_t)(((uintptr_t)block.memory + arena.used + alignment - 1) & ~(uintptr_t)(alignment - 1)) - (uintptr_t)block.memory;
+			if (start + size <= block.size)
+			{
+				arena.used = start + size;
+				return block.memory + start;
+			}
+			// The rest of this block is wasted for this frame.
+			arena.current++;
+			arena.used = 0;
+		}
+
+		// Only happens while the arena is growing to the size of the biggest frame.
+		ArenaBlock block;
+		block.size = std::max((size_t)ARENA_BLOCK_SIZE, size + alignment);
+		block.memory = (char*)malloc(block.size);
+		if (block.memory == nullptr)
+			throw std::bad_alloc();
+		arena.blocks.push_back(block);
+		arena.current = (int)arena.blocks.size() - 1;
+		arena.used = 0;
+		return allocate(size, alignment, thread);
+	}
+
+	template<typename T>
+	T* allocateArray(size_t count, int thread)
+	{
+		return (T*)allocate(std::max(count, (size_t)1) * sizeof(T), std::alignment_of<T>::value, thread);
+	}
+
+	// How many blocks the arena got from the heap so far. They are only freed by release().
+	size_t blockCount()
+	{
+		size_t total = 0;
+		for (unsigned int t = 0; t < threads.size(); t++)
+			total += threads[t].blocks.size();
+		return total;
+	}
+
+	// How much memory the arena holds, used or not.
+	size_t capacity()
+	{
+		size_t total = 0;
+		for (unsigned int t = 0; t < threads.size(); t++)
+		{
+			for (unsigned int b = 0; b < threads[t].blocks.size(); b++)
+				total += threads[t].blocks[b].size;
+		}
+		return total;
+	}
+};
+
+// Lets the standard containers allocate from an arena. A container allocates from the thread it was set up for,
+// so it must only grow on that thread.
+template<typename T>
+struct ArenaAllocator
+{
+	typedef T value_type;
+
+	FrameArena* arena;					// nullptr to use the heap
+	int thread;
+
+	ArenaAllocator(FrameArena* arena = nullptr, int thread = 0) : arena(arena), thread(thread) {}
+	// A container only makes a copy for another type for its own bookkeeping, never for the elements.
+	// That can outlive a reset of the arena, so the copy uses the heap.
+	template<typename U>
+	ArenaAllocator(const ArenaAllocator<U>&) : arena(nullptr), thread(0) {}
+
+	T* allocate(size_t count)
+	{
+		if (arena == nullptr)
+			return (T*)::operator new(count * sizeof(T));
+		return arena->allocateArray<T>(count, thread);
+	}
+
+	// Memory from the arena is only given back when the arena is reset.
+	void deallocate(T* memory, size_t)
+	{
+		if (arena == nullptr)
+			::operator delete(memory);
+	}
+
+	template<typename U>
+	struct rebind
+	{
+		typedef ArenaAllocator<U> other;
+	};
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+	return a.arena == b.arena && a.thread == b.thread;
+}
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+	return !(a == b);
+}
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+// Makes the vector drop its memory without touching it, so the arena can be reset under it.
+template<typename T>
+void forgetArenaMemory(ArenaVector<T>& vector)
+{
+	ArenaVector<T>(vector.get_allocator()).swap(vector);
+}
+
+#endif _FRAME_ARENA_H
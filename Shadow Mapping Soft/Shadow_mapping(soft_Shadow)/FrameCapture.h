@@ -0,0 +1,506 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: FrameCapture.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+Description:
+Records the rendered frames to disk, for regression tests and for looking at them
+later. Reading the framebuffer with glReadPixels into our own memory makes the CPU
+wait until the GPU has finished the frame and copied it over, which throws away
+all the work the CPU and the GPU could have done at the same time.
+
+So the pixels are read into a pixel buffer object instead. With a buffer bound to
+GL_PIXEL_PACK_BUFFER, glReadPixels only queues the copy and returns right away.
+There is a ring of these buffers, and a fence after every copy. A few frames later,
+once the fence says the copy is done, the buffer is mapped, the pixels are copied
+out, and the buffer is free for another frame. The render thread never waits.
+
+The files are written by a few threads of their own, so the encoding and the disk
+are not on the render thread either. The frames are handed to them through a
+queue of jobs. There is a fixed number of jobs, and their memory is allocated up
+front. If the writers fall behind, we skip frames instead of waiting for them.
+
+The frames are written as PNG, or as raw PPM files. The depth from the light can
+be saved too, as 16 bit grayscale. The PNGs are not compressed (they use the
+"stored" blocks of deflate), which keeps the writers fast and the code short,
+but the files are as big as the raw ones.
+*/
+
+#ifndef _FRAME_CAPTURE_H
+#define _FRAME_CAPTURE_H
+
+#include "GLIncludes.h"
+#include "GLStateCache.h"
+#include <deque>
+#include <cstring>
+#include <condition_variable>
+
+// Frames in flight between glReadPixels and the map.
+#define CAPTURE_BUFFERS 3
+// Frames (or depth images) that can be queued for the writers at once.
+#define CAPTURE_JOBS 8
+#define CAPTURE_WRITERS 2
+
+// One image for a writer thread.
+struct CaptureJob
+{
+	bool depth;							// 16 bit depth, otherwise RGBA with 8 bits per channel
+	int width, height;
+	unsigned int frame;
+	std::vector<unsigned char> pixels;	// As OpenGL returns them, bottom row first
+};
+
+// A frame on its way back from the GPU.
+struct CaptureSlot
+{
+	GLuint color;
+	GLuint depth;
+	GLsync fence;
+	unsigned int frame;
+	bool hasDepth;
+};
+
+struct FrameCapture
+{
+	int width, height;					// The window
+	int depthWidth, depthHeight;		// The shadow map
+	bool png;							// PNG or raw PPM/PGM
+	bool captureDepth;					// Also save the shadow map
+	bool active;
+
+	CaptureSlot slots[CAPTURE_BUFFERS];
+	int oldest;							// The slot that was read first, and will be mapped first
+	int pending;						// Slots waiting for the GPU
+	unsigned int frameNumber;
+
+	CaptureJob jobs[CAPTURE_JOBS];
+	std::vector<CaptureJob*> freeJobs;
+	std::deque<CaptureJob*> queue;
+	std::mutex lock;
+	std::condition_variable wake;		// A job was queued, or we are stopping
+	std::condition_variable returned;	// A job is free again
+	std::vector<std::thread> writers;
+	bool stopping;
+
+	unsigned int crcTable[256];
+
+	// What it costs, on the render thread.
+	unsigned int framesCaptured, framesSkipped;
+	double captureSeconds, frameSeconds;
+	std::chrono::high_resolution_clock::time_point lastFrame;
+
+	void init(int w, int h, int shadowWidth, int shadowHeight)
+	{
+		width = w;
+		height = h;
+		depthWidth = shadowWidth;
+		depthHeight = shadowHeight;
+		png = true;
+		captureDepth = false;
+		active = false;
+		oldest = 0;
+		pending = 0;
+		frameNumber = 0;
+		stopping = false;
+
+		for (int i = 0; i < CAPTURE_BUFFERS; i++)
+		{
+			// GL_STREAM_READ: written by the GPU once, read by us once.
+			glGenBuffers(1, &slots[i].color);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[i].color);
+			glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, nullptr, GL_STREAM_READ);
+			glGenBuffers(1, &slots[i].depth);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[i].depth);
+			glBufferData(GL_PIXEL_PACK_BUFFER, depthWidth * depthHeight * 2, nullptr, GL_STREAM_READ);
+			slots[i].fence = 0;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		// Every job is big enough for either image, so the writers never allocate.
+		freeJobs.clear();
+		for (int i = 0; i < CAPTURE_JOBS; i++)
+		{
+			jobs[i].pixels.resize(std::max(width * height * 4, depthWidth * depthHeight * 2));
+			freeJobs.push_back(&jobs[i]);
+		}
+
+		for (unsigned int n = 0; n < 256; n++)
+		{
+			unsigned int c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			crcTable[n] = c;
+		}
+
+		for (int i = 0; i < CAPTURE_WRITERS; i++)
+			writers.push_back(std::thread(&FrameCapture::writerLoop, this));
+	}
+
+	// Stops recording and waits for the writers to finish the frames they have.
+	void release()
+	{
+		if (active)
+			stop();
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (unsigned int i = 0; i < writers.size(); i++)
+			writers[i].join();
+		writers.clear();
+
+		for (int i = 0; i < CAPTURE_BUFFERS; i++)
+		{
+			glDeleteBuffers(1, &slots[i].color);
+			glDeleteBuffers(1, &slots[i].depth);
+		}
+	}
+
+	void start()
+	{
+		active = true;
+		framesCaptured = 0;
+		framesSkipped = 0;
+		captureSeconds = 0.0;
+		frameSeconds = 0.0;
+		lastFrame = std::chrono::high_resolution_clock::now();
+		std::cout << "Capturing frames as " << (png ? "PNG" : "PPM") << (captureDepth ? ", with the shadow map\n" : "\n");
+	}
+
+	// Waits for the frames still on the GPU, so the last frames are not lost, and prints what it cost.
+	void stop()
+	{
+		while (pending > 0)
+			collect(true);
+		active = false;
+
+		std::cout << "Captured " << framesCaptured << " frames, skipped " << framesSkipped << ". "
+			<< captureSeconds / std::max(framesCaptured + framesSkipped, 1u) * 1000.0 << "ms per frame on the render thread, "
+			<< 100.0 * captureSeconds / std::max(frameSeconds, 1e-9) << "% of the frame time\n";
+	}
+
+	// Called after the frame is drawn, before the buffers are swapped.
+	void record(GLuint depthTexture)
+	{
+		if (!active)
+			return;
+		auto startTime = std::chrono::high_resolution_clock::now();
+		frameSeconds += std::chrono::duration<double>(startTime - lastFrame).count();
+		lastFrame = startTime;
+
+		// Hand every frame the GPU is done with to the writers. This frees their slots.
+		while (pending > 0 && collect(false))
+			;
+
+		if (pending == CAPTURE_BUFFERS)
+		{
+			// Either the GPU or the writers are this far behind. Waiting would slow down the rendering.
+			framesSkipped++;
+		}
+		else
+		{
+			CaptureSlot& slot = slots[(oldest + pending) % CAPTURE_BUFFERS];
+			slot.frame = frameNumber;
+			slot.hasDepth = captureDepth;
+
+			// With a pack buffer bound, the last argument is an offset into it, and the calls return without waiting.
+			glState.bindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+			glReadBuffer(GL_BACK);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.color);
+			glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+			if (slot.hasDepth)
+			{
+				glState.bindTexture(0, GL_TEXTURE_2D, depthTexture);
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.depth);
+				glGetTexImage(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT, 0);
+			}
+			// Anything else that reads pixels expects to get them in its own memory.
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+			slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			pending++;
+			framesCaptured++;
+		}
+		frameNumber++;
+
+		captureSeconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+	}
+
+	// Maps the oldest slot and queues its images. Without wait, returns false if the GPU or the writers
+	// are not ready for it yet.
+	bool collect(bool wait)
+	{
+		CaptureSlot& slot = slots[oldest];
+		GLenum result = glClientWaitSync(slot.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000 : 0);
+		if (result == GL_TIMEOUT_EXPIRED)
+			return false;
+
+		int needed = slot.hasDepth ? 2 : 1;
+		CaptureJob* taken[2];
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while (wait && (int)freeJobs.size() < needed)
+				returned.wait(guard);
+			if ((int)freeJobs.size() < needed)
+				return false;
+			for (int i = 0; i < needed; i++)
+			{
+				taken[i] = freeJobs.back();
+				freeJobs.pop_back();
+			}
+		}
+
+		readBack(slot.color, *taken[0], false, width, height, slot.frame);
+		if (slot.hasDepth)
+			readBack(slot.depth, *taken[1], true, depthWidth, depthHeight, slot.frame);
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			for (int i = 0; i < needed; i++)
+				queue.push_back(taken[i]);
+		}
+		wake.notify_all();
+
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		oldest = (oldest + 1) % CAPTURE_BUFFERS;
+		pending--;
+		return true;
+	}
+
+	// Copies the contents of a pack buffer into a job. The copy is quick, and the buffer can be reused right after.
+	void readBack(GLuint buffer, CaptureJob& job, bool depth, int w, int h, unsigned int frame)
+	{
+		job.depth = depth;
+		job.width = w;
+		job.height = h;
+		job.frame = frame;
+		int size = w * h * (depth ? 2 : 4);
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+		const void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+		if (data != nullptr)
+			memcpy(&job.pixels[0], data, size);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	void writerLoop()
+	{
+		// Each writer keeps its own buffers for the converted rows and the PNG stream, which only grow on the first frame.
+		std::vector<unsigned char> rows, stream;
+		while (true)
+		{
+			CaptureJob* job;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				while (!stopping && queue.empty())
+					wake.wait(guard);
+				// Finish whatever is queued before stopping.
+				if (queue.empty())
+					return;
+				job = queue.front();
+				queue.pop_front();
+			}
+
+			writeJob(*job, rows, stream);
+
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				freeJobs.push_back(job);
+			}
+			returned.notify_one();
+		}
+	}
+
+	// Converts the image to what the file wants, top row first: RGB for color, big endian 16 bit for depth.
+	void writeJob(const CaptureJob& job, std::vector<unsigned char>& rows, std::vector<unsigned char>& stream)
+	{
+		int channels = job.depth ? 1 : 3;
+		int rowSize = job.width * channels * (job.depth ? 2 : 1);
+		rows.resize(rowSize * job.height);
+
+		for (int y = 0; y < job.height; y++)
+		{
+			unsigned char* out = &rows[y * rowSize];
+			int sourceRow = job.height - 1 - y;
+			if (job.depth)
+			{
+				const unsigned short* in = (const unsigned short*)&job.pixels[sourceRow * job.width * 2];
+				for (int x = 0; x < job.width; x++)
+				{
+					out[x * 2] = (unsigned char)(in[x] >> 8);
+					out[x * 2 + 1] = (unsigned char)(in[x] & 0xFF);
+				}
+			}
+			else
+			{
+				const unsigned char* in = &job.pixels[sourceRow * job.width * 4];
+				for (int x = 0; x < job.width; x++)
+				{
+					out[x * 3] = in[x * 4];
+					out[x * 3 + 1] = in[x * 4 + 1];
+					out[x * 3 + 2] = in[x * 4 + 2];
+				}
+			}
+		}
+
+		// The name is put together in place, with the frame number padded to 5 digits.
+		char name[40];
+		const char* prefix = job.depth ? "capture_depth_" : "capture_";
+		size_t length = strlen(prefix);
+		memcpy(name, prefix, length);
+		char digits[10];
+		int count = 0;
+		unsigned int frame = job.frame;
+		do
+		{
+			digits[count++] = (char)('0' + frame % 10);
+			frame /= 10;
+		} while (frame != 0);
+		while (count < 5)
+			digits[count++] = '0';
+		while (count > 0)
+			name[length++] = digits[--count];
+		strcpy(name + length, png ? ".png" : (job.depth ? ".pgm" : ".ppm"));
+
+		std::ofstream file(name, std::ios::binary);
+		if (!file.good())
+		{
+			std::cout << "Could not write " << name << "\n";
+			return;
+		}
+
+		if (png)
+			writePNG(file, job, rows, rowSize, stream);
+		else
+		{
+			// PPM for color, PGM for depth. 16 bit PGM is big endian, like PNG.
+			file << (job.depth ? "P5\n" : "P6\n") << job.width << " " << job.height << "\n" << (job.depth ? 65535 : 255) << "\n";
+			file.write((const char*)&rows[0], rows.size());
+		}
+	}
+
+	unsigned int crc(unsigned int c, const unsigned char* data, size_t size)
+	{
+		for (size_t i = 0; i < size; i++)
+			c = crcTable[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+		return c;
+	}
+
+	static void putBigEndian(unsigned char* out, unsigned int value)
+	{
+		out[0] = (unsigned char)(value >> 24);
+		out[1] = (unsigned char)(value >> 16);
+		out[2] = (unsigned char)(value >> 8);
+		out[3] = (unsigned char)value;
+	}
+
+	// Writes a chunk: length, type, data, and the CRC of the type and the data.
+	void writeChunk(std::ofstream& file, const char* type, const unsigned char* data, size_t size)
+	{
+		unsigned char header[8];
+		putBigEndian(header, (unsigned int)size);
+		memcpy(header + 4, type, 4);
+		unsigned int c = crc(0xFFFFFFFFu, header + 4, 4);
+		if (size != 0)
+			c = crc(c, data, size);
+
+		unsigned char footer[4];
+		putBigEndian(footer, c ^ 0xFFFFFFFFu);
+
+		file.write((const char*)header, 8);
+		if (size != 0)
+			file.write((const char*)data, size);
+		file.write((const char*)footer, 4);
+	}
+
+	// A PNG is a header chunk, the image as a zlib stream, and an end chunk. Every row starts with
+	// the number of the filter used on it, which for us is always 0 (none).
+	// The stream is the writer's own buffer, kept between frames like the rows.
+	void writePNG(std::ofstream& file, const CaptureJob& job, const std::vector<unsigned char>& rows, int rowSize,
+		std::vector<unsigned char>& data)
+	{
+		static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		file.write((const char*)signature, 8);
+
+		unsigned char header[13];
+		putBigEndian(header, job.width);
+		putBigEndian(header + 4, job.height);
+		header[8] = job.depth ? 16 : 8;		// Bits per channel
+		header[9] = job.depth ? 0 : 2;		// Grayscale or RGB
+		header[10] = 0;						// Deflate
+		header[11] = 0;						// The only filter method there is
+		header[12] = 0;						// Not interlaced
+		writeChunk(file, "IHDR", header, 13);
+
+		// The zlib stream: 2 header bytes, stored deflate blocks of at most 65535 bytes, and the Adler-32 of the data.
+		size_t total = (size_t)(rowSize + 1) * job.height;
+		data.clear();
+		data.reserve(total + total / 65535 * 5 + 16);
+		data.push_back(0x78);
+		data.push_back(0x01);
+
+		unsigned int a = 1, b = 0;
+		int sinceModulo = 0;
+		size_t written = 0, blockLeft = 0;
+		for (int y = 0; y < job.height; y++)
+		{
+			for (int i = -1; i < rowSize; i++)
+			{
+				if (blockLeft == 0)
+				{
+					blockLeft = std::min(total - written, (size_t)65535);
+					data.push_back(written + blockLeft == total ? 1 : 0);
+					data.push_back((unsigned char)(blockLeft & 0xFF));
+					data.push_back((unsigned char)(blockLeft >> 8));
+					data.push_back((unsigned char)(~blockLeft & 0xFF));
+					data.push_back((unsigned char)((~blockLeft >> 8) & 0xFF));
+				}
+				unsigned char value = (i < 0) ? 0 : rows[y * rowSize + i];
+				data.push_back(value);
+				// The sums only need the modulo every 5552 bytes, before b could overflow.
+				a += value;
+				b += a;
+				if (++sinceModulo == 5552)
+				{
+					a %= 65521;
+					b %= 65521;
+					sinceModulo = 0;
+				}
+				written++;
+				blockLeft--;
+			}
+		}
+		data.resize(data.size() + 4);
+		putBigEndian(&data[data.size() - 4], ((b % 65521) << 16) | (a % 65521));
+		writeChunk(file, "IDAT", &data[0], data.size());
+
+		writeChunk(file, "IEND", nullptr, 0);
+	}
+
+}frameCapture;
+
+#endif _FRAME_CAPTURE_H
@@ -0,0 +1,238 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: FrameDataRing.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+Description:
+A ring buffer for the data that changes every frame: the light, and the matrices
+of every object that is drawn. Setting these with glUniform* means the driver
+copies every value into its own memory before it goes to the GPU, once per call.
+Instead, we write them straight into a buffer the GPU reads from.
+
+The buffer is created with glBufferStorage and mapped once, with the persistent
+and coherent flags, so the pointer stays valid for the whole program and whatever
+we write there is seen by the next draw call without any unmapping or flushing.
+Since nothing is copied, the draws only need to be told where their data is,
+which is one glBindBufferRange per draw.
+
+The catch is that the GPU runs a frame or two behind, so it may still be reading
+data we want to overwrite. The buffer is split into 3 regions, one per frame. At
+the end of a frame we put a fence after its commands, and before a region is used
+again we wait on its fence. Usually that frame is long done and there is no wait.
+
+Every uniform block must start at a multiple of GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT,
+so each object gets a slot of that size, which lets the thread pool fill the slots
+of different objects at the same time.
+
+If a frame needs more than a region holds, the buffer is replaced by a larger one.
+Without GL_ARB_buffer_storage we can't map persistently, so the data is written to
+memory of our own and sent with glBufferSubData before the draws use it.
+*/
+
+#ifndef _FRAME_DATA_RING_H
+#define _FRAME_DATA_RING_H
+
+#include "GLIncludes.h"
+
+#define FRAME_DATA_REGIONS 3
+// Uniform buffer binding points. Match the bindings of the blocks in the shaders.
+#define FRAME_BLOCK_BINDING 0
+#define OBJECT_BLOCK_BINDING 1
+
+// FrameBlock in LightFragShader.glsl, laid out the way std140 expects.
+struct FrameUniforms
+{
+	glm::vec4 lightPosition;		// The struct members are vec3s, but std140 puts each one at a multiple of 16
+	glm::vec4 lightIntensity;
+	glm::vec3 offsetTexSize;
+	int frameIndex;					// Fits in the last 4 bytes of the vec3
+	float historyWeight;
+	int usePyramid;
+	int omniShadows;				// 1 if the shadow comes from the cube shadow map, 2 from the dual paraboloid one
+	int omniFilter;					// The filter of the dual paraboloid map, like ControlState::filter
+	glm::mat4 viewToLight;			// From view space to world space around the light, for the cube map lookup
+	glm::vec2 cubeDepth;			// CubeShadowMap::depthParams()
+	glm::vec2 paraboloidDepth;		// ParaboloidShadowMap::depthParams()
+	glm::vec4 clusterScale;			// ClusteredLights::scale()
+};
+
+// ObjectBlock in LightVertexShader.glsl. A mat3 is stored as 3 columns of 4 floats.
+struct ObjectUniforms
+{
+	glm::mat4 MVP;
+	glm::mat4 ModelViewMatrix;
+	glm::vec4 NormalMatrix[3];
+	glm::mat4 ShadowMatrix;
+	glm::mat4 PrevMVP;
+};
+
+// ObjectBlock in VertexShader.glsl.
+struct ShadowObjectUniforms
+{
+	glm::mat4 MVP;
+};
+
+struct FrameDataRing
+{
+	GLuint buffer;
+	char* mapped;					// Where the whole buffer is mapped, or our own copy without persistent mapping
+	std::vector<char> staging;
+	bool persistent;
+
+	GLsizeiptr regionSize;
+	GLint alignment;				// GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+	GLsync fences[FRAME_DATA_REGIONS];
+	int region;						// The region this frame writes to
+	GLsizeiptr used;				// Bytes of the region handed out this frame
+
+	// Counts, to see if the CPU ever has to wait for the GPU.
+	unsigned int frames;
+	unsigned int stalls;
+
+	void init(GLsizeiptr size)
+	{
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		persistent = GLEW_ARB_buffer_storage != 0;
+		for (int i = 0; i < FRAME_DATA_REGIONS; i++)
+			fences[i] = 0;
+		region = 0;
+		used = 0;
+		frames = 0;
+		stalls = 0;
+		buffer = 0;
+		create(aligned(size));
+	}
+
+	void create(GLsizeiptr size)
+	{
+		regionSize = size;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		if (persistent)
+		{
+			// The storage can't be resized or respecified, which is what lets the driver keep it mapped.
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_UNIFORM_BUFFER, regionSize * FRAME_DATA_REGIONS, nullptr, flags);
+			mapped = (char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, regionSize * FRAME_DATA_REGIONS, flags);
+		}
+		else
+		{
+			glBufferData(GL_UNIFORM_BUFFER, regionSize * FRAME_DATA_REGIONS, nullptr, GL_STREAM_DRAW);
+			staging.resize(regionSize * FRAME_DATA_REGIONS);
+			mapped = &staging[0];
+		}
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+	void release()
+	{
+		for (int i = 0; i < FRAME_DATA_REGIONS; i++)
+			waitFor(i);
+		if (persistent)
+		{
+			glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+			glUnmapBuffer(GL_UNIFORM_BUFFER);
+			glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		}
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+		mapped = nullptr;
+	}
+
+	// Rounds a size up to the next multiple of the uniform buffer alignment.
+	GLsizeiptr aligned(GLsizeiptr size)
+	{
+		return (size + alignment - 1) / alignment * alignment;
+	}
+
+	// Blocks until the GPU is done with the commands before the region's fence. Returns false if it was done already.
+	bool waitFor(int index)
+	{
+		if (fences[index] == 0)
+			return false;
+		GLenum result = glClientWaitSync(fences[index], 0, 0);
+		bool waited = (result == GL_TIMEOUT_EXPIRED);
+		// The first wait flushes, otherwise the fence might never reach the GPU.
+		GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+		while (result == GL_TIMEOUT_EXPIRED)
+		{
+			result = glClientWaitSync(fences[index], flags, 1000000000);
+			flags = 0;
+		}
+		glDeleteSync(fences[index]);
+		fences[index] = 0;
+		return waited;
+	}
+
+	// Moves on to the next region, waiting until the GPU has finished the frame that used it last.
+	void beginFrame()
+	{
+		region = (region + 1) % FRAME_DATA_REGIONS;
+		if (waitFor(region))
+			stalls++;
+		used = 0;
+		frames++;
+	}
+
+	void endFrame()
+	{
+		fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	// Hands out size bytes of this frame's region. offset is where they are in the buffer, for glBindBufferRange.
+	// The memory may be write-combined, so it should only be written, never read back.
+	char* allocate(GLsizeiptr size, GLintptr& offset)
+	{
+		size = aligned(size);
+		if (used + size > regionSize)
+			grow(size);
+
+		offset = region * regionSize + used;
+		used += size;
+		return mapped + offset;
+	}
+
+	// Sends what was written to [offset, offset + size) to the GPU. Only needed without persistent mapping,
+	// and must be called before the draws that read it.
+	void flush(GLintptr offset, GLsizeiptr size)
+	{
+		if (persistent || size == 0)
+			return;
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, offset, size, mapped + offset);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+	// Replaces the buffer with one whose regions hold at least size bytes.
+	// The draws already issued this frame keep the old buffer alive until they are done with it.
+	void grow(GLsizeiptr size)
+	{
+		GLsizeiptr newSize = std::max(regionSize * 2, aligned(size));
+		std::cout << "Frame data ring: growing the regions from " << regionSize / 1024 << "KB to " << newSize / 1024 << "KB\n";
+		release();
+		create(newSize);
+		used = 0;
+	}
+
+}frameRing;
+
+#endif _FRAME_DATA_RING_H
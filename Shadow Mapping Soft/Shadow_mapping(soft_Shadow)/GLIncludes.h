@@ -70,6 +70,10 @@ OpenGL 4 Shading language Cookbook
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 #include <soil\SOIL.h>
 #include "glew\glew.h"
 #include "glfw\glfw3.h"
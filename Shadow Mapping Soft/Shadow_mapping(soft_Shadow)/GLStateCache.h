@@ -0,0 +1,222 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: GLStateCache.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+A thin layer over the OpenGL calls we make every frame. OpenGL is a state machine,
+and a lot of our calls set the state to what it already is: the shadow map is bound
+to the same unit every frame, the light's position is uploaded even when it hasn't
+moved, and so on. Each of these calls still costs time in the driver.
+This struct remembers what we last set, and skips the call when nothing changes.
+It counts the calls it made and the ones it skipped, so we can see how much it saves.
+
+Everything that changes state behind its back (like creating textures in setup, or
+a new program from the shader reloader) has to call invalidate() afterwards.
+*/
+
+#ifndef _GL_STATE_CACHE_H
+#define _GL_STATE_CACHE_H
+
+#include "GLIncludes.h"
+#include <unordered_map>
+#include <cstring>
+
+#define STATE_CACHE_TEXTURE_UNITS 8
+#define STATE_UNKNOWN 0xFFFFFFFF		// Not a valid name for anything, so a cached value of this never matches
+
+struct GLStateCache
+{
+	GLuint program;
+	GLuint vertexArray;
+	GLuint drawFramebuffer;
+	GLuint readFramebuffer;
+	GLenum activeUnit;
+	GLuint texture2D[STATE_CACHE_TEXTURE_UNITS];
+	GLuint texture3D[STATE_CACHE_TEXTURE_UNITS];
+	GLuint textureCube[STATE_CACHE_TEXTURE_UNITS];
+	GLuint textureArray[STATE_CACHE_TEXTURE_UNITS];
+	GLuint subroutine;			// The fragment subroutine set for the current program. Reset by every program switch.
+
+	// The last value uploaded to each uniform. The key is the program in the high bits and the location in the low bits.
+	struct UniformValue
+	{
+		float values[16];
+		int count;
+	};
+	std::unordered_map<unsigned long long, UniformValue> uniforms;
+
+	// Number of calls made and skipped, for this frame and the last one.
+	int issued, elided;
+	int lastIssued, lastElided;
+
+	// Forget everything, so the next call of each kind is always made.
+	void invalidate()
+	{
+		program = STATE_UNKNOWN;
+		vertexArray = STATE_UNKNOWN;
+		drawFramebuffer = STATE_UNKNOWN;
+		readFramebuffer = STATE_UNKNOWN;
+		activeUnit = STATE_UNKNOWN;
+		subroutine = STATE_UNKNOWN;
+		for (int i = 0; i < STATE_CACHE_TEXTURE_UNITS; i++)
+		{
+			texture2D[i] = STATE_UNKNOWN;
+			texture3D[i] = STATE_UNKNOWN;
+			textureCube[i] = STATE_UNKNOWN;
+			textureArray[i] = STATE_UNKNOWN;
+		}
+		uniforms.clear();
+	}
+
+	// Call once at the end of every frame.
+	void endFrame()
+	{
+		lastIssued = issued;
+		lastElided = elided;
+		issued = 0;
+		elided = 0;
+	}
+
+	// Returns true if the call can be skipped, and counts it either way.
+	bool skip(bool unchanged)
+	{
+		if (unchanged)
+		{
+			elided++;
+			return true;
+		}
+		issued++;
+		return false;
+	}
+
+	void useProgram(GLuint id)
+	{
+		if (skip(program == id))
+			return;
+		glUseProgram(id);
+		program = id;
+		// Subroutine uniforms are lost whenever the program changes, so they have to be set again.
+		subroutine = STATE_UNKNOWN;
+	}
+
+	void bindVertexArray(GLuint id)
+	{
+		if (skip(vertexArray == id))
+			return;
+		glBindVertexArray(id);
+		vertexArray = id;
+	}
+
+	// Accepts GL_FRAMEBUFFER, GL_DRAW_FRAMEBUFFER and GL_READ_FRAMEBUFFER.
+	void bindFramebuffer(GLenum target, GLuint id)
+	{
+		bool draw = (target != GL_READ_FRAMEBUFFER);
+		bool read = (target != GL_DRAW_FRAMEBUFFER);
+		if (skip((!draw || drawFramebuffer == id) && (!read || readFramebuffer == id)))
+			return;
+		glBindFramebuffer(target, id);
+		if (draw)
+			drawFramebuffer = id;
+		if (read)
+			readFramebuffer = id;
+	}
+
+	// Binds a texture to a unit. Only switches the active unit if the binding actually changes.
+	void bindTexture(GLuint unit, GLenum target, GLuint id)
+	{
+		GLuint* bound = &texture2D[unit];
+		if (target == GL_TEXTURE_3D)
+			bound = &texture3D[unit];
+		else if (target == GL_TEXTURE_CUBE_MAP)
+			bound = &textureCube[unit];
+		else if (target == GL_TEXTURE_2D_ARRAY)
+			bound = &textureArray[unit];
+		if (skip(*bound == id))
+			return;
+		if (activeUnit != unit)
+		{
+			glActiveTexture(GL_TEXTURE0 + unit);
+			activeUnit = unit;
+		}
+		glBindTexture(target, id);
+		*bound = id;
+	}
+
+	void fragmentSubroutine(GLuint index)
+	{
+		if (skip(subroutine == index))
+			return;
+		glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &index);
+		subroutine = index;
+	}
+
+	// Compares the new value with the cached one for the current program, and stores it if it changed.
+	bool uniformUnchanged(GLint location, const float* values, int count)
+	{
+		// Uniforms the shader doesn't use have location -1. Setting them does nothing, so we don't even count them.
+		if (location < 0)
+			return true;
+
+		unsigned long long key = ((unsigned long long)program << 32) | (unsigned int)location;
+		UniformValue& cached = uniforms[key];
+		if (skip(cached.count == count && memcmp(cached.values, values, count * sizeof(float)) == 0))
+			return true;
+		memcpy(cached.values, values, count * sizeof(float));
+		cached.count = count;
+		return false;
+	}
+
+	void uniform1i(GLint location, int value)
+	{
+		float asFloat;
+		memcpy(&asFloat, &value, sizeof(float));	// Only the bits are compared, so we store them in a float slot as they are.
+		if (!uniformUnchanged(location, &asFloat, 1))
+			glUniform1i(location, value);
+	}
+
+	void uniform1f(GLint location, float value)
+	{
+		if (!uniformUnchanged(location, &value, 1))
+			glUniform1f(location, value);
+	}
+
+	void uniform3fv(GLint location, const glm::vec3& value)
+	{
+		if (!uniformUnchanged(location, glm::value_ptr(value), 3))
+			glUniform3fv(location, 1, glm::value_ptr(value));
+	}
+
+	void uniformMatrix3fv(GLint location, const glm::mat3& value)
+	{
+		if (!uniformUnchanged(location, glm::value_ptr(value), 9))
+			glUniformMatrix3fv(location, 1, GL_FALSE, glm::value_ptr(value));
+	}
+
+	void uniformMatrix4fv(GLint location, const glm::mat4& value)
+	{
+		if (!uniformUnchanged(location, glm::value_ptr(value), 16))
+			glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value));
+	}
+
+}glState;
+
+#endif _GL_STATE_CACHE_H
@@ -65,37 +65,118 @@ OpenGL 4 Shading language Cookbook
 #version 430 core // Identifies the version of the shader, this line must be on a separate line from the rest of the shader code
 
 layout(location = 0) out vec4 Color; // Establishes the variable we will pass out of this shader.
+// Second output, only attached in the temporal mode. Stores the shadow value and the view depth of this fragment,
+// so the next frame can reuse it.
+layout(location = 1) out vec2 ShadowHistoryOut;
 
 layout (binding = 0) uniform sampler2DShadow ShadowMap;
- 
-in vec3 Position;
-in vec3 Normal;
-in vec4 Albedo;
-in vec4 ShadowCoord;
 
-uniform struct PointLight
+layout(location = 0) in vec3 Position;
+layout(location = 1) in vec3 Normal;
+layout(location = 2) in vec4 Albedo;
+layout(location = 3) in vec4 ShadowCoord;
+layout(location = 4) in vec4 PrevClipPos;
+
+struct PointLight
 {
 	vec3 position;
 	vec3 Intensity;
-}pointLight;
+};
+
+// Everything that is the same for the whole frame. Written once per frame into the frame data ring (FrameDataRing.h).
+layout(std140, binding = 0) uniform FrameBlock
+{
+	PointLight pointLight;
+	vec3 OffsetTexsize;
+	int FrameIndex;			// Increments every frame. Picks the part of the pattern the temporal filter uses.
+	float HistoryWeight;	// How much of the new value goes in. 1 means ignore the history.
+	int UsePyramid;			// Whether the random sampling tests the depth pyramid first
+	int OmniShadows;		// 1 if the shadow comes from the cube shadow map instead of ShadowMap, 2 from the dual paraboloid map
+	int OmniFilter;			// The filter for the dual paraboloid map: 0 basic, 1 PCF, 2 and 3 random sampling
+	mat4 ViewToLight;		// From view space to world space around the light
+	vec2 CubeDepth;			// The depth of a face at distance d along its axis is x - y / d
+	vec2 ParaboloidDepth;	// The depth of a point at distance d from the light is (d - x) * y
+	vec4 ClusterScale;		// Clusters per pixel in xy. The slice at view depth d is log(d) * z + w.
+};
 
 layout (binding = 1) uniform sampler3D OffsetTex;
-uniform vec3 OffsetTexsize;
+
+// The spot lights with their shadows in the atlas (ShadowAtlas.h). Also fed from the frame data ring.
+#define MAX_ATLAS_LIGHTS 64
+
+struct AtlasLight
+{
+	mat4 ShadowMatrix;		// From view space to this light's tile in the atlas
+	vec4 Position;			// In view space. w is how far the light reaches.
+	vec4 Color;
+	vec4 Tile;				// The corners of the tile in the atlas: lowest in xy, highest in zw
+};
+
+layout(std140, binding = 2) uniform AtlasBlock
+{
+	int AtlasLightCount;
+	AtlasLight AtlasLights[MAX_ATLAS_LIGHTS];
+};
+
+layout (binding = 4) uniform sampler2DShadow ShadowAtlas;
+
+// All the lights of the frame, sorted into clusters of the view volume by ClusterLights.glsl (ClusteredLights.h).
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 16
+#define CLUSTERS_Z 24
+#define MAX_LIGHTS_PER_CLUSTER 128
+
+struct ClusterLight
+{
+	vec4 PositionRange;		// In view space
+	vec4 ColorShadow;		// w is the light's entry in AtlasLights, -1 if it has no shadow
+	vec4 DirectionCos;		// Where a spot light points and the cosine of half its cone. w is -2 for a point light.
+};
+
+layout(std430, binding = 0) readonly buffer LightBuffer
+{
+	ClusterLight Lights[];
+};
+
+layout(std430, binding = 1) readonly buffer ClusterCountBuffer
+{
+	uint ClusterCounts[];
+};
+
+layout(std430, binding = 2) readonly buffer ClusterIndexBuffer
+{
+	uint ClusterIndices[];
+};
+
+#ifdef GL_SPIRV
+// When this file is compiled to SPIR-V (glslangValidator -G defines GL_SPIRV), subroutines are not available.
+// Instead, the filter and its parameters are specialization constants, which are set when the program is loaded.
+// The driver then compiles a separate version of the shader for each filter, with the loop bounds known.
+layout(constant_id = 0) const int ShadowFilter = 0;		// 0 basic, 1 PCF, 2 random sampling, 3 temporal
+layout(constant_id = 1) const int SamplesDiv2 = 8;
+layout(constant_id = 2) const float KernelRadius = 0.004f;
+#define SHADOW_FILTER
+#define SAMPLES_DIV2 SamplesDiv2
+#else
+const float KernelRadius = 0.004f;
+#define SHADOW_FILTER subroutine (shadowSubType)
+#define SAMPLES_DIV2 int (OffsetTexsize.z)
 
 subroutine float shadowSubType();
 
 
 subroutine uniform shadowSubType shadowSubUniform;
+#endif
 
 // Basic shadow: just sample the texture and return
-subroutine (shadowSubType) 
+SHADOW_FILTER
 float basicShadow()
 {
 	return textureProj(ShadowMap, ShadowCoord);
 }
 
 // PCF: Sample the surrounding texels and find the average value
-subroutine (shadowSubType) 
+SHADOW_FILTER
 float PCFshadow()
 {
 	float sum = 0;
@@ -109,17 +190,76 @@ float PCFshadow()
 	return sum * 0.25f; //textureProj(ShadowMap, ShadowCoord);
 }
 
+// Min/max depth pyramid of the shadow map (see DepthPyramid.h). Closest depth in r, farthest in g.
+// A texel of level n covers 2^(n+1) texels of the shadow map on each side.
+layout (binding = 3) uniform sampler2D DepthPyramid;
+
+// Per frame counts of the fragments that skipped the taps (FastPathCount) and that took them (FullPathCount).
+layout(binding = 0, offset = 0) uniform atomic_uint FastPathCount;
+layout(binding = 0, offset = 4) uniform atomic_uint FullPathCount;
+
+// Tests the whole area the taps can reach against the pyramid.
+// Returns 1 if every tap would be lit, 0 if every tap would be in shadow, and -1 if we have to take the taps to know.
+float pyramidShadow(float radius)
+{
+	if (UsePyramid == 0 || ShadowCoord.w <= 0.0f)
+		return -1.0f;
+
+	// The offsets are at most 1 in x and y, times the radius. The linear filter reads one more texel on each side.
+	vec2 center = ShadowCoord.xy / ShadowCoord.w;
+	vec2 size = vec2(textureSize(ShadowMap, 0));
+	ivec2 low = ivec2(floor((center - radius) * size - 0.5f));
+	ivec2 high = ivec2(floor((center + radius) * size - 0.5f)) + 1;
+
+	// Outside the shadow map the taps return the border, which the pyramid doesn't know about.
+	if (any(lessThan(low, ivec2(0))) || any(greaterThanEqual(high, ivec2(size))))
+		return -1.0f;
+
+	// The smallest level where the area falls into at most 2x2 texels.
+	int span = max(high.x - low.x, high.y - low.y) + 1;
+	int level = min(max(int(ceil(log2(float(span)))) - 1, 0), textureQueryLevels(DepthPyramid) - 1);
+
+	ivec2 levelSize = textureSize(DepthPyramid, level);
+	ivec2 low2 = min(low >> (level + 1), levelSize - 1);
+	ivec2 high2 = min(high >> (level + 1), levelSize - 1);
+
+	vec2 range = texelFetch(DepthPyramid, low2, level).rg;
+	vec2 other = texelFetch(DepthPyramid, ivec2(high2.x, low2.y), level).rg;
+	range = vec2(min(range.x, other.x), max(range.y, other.y));
+	other = texelFetch(DepthPyramid, ivec2(low2.x, high2.y), level).rg;
+	range = vec2(min(range.x, other.x), max(range.y, other.y));
+	other = texelFetch(DepthPyramid, high2, level).rg;
+	range = vec2(min(range.x, other.x), max(range.y, other.y));
+
+	// The comparison is GL_LESS against the depth clamped to [0, 1], same as textureProj does.
+	float depth = clamp(ShadowCoord.z / ShadowCoord.w, 0.0f, 1.0f);
+	if (depth < range.x)
+		return 1.0f;
+	if (depth >= range.y)
+		return 0.0f;
+	return -1.0f;
+}
+
 // Random sampling
-subroutine (shadowSubType) 
+SHADOW_FILTER
 float randomSamplingShadow()
 {
-	float radius = 0.004f;
+	float radius = KernelRadius;
+
+	// If the whole area is in front of or behind the fragment, all the taps give the same answer.
+	float known = pyramidShadow(radius);
+	if (known >= 0.0f)
+	{
+		atomicCounterIncrement(FastPathCount);
+		return known;
+	}
+	atomicCounterIncrement(FullPathCount);
 
 	ivec3 offsetCoord;
 	offsetCoord.xy = ivec2(mod(gl_FragCoord.xy, OffsetTexsize.xy));
 
 	float sum = 0;
-	int samplesDiv2 = int (OffsetTexsize.z);
+	int samplesDiv2 = SAMPLES_DIV2;
 	vec4 sc = ShadowCoord;
 
 	// Sample the texels on the outskirts of the area.
@@ -160,6 +300,132 @@ float randomSamplingShadow()
 	return shadow;
 }
 
+// Temporal random sampling
+// Instead of taking every sample in one frame, we only take a few of them and rotate the pattern every frame.
+// The result is blended with what this surface looked like last frame, so over a few frames we get
+// the same penumbra as randomSamplingShadow for a fraction of the cost.
+layout (binding = 2) uniform sampler2D ShadowHistory;	// Shadow value (r) and view depth (g) from the last frame
+
+const int TemporalSamplesDiv2 = 4;		// 8 samples per frame
+const float DepthRejection = 0.02f;		// Allowed relative difference in depth before the history is thrown away
+
+SHADOW_FILTER
+float temporalSamplingShadow()
+{
+	float radius = KernelRadius;
+
+	ivec3 offsetCoord;
+	offsetCoord.xy = ivec2(mod(gl_FragCoord.xy, OffsetTexsize.xy));
+
+	float sum = 0;
+	int samplesDiv2 = SAMPLES_DIV2;
+	vec4 sc = ShadowCoord;
+
+	// Rotate the whole pattern by the golden angle every frame so the samples don't land on the same texels again.
+	float angle = float(FrameIndex) * 2.3999632f;
+	mat2 rotation = mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+
+	for( int i=0; i < TemporalSamplesDiv2; i++)
+	{
+		// Walk through a different set of slices of the offset texture every frame.
+		offsetCoord.z = (FrameIndex * TemporalSamplesDiv2 + i) % samplesDiv2;
+		vec4 offsets = texelFetch(OffsetTex, offsetCoord, 0) * radius * ShadowCoord.w;
+
+		sc.xy = ShadowCoord.xy + rotation * offsets.xy;
+		sum += textureProj(ShadowMap, sc);
+		sc.xy = ShadowCoord.xy + rotation * offsets.zw;
+		sum+= textureProj(ShadowMap, sc);
+	}
+
+	float shadow = sum / float(TemporalSamplesDiv2 * 2);
+
+	// Find where this surface was on screen last frame.
+	vec2 prevUV = (PrevClipPos.xy / PrevClipPos.w) * 0.5f + 0.5f;
+	vec2 history = texture(ShadowHistory, prevUV).rg;
+
+	// The history is only usable if the point was on screen, and the depth stored there is the depth we expect.
+	// If something else was covering that pixel last frame, the depths won't match and we start over.
+	bool onScreen = all(greaterThanEqual(prevUV, vec2(0.0f))) && all(lessThanEqual(prevUV, vec2(1.0f)));
+	bool sameSurface = abs(history.g - PrevClipPos.w) < DepthRejection * PrevClipPos.w;
+
+	if(onScreen && sameSurface)
+	{
+		shadow = mix(history.r, shadow, HistoryWeight);
+	}
+
+	return shadow;
+}
+
+// Shadows all around the light, from the cube shadow map (CubeShadowMap.h).
+layout (binding = 5) uniform samplerCubeShadow ShadowCube;
+
+// 4 tap PCF. The taps are moved across the direction, one texel of the face apart.
+float cubeShadow()
+{
+	vec3 direction = vec3(ViewToLight * vec4(Position, 1.0f));
+	vec3 size = abs(direction);
+	float distance = max(size.x, max(size.y, size.z));
+	float depth = CubeDepth.x - CubeDepth.y / distance;
+
+	// A texel of a face is 2 / size wide at distance 1 along its axis.
+	float step = distance / float(textureSize(ShadowCube, 0).x);
+	float sum = 0.0f;
+	sum += texture(ShadowCube, vec4(direction + vec3(step, step, step), depth));
+	sum += texture(ShadowCube, vec4(direction + vec3(step, -step, -step), depth));
+	sum += texture(ShadowCube, vec4(direction + vec3(-step, step, -step), depth));
+	sum += texture(ShadowCube, vec4(direction + vec3(-step, -step, step), depth));
+	return sum * 0.25f;
+}
+
+// Shadows all around the light, from the dual paraboloid map (ParaboloidShadowMap.h). Layer 0 looks down, layer 1 up.
+layout (binding = 6) uniform sampler2DArrayShadow ShadowParaboloid;
+
+// Where this fragment is in the dual paraboloid map: the point on the map in xy, the layer in z and the depth in w.
+vec4 paraboloidCoord()
+{
+	vec3 v = vec3(ViewToLight * vec4(Position, 1.0f));
+	float distance = length(v);
+	vec3 d = v / distance;
+	float layer = (d.y <= 0.0f) ? 0.0f : 1.0f;
+	float side = layer * 2.0f - 1.0f;
+	vec2 p = vec2(d.x, side * d.z) / (1.0f + side * d.y);
+	return vec4(p * 0.5f + 0.5f, layer, (distance - ParaboloidDepth.x) * ParaboloidDepth.y);
+}
+
+// The same filters as the light's own shadow map, on the dual paraboloid map.
+float paraboloidShadow()
+{
+	vec4 sc = paraboloidCoord();
+	if (OmniFilter == 0)
+		return texture(ShadowParaboloid, sc);
+
+	float sum = 0;
+	if (OmniFilter == 1)
+	{
+		sum += textureOffset(ShadowParaboloid, sc, ivec2(-1,-1));
+		sum += textureOffset(ShadowParaboloid, sc, ivec2(1,-1));
+		sum += textureOffset(ShadowParaboloid, sc, ivec2(-1,1));
+		sum += textureOffset(ShadowParaboloid, sc, ivec2(1,1));
+		return sum * 0.25f;
+	}
+
+	// Random sampling: the outskirts of the area first, and the rest only if they don't all agree.
+	ivec3 offsetCoord;
+	offsetCoord.xy = ivec2(mod(gl_FragCoord.xy, OffsetTexsize.xy));
+	int samplesDiv2 = SAMPLES_DIV2;
+	for (int i = 0; i < samplesDiv2; i++)
+	{
+		offsetCoord.z = i;
+		vec4 offsets = texelFetch(OffsetTex, offsetCoord, 0) * KernelRadius;
+		sum += texture(ShadowParaboloid, vec4(sc.xy + offsets.xy, sc.zw));
+		sum += texture(ShadowParaboloid, vec4(sc.xy + offsets.zw, sc.zw));
+
+		if (i == 3 && (sum == 0.0f || sum == 8.0f))
+			return sum / 8.0f;
+	}
+	return sum / float(samplesDiv2 * 2);
+}
+
 // calculate the light's component in coloring the fragment
 vec3 diffuseModel (vec3 pos, vec3 norm, vec3 diff)
 {
@@ -170,6 +436,66 @@ vec3 diffuseModel (vec3 pos, vec3 norm, vec3 diff)
 	return diffuse;
 }
 
+// The shadow of a light from its tile in the atlas, with a 4 tap PCF.
+float atlasShadow(int i, vec3 pos)
+{
+	vec4 sc = AtlasLights[i].ShadowMatrix * vec4(pos, 1.0f);
+	if (sc.w <= 0.0f)
+		return 0.0f;
+	vec3 p = sc.xyz / sc.w;
+
+	// Outside the tile is outside the light's cone.
+	vec4 tile = AtlasLights[i].Tile;
+	if (any(lessThan(p.xy, tile.xy)) || any(greaterThan(p.xy, tile.zw)) || p.z > 1.0f)
+		return 0.0f;
+
+	// The taps stay inside the tile, the texels next to it belong to another light.
+	vec2 texel = 1.0f / vec2(textureSize(ShadowAtlas, 0));
+	vec2 low = tile.xy + texel;
+	vec2 high = tile.zw - texel;
+	float shadow = 0.0f;
+	shadow += texture(ShadowAtlas, vec3(clamp(p.xy + vec2(-0.5f, -0.5f) * texel, low, high), p.z));
+	shadow += texture(ShadowAtlas, vec3(clamp(p.xy + vec2(0.5f, -0.5f) * texel, low, high), p.z));
+	shadow += texture(ShadowAtlas, vec3(clamp(p.xy + vec2(-0.5f, 0.5f) * texel, low, high), p.z));
+	shadow += texture(ShadowAtlas, vec3(clamp(p.xy + vec2(0.5f, 0.5f) * texel, low, high), p.z));
+	return shadow * 0.25f;
+}
+
+// The light of every light in this fragment's cluster. Only the ones with a tile in the atlas cast shadows.
+vec3 clusteredLights(vec3 pos, vec3 norm, vec3 diff)
+{
+	ivec3 cell;
+	cell.xy = ivec2(gl_FragCoord.xy * ClusterScale.xy);
+	cell.z = int(log(max(-pos.z, 1e-4f)) * ClusterScale.z + ClusterScale.w);
+	cell = clamp(cell, ivec3(0), ivec3(CLUSTERS_X - 1, CLUSTERS_Y - 1, CLUSTERS_Z - 1));
+	uint cluster = uint(cell.x + CLUSTERS_X * (cell.y + CLUSTERS_Y * cell.z));
+
+	vec3 result = vec3(0.0f);
+	uint count = ClusterCounts[cluster];
+	for (uint j = 0; j < count; j++)
+	{
+		ClusterLight light = Lights[ClusterIndices[cluster * MAX_LIGHTS_PER_CLUSTER + j]];
+
+		vec3 toLight = light.PositionRange.xyz - pos;
+		float distance = length(toLight);
+		float falloff = clamp(1.0f - distance / light.PositionRange.w, 0.0f, 1.0f);
+		vec3 s = toLight / max(distance, 1e-4f);
+		float nDotL = max(dot(s, norm), 0.0f);
+		if (falloff * nDotL <= 0.0f)
+			continue;
+
+		// Spot lights only light their cone.
+		if (light.DirectionCos.w > -1.5f && dot(-s, light.DirectionCos.xyz) < light.DirectionCos.w)
+			continue;
+
+		float shadow = 1.0f;
+		if (light.ColorShadow.w >= 0.0f)
+			shadow = atlasShadow(int(light.ColorShadow.w), pos);
+		result += light.ColorShadow.rgb * (diff * nDotL) * (falloff * shadow);
+	}
+	return result;
+}
+
 void main(void)
 {
 	//Set the ambient light value. Models in shadow would be only lit by ambient light
@@ -178,7 +504,33 @@ void main(void)
 	// So when we sample the texture, it compare it with the current depth value and returns
 	// 1 if the point is closer than the one on the texture, else it returns 0.
 
-	float shadow = shadowSubUniform();
-
-	Color = vec4((diffuseModel(Position, Normal, Albedo.xyz) * shadow) + Ambient, 1.0f);
+#ifdef GL_SPIRV
+	// ShadowFilter is a constant by the time the driver compiles this, so only one branch is left.
+	float shadow;
+	if (OmniShadows == 1)
+		shadow = cubeShadow();
+	else if (OmniShadows == 2)
+		shadow = paraboloidShadow();
+	else if (ShadowFilter == 0)
+		shadow = basicShadow();
+	else if (ShadowFilter == 1)
+		shadow = PCFshadow();
+	else if (ShadowFilter == 2)
+		shadow = randomSamplingShadow();
+	else
+		shadow = temporalSamplingShadow();
+#else
+	float shadow;
+	if (OmniShadows == 1)
+		shadow = cubeShadow();
+	else if (OmniShadows == 2)
+		shadow = paraboloidShadow();
+	else
+		shadow = shadowSubUniform();
+#endif
+
+	// The view depth is the distance along the camera's forward axis, same as the w of the clip coordinates.
+	ShadowHistoryOut = vec2(shadow, -Position.z);
+
+	Color = vec4((diffuseModel(Position, Normal, Albedo.xyz) * shadow) + clusteredLights(Position, normalize(Normal), Albedo.xyz) + Ambient, 1.0f);
 }
\ No newline at end of file
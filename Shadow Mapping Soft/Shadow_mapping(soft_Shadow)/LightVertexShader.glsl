@@ -68,15 +68,23 @@ layout(location = 0) in vec3 in_position;	// Get in a vec3 for position
 layout(location = 1) in vec3 in_normal;
 layout(location = 2) in vec4 in_color;		// Get in a vec4 for color
 
-out vec3 Position;
-out vec3 Normal;
-out vec4 Albedo;
-out vec4 ShadowCoord;
+// The outputs have explicit locations, since SPIR-V shaders match them by location instead of by name.
+layout(location = 0) out vec3 Position;
+layout(location = 1) out vec3 Normal;
+layout(location = 2) out vec4 Albedo;
+layout(location = 3) out vec4 ShadowCoord;
+layout(location = 4) out vec4 PrevClipPos;
 
-uniform mat4 MVP;
-uniform mat4 ModelViewMatrix;
-uniform mat3 NormalMatrix;
-uniform mat4 ShadowMatrix;
+// The matrices of the object being drawn. They are written into the frame data ring (FrameDataRing.h),
+// and every draw binds its own part of it here.
+layout(std140, binding = 1) uniform ObjectBlock
+{
+	mat4 MVP;
+	mat4 ModelViewMatrix;
+	mat3 NormalMatrix;
+	mat4 ShadowMatrix;
+	mat4 PrevMVP;		// The MVP of the previous frame. Used to find where this vertex was on screen last frame.
+};
 
 void main(void)
 {
@@ -86,6 +94,8 @@ void main(void)
 	Albedo = in_color;
 	// Convert the coordinates from model space to clip coordinates from the perspective of the light source.
 	ShadowCoord = ShadowMatrix * vec4(in_position, 1.0f);
+	// Clip coordinates from the previous frame's camera, used to reproject the shadow history.
+	PrevClipPos = PrevMVP * vec4(in_position, 1.0f);
 
 	gl_Position = MVP * vec4(in_position, 1.0f);
 }
\ No newline at end of file
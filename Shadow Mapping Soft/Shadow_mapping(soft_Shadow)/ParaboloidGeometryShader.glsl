@@ -0,0 +1,85 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: ParaboloidGeometryShader.glsl
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+Draws every triangle into the halves of the dual paraboloid shadow map it is in,
+in one pass (see ParaboloidShadowMap.h). The shader is instanced twice: instance
+0 draws the half looking down, instance 1 the half looking up, each into its own
+layer of the texture.
+Every vertex is projected onto the paraboloid here, since the projection can't be
+done with a matrix. Triangles that cross the edge of the half are clipped there
+by gl_ClipDistance, so the part in the other half doesn't end up stretched across
+the map.
+*/
+
+#version 430 core
+
+layout(triangles, invocations = 2) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+layout(std140, binding = 4) uniform ParaboloidBlock
+{
+	vec4 LightPosition;
+	vec2 Depth;				// The depth of a point at distance d is (d - x) * y
+};
+
+layout(std140, binding = 1) uniform ObjectBlock
+{
+	mat4 Model;
+	int FaceMask;			// Bit 0 for the half looking down, bit 1 for the one looking up
+};
+
+void main(void)
+{
+	int layer = gl_InvocationID;
+	if ((FaceMask & (1 << layer)) == 0)
+		return;
+
+	// The half looking down sees z upside down, so that neither half is mirrored and the culling still works.
+	float side = (layer == 0) ? -1.0f : 1.0f;
+
+	vec4 corners[3];
+	float along[3];
+	for (int i = 0; i < 3; i++)
+	{
+		vec3 v = gl_in[i].gl_Position.xyz - LightPosition.xyz;
+		float distance = length(v);
+		vec3 d = v / distance;
+		along[i] = side * d.y;
+		vec2 p = vec2(d.x, side * d.z) / max(1.0f + along[i], 1e-3f);
+		corners[i] = vec4(p, (distance - Depth.x) * Depth.y * 2.0f - 1.0f, 1.0f);
+	}
+
+	// All in the other half.
+	if (along[0] < 0.0f && along[1] < 0.0f && along[2] < 0.0f)
+		return;
+
+	for (int i = 0; i < 3; i++)
+	{
+		gl_Layer = layer;
+		gl_ClipDistance[0] = along[i];
+		gl_Position = corners[i];
+		EmitVertex();
+	}
+	EndPrimitive();
+}
@@ -0,0 +1,141 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: ParaboloidShadowMap.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+A cheaper way to give the light shadows in every direction than the cube shadow
+map (CubeShadowMap.h): two maps instead of six, each covering half of the sphere
+around the light.
+
+Each half is squashed onto a disk by a paraboloid. For a direction d from the
+light, in the half that looks down the axis a, the point on the map is
+	(d.x, d.z) / (1 + d.a)
+which is 0 straight down the axis and on the unit circle at the edge of the half.
+Unlike a perspective projection this is not linear, so it can't be done with a
+matrix: every vertex is projected by the geometry shader, and the straight edge
+of a triangle between two vertices is really a curve on the map. So the shadows of
+big triangles are a little off, the spheres here are fine.
+The depth is simply the distance from the light, scaled into [0, 1].
+
+The two halves look straight down and straight up, since the light is above the
+scene and almost everything ends up in the half looking down.
+
+Both halves are layers of one 2D array texture, and drawn in one pass the same
+way as the cube: the geometry shader is instanced twice, and each instance writes
+gl_Layer and drops the objects and triangles that are all in the other half.
+Most objects are only in one half, against one to three faces of the cube, so a
+lot less is drawn. The triangles that cross the edge are clipped there with
+gl_ClipDistance.
+
+The map is read with a sampler2DArrayShadow, with the same basic, PCF and random
+sampling filters as the light's shadow map, picked with the keys 1 to 4.
+*/
+
+#ifndef _PARABOLOID_SHADOW_MAP_H
+#define _PARABOLOID_SHADOW_MAP_H
+
+#include "GLIncludes.h"
+#include "CubeShadowMap.h"
+
+#define PARABOLOID_SIZE 1024
+#define PARABOLOID_TEXTURE_UNIT 6
+#define PARABOLOID_BLOCK_BINDING 4
+
+// ParaboloidBlock in ParaboloidGeometryShader.glsl.
+struct ParaboloidUniforms
+{
+	glm::vec4 LightPosition;
+	glm::vec2 Depth;				// depthParams()
+};
+
+struct ParaboloidShadowMap
+{
+	GLuint texture;
+	GLuint fbo;
+	GLuint program;					// Set to 0 by finishPrograms() if it fails to link
+	GLuint geometryShader;
+	bool usable;					// False if the framebuffer couldn't be made
+
+	// Call after cubeShadow.init(), its vertex shader is shared.
+	void init()
+	{
+		usable = true;
+		GLfloat border[] = { 1.0f, 0.0f, 0.0f, 0.0f };
+
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT24, PARABOLOID_SIZE, PARABOLOID_SIZE, 2);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, border);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LESS);
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0);
+		GLenum drawbuf[] = { GL_NONE };
+		glDrawBuffers(1, drawbuf);
+		glReadBuffer(GL_NONE);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			usable = false;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		// The vertex shader is the cube's, which only takes the vertex to world space, and the fragment shader the
+		// shared depth-only one, so only the geometry shader is compiled here. finishPrograms() checks the program.
+		geometryShader = submitShaderFile("ParaboloidGeometryShader.glsl", GL_GEOMETRY_SHADER);
+		GLuint shaders[] = { cubeShadow.vertexShader, geometryShader, sharedDepthFragmentShader() };
+		program = submitLinkedProgram("CubeShadowVertexShader.glsl + ParaboloidGeometryShader.glsl + FragmentShader.glsl",
+			shaders, 3, &program);
+
+		if (!usable)
+			std::cout << "Dual paraboloid shadow map not created.\n";
+	}
+
+	// Whether the map can be drawn: it has its framebuffer, and its program linked. Only known after finishPrograms().
+	bool ready() const
+	{
+		return usable && program != 0;
+	}
+
+	void release()
+	{
+		glDeleteProgram(program);
+		glDeleteShader(geometryShader);
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &texture);
+		program = 0;
+		fbo = 0;
+		texture = 0;
+	}
+
+	// The depth stored for a point at distance d from the light is (d - x) * y. Same range as the cube.
+	static glm::vec2 depthParams()
+	{
+		return glm::vec2(CUBE_NEAR, 1.0f / (CUBE_FAR - CUBE_NEAR));
+	}
+
+}paraboloidShadow;
+
+#endif _PARABOLOID_SHADOW_MAP_H
@@ -0,0 +1,209 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: RayTracer.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+A ray tracer that computes what the soft shadows should really look like, so the
+shadow mapping techniques have something to be compared against.
+
+A real light is not a point, it has a size. A point on the ground is in full light
+if it can see the whole light, in full shadow if it can see none of it, and in the
+penumbra if it sees only part of it. So for every pixel we find the surface the
+camera sees (by shooting a ray through the pixel), and then shoot many rays from
+that surface to points spread over the light, which is a disk facing the surface.
+The fraction of the rays that reach the light is the shadow value.
+
+Our scene is only spheres and a plane, so we don't need any triangles: a ray hits
+a sphere where the distance to the center equals the radius, which is a quadratic
+equation, and it hits the plane where its height equals the plane's height. So the
+result is exact, apart from the noise from using a limited number of rays.
+
+The rows of the image are spread over the thread pool.
+*/
+
+#ifndef _RAY_TRACER_H
+#define _RAY_TRACER_H
+
+#include "GLIncludes.h"
+#include "ThreadPool.h"
+
+struct RaySphere
+{
+	glm::vec3 center;
+	float radius;
+};
+
+struct ShadowRayTracer
+{
+	std::vector<RaySphere> spheres;
+	float planeHeight;				// The plane is horizontal, at this height
+	float planeExtent;				// and goes from -extent to +extent in x and z
+
+	glm::mat4 inversePV;			// Takes a point on the screen back to the world
+	int width, height;
+
+	glm::vec3 lightPosition;
+	float lightRadius;				// Radius of the disk light. 0 gives hard shadows.
+	int lightSamples;				// Rays per pixel along each side of the grid, so lightSamples^2 rays in total
+
+	// The fraction of the light visible from every pixel, bottom row first. -1 where the camera ray hits nothing,
+	// and on surfaces facing away from the light, which are dark whatever the shadow is.
+	std::vector<float> visibility;
+	double seconds;
+
+	void init(int w, int h)
+	{
+		width = w;
+		height = h;
+		spheres.clear();
+		planeHeight = 0.0f;
+		planeExtent = 10.0f;
+		lightRadius = 1.0f;
+		lightSamples = 16;
+	}
+
+	// Finds the closest surface along the ray, up to maxDistance. Returns false if there is none.
+	bool intersect(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float& distance, glm::vec3& normal) const
+	{
+		bool hit = false;
+		distance = maxDistance;
+
+		for (unsigned int i = 0; i < spheres.size(); i++)
+		{
+			// |origin + t * direction - center| = radius, with direction normalized
+			glm::vec3 oc = origin - spheres[i].center;
+			float b = glm::dot(oc, direction);
+			float c = glm::dot(oc, oc) - spheres[i].radius * spheres[i].radius;
+			float discriminant = b * b - c;
+			if (discriminant < 0.0f)
+				continue;
+
+			float root = sqrtf(discriminant);
+			float t = -b - root;
+			if (t <= 0.0f)
+				t = -b + root;		// We are inside the sphere
+			if (t > 0.0f && t < distance)
+			{
+				distance = t;
+				normal = (origin + direction * t - spheres[i].center) / spheres[i].radius;
+				hit = true;
+			}
+		}
+
+		if (direction.y != 0.0f)
+		{
+			float t = (planeHeight - origin.y) / direction.y;
+			glm::vec3 p = origin + direction * t;
+			if (t > 0.0f && t < distance && fabs(p.x) <= planeExtent && fabs(p.z) <= planeExtent)
+			{
+				distance = t;
+				normal = glm::vec3(0.0f, 1.0f, 0.0f);
+				hit = true;
+			}
+		}
+
+		return hit;
+	}
+
+	// A small hash, so every pixel gets its own rotation of the sample grid without any shared random state.
+	static float hashToUnit(unsigned int x)
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352d;
+		x ^= x >> 15;
+		x *= 0x846ca68b;
+		x ^= x >> 16;
+		return (x & 0xFFFFFF) / 16777216.0f;
+	}
+
+	// The fraction of the light that can be seen from point, on a surface with the given normal.
+	float lightVisibility(const glm::vec3& point, const glm::vec3& normal, unsigned int seed) const
+	{
+		// Move the start a little off the surface, so the rays don't hit the surface they start from.
+		glm::vec3 origin = point + normal * 1e-3f;
+
+		// Two axes across the disk, which faces the point.
+		glm::vec3 toLight = glm::normalize(lightPosition - origin);
+		glm::vec3 helper = fabs(toLight.y) < 0.9f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+		glm::vec3 axisU = glm::normalize(glm::cross(helper, toLight));
+		glm::vec3 axisV = glm::cross(toLight, axisU);
+
+		float jitterU = hashToUnit(seed);
+		float jitterV = hashToUnit(seed * 747796405u + 2891336453u);
+
+		int visible = 0;
+		for (int i = 0; i < lightSamples; i++)
+		{
+			for (int j = 0; j < lightSamples; j++)
+			{
+				// A jittered grid on the unit square, spread evenly over the disk (the area grows with r^2, hence the sqrt).
+				float u = (i + jitterU) / lightSamples;
+				float v = (j + jitterV) / lightSamples;
+				float r = sqrtf(u) * lightRadius;
+				float angle = 2.0f * 3.14159265f * v;
+				glm::vec3 target = lightPosition + axisU * (r * cosf(angle)) + axisV * (r * sinf(angle));
+
+				glm::vec3 direction = target - origin;
+				float length = glm::length(direction);
+				float distance;
+				glm::vec3 unused;
+				if (!intersect(origin, direction / length, length, distance, unused))
+					visible++;
+			}
+		}
+
+		return visible / float(lightSamples * lightSamples);
+	}
+
+	void render()
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+		visibility.assign(width * height, -1.0f);
+
+		threadPool.parallelFor(height, [&](int y)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				// The pixel center on the near and far planes, in world space.
+				glm::vec2 ndc((x + 0.5f) / width * 2.0f - 1.0f, (y + 0.5f) / height * 2.0f - 1.0f);
+				glm::vec4 nearPoint = inversePV * glm::vec4(ndc, -1.0f, 1.0f);
+				glm::vec4 farPoint = inversePV * glm::vec4(ndc, 1.0f, 1.0f);
+				glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+				glm::vec3 direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
+
+				float distance;
+				glm::vec3 normal;
+				if (!intersect(origin, direction, 1e9f, distance, normal))
+					continue;
+
+				glm::vec3 point = origin + direction * distance;
+				if (glm::dot(normal, lightPosition - point) > 0.0f)
+					visibility[y * width + x] = lightVisibility(point, normal, y * width + x);
+			}
+		});
+
+		seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+	}
+
+}rayTracer;
+
+#endif _RAY_TRACER_H
@@ -0,0 +1,543 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: Scene.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+The list of objects in the scene, and the work done on them every frame before
+anything is drawn. For every object we need its matrices for this frame (the
+same MVP, ModelView and NormalMatrix the shaders get), whether the camera and
+the light can see it at all, and then the lists of draw calls for both passes.
+
+With three objects none of this matters, but the cost grows with the number of
+objects, so all three steps run on the thread pool:
+The transforms are independent for every object, so the objects are just split
+into chunks (the grain size) and the chunks are spread over the threads. Within a
+chunk they are done 4 at a time with SSE, from positions kept as a structure of
+arrays (TransformStore.h).
+Culling tests the bounding sphere of each object against the six planes of the
+camera's and the light's view volumes. Every chunk writes the indices of its
+visible objects into two short lists of its own.
+Testing every object costs the same however few of them can be seen, so by default
+the culling walks a bounding volume hierarchy instead (SceneBVH.h), and only the
+matrices of the objects that passed are computed. Then the chunks are subtrees of
+the hierarchy instead of ranges of objects, and the lists come out in the order of
+the tree.
+The draw lists are built from those. A running sum of the lengths of the lists
+tells each chunk where its draws start in the draw list, and then every chunk
+writes its draws there. So the threads never write to the same place, and the
+list comes out in the same order as if it was built on one thread.
+The objects the light sees go into two shadow lists: the ones that never move and
+the dynamic ones. The first only has to be drawn when the light moves, into a
+cached shadow map (StaticShadowCache.h), the second is drawn every frame.
+
+None of this outlives the frame, so it all comes from an arena (FrameArena.h)
+that is reset at the start of every update(). The lists of a chunk come from the
+sub-arena of the thread running it, so the threads don't have to share anything.
+
+The planes of a view volume come straight out of its view-projection matrix: a
+point is inside if -w <= x <= w and the same for y and z, and each of those six
+inequalities is a plane once the point is multiplied by the matrix.
+
+An object can have coarser versions of its mesh (MeshLODs). Every draw picks the
+coarsest one whose edges are still short on the screen, or in the shadow map for
+the shadow passes. How big the object's radius is there comes from the w of its
+center, which is already in the MVP: the radius times the pixels per unit at a
+distance of one, divided by w. The shadow passes allow longer edges, since the
+filters blur the shadow anyway and only the outline of a caster shows.
+*/
+
+#ifndef _SCENE_H
+#define _SCENE_H
+
+#include "GLIncludes.h"
+#include "ThreadPool.h"
+#include "FrameArena.h"
+#include "TransformStore.h"
+#include "SceneBVH.h"
+
+// Uses stuff_for_drawing from BasicFunctions.h, so include this after it.
+
+// Number of objects in one task. Small enough that the threads can balance, big enough that a task is worth it.
+#define SCENE_GRAIN_SIZE 256
+// The SSE kernels of the TransformStore write 4 objects at a time, also past the end of a chunk,
+// so a chunk has to start where the one before it stops writing.
+static_assert(SCENE_GRAIN_SIZE % 4 == 0, "SCENE_GRAIN_SIZE has to be a multiple of 4");
+
+// The longest an edge of a mesh can be, in pixels in the camera pass and in texels in the shadow passes.
+#define CAMERA_LOD_EDGE 8.0f
+#define SHADOW_LOD_EDGE 16.0f
+#define MAX_MESH_LODS 4
+
+// A mesh and coarser versions of it, finest first. segments is how many edges go around the mesh at each level,
+// so an edge of level l is about 2 pi radius / segments[l] long.
+struct MeshLODs
+{
+	const stuff_for_drawing* levels[MAX_MESH_LODS];
+	int segments[MAX_MESH_LODS];
+	int count;
+};
+
+struct SceneObject
+{
+	const stuff_for_drawing* mesh;		// Shared by all objects with the same shape
+	glm::vec3 origin;
+	float radius;						// Of the bounding sphere around the origin
+	bool dynamic;						// Can move, so it is drawn into the shadow map every frame
+	const MeshLODs* lods;				// nullptr if mesh is the only level
+};
+
+// The matrices of one object for one frame, as glm computes them one object at a time.
+// update() doesn't use this any more, --bench-transforms compares the TransformStore with it.
+struct ObjectTransform
+{
+	glm::mat4 Model;
+	glm::mat4 MVP;
+	glm::mat4 ModelView;
+	glm::mat3 NormalMatrix;
+	glm::mat4 ShadowMatrix;				// light.S * Model, takes the object to shadow map coordinates
+	glm::mat4 LightMVP;					// The MVP of the first pass
+};
+
+// One draw call of the camera pass. Has everything secondDrawPass() sends as uniforms, apart from the light.
+struct CameraDraw
+{
+	int object;
+	int lod;							// The level of the object's mesh to draw
+	glm::mat4 Model;
+	glm::mat4 MVP;
+	glm::mat4 ModelView;
+	glm::mat3 NormalMatrix;
+	glm::mat4 ShadowMatrix;
+};
+
+// One draw call of the shadow pass.
+struct ShadowDraw
+{
+	int object;
+	int lod;
+	glm::mat4 MVP;
+};
+
+// One draw call of the cube or dual paraboloid shadow map. Each face has its own view, so the model matrix is sent,
+// with the faces the object is in.
+struct CubeDraw
+{
+	int object;
+	int lod;
+	unsigned int faces;					// Bit f is set if the object is in face f (or half f of the paraboloid map)
+	glm::mat4 Model;
+};
+
+// The draw lists live in the arena of the frame snapshot they belong to.
+typedef ArenaVector<CameraDraw> CameraDrawList;
+typedef ArenaVector<ShadowDraw> ShadowDrawList;
+typedef ArenaVector<CubeDraw> CubeDrawList;
+
+// The objects of one chunk that passed the culling.
+struct ChunkVisibility
+{
+	int* camera;						// Indices of the objects the camera can see
+	int* light;							// and the ones the light can see that never move
+	int* lightDynamic;					// and the ones it can see that can move
+	int cameraCount, lightCount, lightDynamicCount;
+	int cameraStart, lightStart, lightDynamicStart;		// Where the chunk's draws go in the draw lists
+};
+
+// The six planes of the volume a view-projection matrix sees, as (normal, distance). Inside is positive.
+struct Frustum
+{
+	glm::vec4 planes[6];
+
+	void fromMatrix(const glm::mat4& m)
+	{
+		// glm is column major, so m[column][row]. We need the rows.
+		glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+		glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+		glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+		glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+		planes[0] = row3 + row0;		// left
+		planes[1] = row3 - row0;		// right
+		planes[2] = row3 + row1;		// bottom
+		planes[3] = row3 - row1;		// top
+		planes[4] = row3 + row2;		// near
+		planes[5] = row3 - row2;		// far
+
+		// Normalized, so the result of the plane equation is a distance we can compare with the radius.
+		for (int i = 0; i < 6; i++)
+			planes[i] /= glm::length(glm::vec3(planes[i]));
+	}
+
+	bool containsSphere(const glm::vec3& center, float radius) const
+	{
+		for (int i = 0; i < 6; i++)
+		{
+			if (glm::dot(glm::vec3(planes[i]), center) + planes[i].w < -radius)
+				return false;
+		}
+		return true;
+	}
+};
+
+struct Scene
+{
+	std::vector<SceneObject> objects;
+
+	// The positions and bounding spheres of the objects, copied from objects whenever they change.
+	TransformStore transforms;
+	SharedTransforms shared;
+	bool objectsChanged;
+
+	SceneBVH bvh;						// Built again whenever objects are added
+	bool useBVH;						// Otherwise every object is tested
+
+	int dynamicCount;
+	// Changes whenever the objects that never move change, so a cached shadow map of them can tell it is out of date.
+	unsigned int staticVersion;
+
+	// Filled every frame by update(), in the arena. Only valid until the next update().
+	FrameArena arena;
+	ChunkVisibility* chunks;
+	int chunkCount;
+
+	int grainSize;						// SCENE_GRAIN_SIZE, so a multiple of 4
+
+	// The pixels (or texels) per unit at a distance of one, for picking the levels of the meshes.
+	float cameraLODScale;
+	float shadowLODScale;
+
+	void init()
+	{
+		objects.clear();
+		objectsChanged = true;
+		useBVH = true;
+		dynamicCount = 0;
+		staticVersion++;
+		grainSize = SCENE_GRAIN_SIZE;
+		cameraLODScale = 0.0f;
+		shadowLODScale = 0.0f;
+	}
+
+	// Adds an object. The bounding sphere is found from the vertices of the mesh, which is the finest level of lods if it has them.
+	int add(const stuff_for_drawing* mesh, const glm::vec3& origin, bool dynamic = false, const MeshLODs* lods = nullptr)
+	{
+		float radius = 0.0f;
+		for (unsigned int i = 0; i < mesh->vertices.size(); i++)
+			radius = std::max(radius, glm::length(mesh->vertices[i].position));
+
+		SceneObject object = { mesh, origin, radius, dynamic, lods };
+		objects.push_back(object);
+		objectsChanged = true;
+		if (dynamic)
+			dynamicCount++;
+		else
+			staticVersion++;
+		return (int)objects.size() - 1;
+	}
+
+	// The mesh a draw uses.
+	const stuff_for_drawing* meshOf(int object, int lod) const
+	{
+		const SceneObject& o = objects[object];
+		return o.lods ? o.lods->levels[lod] : o.mesh;
+	}
+
+	// The coarsest level of an object's mesh whose edges are at most maxEdge pixels long, when the object is w away
+	// and scale is the pixels per unit at a distance of one. w is the w of the object's center after its MVP.
+	int pickLOD(int i, float w, float scale, float maxEdge) const
+	{
+		const MeshLODs* lods = objects[i].lods;
+		if (!lods || scale <= 0.0f)
+			return 0;
+		float pixels = transforms.radius[i] * scale / std::max(w, 1e-3f);
+		float needed = 6.2831853f * pixels / maxEdge;
+		int lod = 0;
+		while (lod + 1 < lods->count && lods->segments[lod + 1] >= needed)
+			lod++;
+		return lod;
+	}
+
+	// Sets how the levels are picked for the camera and the main light. Each is the [1][1] element of the projection
+	// times half the height of the target, so it works for both perspective and orthographic projections.
+	void setLODScales(float camera, float shadow)
+	{
+		cameraLODScale = camera;
+		shadowLODScale = shadow;
+	}
+
+	// Moves a dynamic object.
+	void move(int i, const glm::vec3& origin)
+	{
+		objects[i].origin = origin;
+		if (!objectsChanged)
+		{
+			transforms.set(i, origin, objects[i].radius);
+			bvh.refit(i);
+		}
+	}
+
+	// Computes the matrices of the objects for this frame, and tests them against both view volumes.
+	// Without the BVH the matrices of every object are computed, with it only those of the objects that passed.
+	void update(const glm::mat4& view, const glm::mat4& PV, const glm::mat4& lightPV, const glm::mat4& lightS)
+	{
+		int n = (int)objects.size();
+		if (objectsChanged)
+		{
+			transforms.resize(n);
+			for (int i = 0; i < n; i++)
+				transforms.set(i, objects[i].origin, objects[i].radius);
+			bvh.build(transforms);
+			objectsChanged = false;
+		}
+
+		arena.reset();
+		transforms.allocateOutputs(arena);
+		shared.set(view, PV, lightPV, lightS);
+
+		Frustum camera, shadow;
+		camera.fromMatrix(PV);
+		shadow.fromMatrix(lightPV);
+
+		if (useBVH)
+			cullTree(camera, shadow);
+		else
+			cullAll(camera, shadow);
+	}
+
+	// The lists of a chunk that can hold count objects.
+	void startChunk(ChunkVisibility& chunk, int count, int thread)
+	{
+		chunk.camera = arena.allocateArray<int>(count, thread);
+		chunk.light = arena.allocateArray<int>(count, thread);
+		chunk.lightDynamic = dynamicCount > 0 ? arena.allocateArray<int>(count, thread) : nullptr;
+		chunk.cameraCount = 0;
+		chunk.lightCount = 0;
+		chunk.lightDynamicCount = 0;
+	}
+
+	// Moves the dynamic objects out of the light's list, keeping the order of both.
+	void splitDynamic(ChunkVisibility& chunk)
+	{
+		if (dynamicCount == 0)
+			return;
+		int staticCount = 0;
+		for (int k = 0; k < chunk.lightCount; k++)
+		{
+			int i = chunk.light[k];
+			if (objects[i].dynamic)
+				chunk.lightDynamic[chunk.lightDynamicCount++] = i;
+			else
+				chunk.light[staticCount++] = i;
+		}
+		chunk.lightCount = staticCount;
+	}
+
+	// Every object, in chunks of grainSize, with the SSE kernels of the TransformStore.
+	void cullAll(const Frustum& camera, const Frustum& shadow)
+	{
+		int n = (int)objects.size();
+		chunkCount = (n + grainSize - 1) / grainSize;
+		chunks = arena.allocateArray<ChunkVisibility>(chunkCount, 0);
+
+		threadPool.parallelForRange(n, grainSize, [&](int begin, int end)
+		{
+			ChunkVisibility& chunk = chunks[begin / grainSize];
+			startChunk(chunk, end - begin, threadPool.threadIndex());
+			transforms.compute(begin, end, shared, camera.planes, shadow.planes,
+				chunk.camera, chunk.cameraCount, chunk.light, chunk.lightCount);
+			splitDynamic(chunk);
+		});
+	}
+
+	// Only the parts of the tree near the view volumes. Every chunk is a subtree.
+	void cullTree(const Frustum& camera, const Frustum& shadow)
+	{
+		int target = threadPool.size() * 8;
+		int* roots = arena.allocateArray<int>(target + 1, 0);
+		chunkCount = bvh.pieces(roots, target);
+		chunks = arena.allocateArray<ChunkVisibility>(chunkCount, 0);
+
+		threadPool.parallelFor(chunkCount, [&](int c)
+		{
+			ChunkVisibility& chunk = chunks[c];
+			startChunk(chunk, bvh.nodes[roots[c]].count, threadPool.threadIndex());
+
+			auto visit = [&](int i, bool seenByCamera, bool seenByLight)
+			{
+				transforms.computeObject(i, shared);
+				if (seenByCamera)
+					chunk.camera[chunk.cameraCount++] = i;
+				if (seenByLight)
+					chunk.light[chunk.lightCount++] = i;
+			};
+			bvh.cull(roots[c], camera.planes, shadow.planes, visit);
+			splitDynamic(chunk);
+		});
+	}
+
+	// Adds a shadow draw to the list for every object inside the view volume of lightPV. For the lights other than
+	// the main one, which are not worth spreading over the threads. lodScale is like shadowLODScale, for this light.
+	// Call after update().
+	void cullFrustum(const glm::mat4& lightPV, float lodScale, ShadowDrawList& draws)
+	{
+		Frustum frustum;
+		frustum.fromMatrix(lightPV);
+		auto visit = [&](int i)
+		{
+			ShadowDraw draw;
+			draw.object = i;
+			draw.MVP = lightPV * transforms.model(i);
+			draw.lod = pickLOD(i, draw.MVP[3][3], lodScale, SHADOW_LOD_EDGE);
+			draws.push_back(draw);
+		};
+
+		if (useBVH && !bvh.nodes.empty())
+			bvh.cull(0, frustum.planes, visit);
+		else
+		{
+			for (int i = 0; i < transforms.count; i++)
+			{
+				if (transforms.insideScalar(frustum.planes, i))
+					visit(i);
+			}
+		}
+	}
+
+	// The faces of a cube map around a light that a sphere at offset from the light is in. Face f looks down
+	// axis f / 2, the positive side for even f, like GL_TEXTURE_CUBE_MAP_POSITIVE_X + f.
+	// A point is in a face if its distance along the face's axis is at least as big as either other coordinate,
+	// so the sides of the face are the planes at 45 degrees between the axes, and a sphere is in the face if it
+	// is no more than its radius behind any of them.
+	static unsigned int cubeFaces(const glm::vec3& offset, float radius)
+	{
+		float slack = radius * 1.41421356f;
+		unsigned int faces = 0;
+		for (int f = 0; f < 6; f++)
+		{
+			int axis = f / 2;
+			float along = (f & 1) ? -offset[axis] : offset[axis];
+			if (along + slack >= fabsf(offset[(axis + 1) % 3]) && along + slack >= fabsf(offset[(axis + 2) % 3]))
+				faces |= 1u << f;
+		}
+		return faces;
+	}
+
+	// The halves of a dual paraboloid map a sphere at offset from the light is in. Half 0 looks down, half 1 up.
+	static unsigned int paraboloidHalves(const glm::vec3& offset, float radius)
+	{
+		return (offset.y <= radius ? 1u : 0u) | (offset.y >= -radius ? 2u : 0u);
+	}
+
+	// Finds the objects within range of a point light, and which faces of its shadow map they are in,
+	// with cubeFaces or paraboloidHalves. To the BVH, the box around the range is just another frustum
+	// (an orthographic one). Only the objects in the box get the exact test against the sphere.
+	// lodScale is the texels per unit at a distance of one from the light. The distance stands in for w.
+	void cullPointLight(const glm::vec3& position, float range, unsigned int (*facesOf)(const glm::vec3&, float), float lodScale,
+		CubeDrawList& draws)
+	{
+		Frustum box;
+		box.fromMatrix(glm::ortho(-range, range, -range, range, -range, range) * glm::translate(glm::mat4(1.0f), -position));
+		auto visit = [&](int i)
+		{
+			glm::vec3 offset = glm::vec3(transforms.x[i], transforms.y[i], transforms.z[i]) - position;
+			float reach = range + transforms.radius[i];
+			if (glm::dot(offset, offset) > reach * reach)
+				return;
+
+			CubeDraw draw;
+			draw.object = i;
+			draw.lod = pickLOD(i, sqrtf(glm::dot(offset, offset)), lodScale, SHADOW_LOD_EDGE);
+			draw.faces = facesOf(offset, transforms.radius[i]);
+			draw.Model = transforms.model(i);
+			draws.push_back(draw);
+		};
+
+		if (useBVH && !bvh.nodes.empty())
+			bvh.cull(0, box.planes, visit);
+		else
+		{
+			for (int i = 0; i < transforms.count; i++)
+			{
+				if (transforms.insideScalar(box.planes, i))
+					visit(i);
+			}
+		}
+	}
+
+	// Builds the draw lists of both passes from the objects that passed the culling, in the order of the chunks.
+	// The shadow pass has one list for the objects that never move and one for the dynamic ones.
+	void buildDrawLists(CameraDrawList& cameraDraws, ShadowDrawList& shadowDraws, ShadowDrawList& dynamicShadowDraws)
+	{
+		int count = chunkCount;
+
+		// The index of the first draw of every chunk.
+		int cameraTotal = 0, lightTotal = 0, dynamicTotal = 0;
+		for (int c = 0; c < count; c++)
+		{
+			chunks[c].cameraStart = cameraTotal;
+			chunks[c].lightStart = lightTotal;
+			chunks[c].lightDynamicStart = dynamicTotal;
+			cameraTotal += chunks[c].cameraCount;
+			lightTotal += chunks[c].lightCount;
+			dynamicTotal += chunks[c].lightDynamicCount;
+		}
+		cameraDraws.resize(cameraTotal);
+		shadowDraws.resize(lightTotal);
+		dynamicShadowDraws.resize(dynamicTotal);
+
+		threadPool.parallelFor(count, [&](int c)
+		{
+			const ChunkVisibility& chunk = chunks[c];
+			for (int k = 0; k < chunk.cameraCount; k++)
+			{
+				int i = chunk.camera[k];
+				CameraDraw& draw = cameraDraws[chunk.cameraStart + k];
+				draw.object = i;
+				draw.Model = transforms.model(i);
+				draw.MVP = TransformStore::withColumn(shared.PV, transforms.mvp, i);
+				draw.ModelView = TransformStore::withColumn(shared.view, transforms.modelView, i);
+				draw.NormalMatrix = shared.NormalMatrix;
+				draw.ShadowMatrix = TransformStore::withColumn(shared.lightS, transforms.shadow, i);
+				draw.lod = pickLOD(i, draw.MVP[3][3], cameraLODScale, CAMERA_LOD_EDGE);
+			}
+			for (int k = 0; k < chunk.lightCount; k++)
+			{
+				int i = chunk.light[k];
+				ShadowDraw& draw = shadowDraws[chunk.lightStart + k];
+				draw.object = i;
+				draw.MVP = TransformStore::withColumn(shared.lightPV, transforms.lightMVP, i);
+				draw.lod = pickLOD(i, draw.MVP[3][3], shadowLODScale, SHADOW_LOD_EDGE);
+			}
+			for (int k = 0; k < chunk.lightDynamicCount; k++)
+			{
+				int i = chunk.lightDynamic[k];
+				ShadowDraw& draw = dynamicShadowDraws[chunk.lightDynamicStart + k];
+				draw.object = i;
+				draw.MVP = TransformStore::withColumn(shared.lightPV, transforms.lightMVP, i);
+				draw.lod = pickLOD(i, draw.MVP[3][3], shadowLODScale, SHADOW_LOD_EDGE);
+			}
+		});
+	}
+
+}scene;
+
+#endif _SCENE_H
@@ -0,0 +1,503 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: SceneBVH.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+Description:
+A bounding volume hierarchy over the objects of the scene, so the culling only
+looks at the parts of the scene that are near a view volume.
+
+Testing every object against the view volumes costs the same for every object,
+wherever it is. In a big scene most objects are far away from both the camera
+and the light, and we pay for all of them every frame. The hierarchy is a binary
+tree of boxes: every node has a box around all the objects under it, and the
+leaves have a few objects each. If a box is completely outside a view volume, so
+is everything under it, and the whole subtree is skipped with one test. If it is
+completely inside, everything under it is visible and there is nothing left to
+test. Only the nodes that cross a plane are opened. So the cost grows with the
+number of visible objects and the depth of the tree, not with the whole scene.
+Both view volumes are tested in the same walk down the tree.
+
+The tree is built top down. At every node the objects are split in two along the
+axis where their centers are spread the most. Where to split is decided by the
+surface area heuristic: the chance that a ray or a view volume hits a box grows
+with its surface area, so we pick the split that makes the sum of area times
+number of objects of the two children the smallest. Instead of trying every
+possible split, the centers are sorted into 16 bins along the axis and only the
+15 splits between bins are tried, which needs only one pass over the objects.
+
+The build uses the thread pool in two ways. The nodes at the top have most of the
+objects, so the binning of those is spread over the threads. Once the nodes are
+small enough, each of them is a task that builds its whole subtree on one thread.
+
+When an object moves, the tree doesn't have to be built again. Its leaf box is
+fitted to it again, and then the boxes of the nodes above it, until one of them
+doesn't change (a refit). The tree gets a bit worse if objects move far, but it
+is still correct. When objects are added or removed it is built again.
+*/
+
+#ifndef _SCENE_BVH_H
+#define _SCENE_BVH_H
+
+#include "GLIncludes.h"
+#include "ThreadPool.h"
+#include "TransformStore.h"
+#include <cfloat>
+
+// Most objects in a leaf. The culling tests the objects of a leaf one by one.
+#define BVH_LEAF_SIZE 4
+#define BVH_BINS 16
+// Nodes with more objects than this have their binning spread over the thread pool, in pieces of this size.
+#define BVH_PARALLEL_GRAIN 4096
+
+struct BVHNode
+{
+	glm::vec3 min;
+	int left;				// The children are left and left + 1. -1 for a leaf.
+	glm::vec3 max;
+	int parent;				// -1 for the root
+	int first, count;		// The objects under this node are order[first] to order[first + count - 1]
+};
+
+// A set of objects: the box around their spheres, the box around their centers, and how many there are.
+struct BVHBin
+{
+	glm::vec3 min, max;
+	glm::vec3 centerMin, centerMax;
+	int count;
+
+	void clear()
+	{
+		min = centerMin = glm::vec3(FLT_MAX);
+		max = centerMax = glm::vec3(-FLT_MAX);
+		count = 0;
+	}
+
+	void add(const glm::vec3& center, float radius)
+	{
+		min = glm::min(min, center - radius);
+		max = glm::max(max, center + radius);
+		centerMin = glm::min(centerMin, center);
+		centerMax = glm::max(centerMax, center);
+		count++;
+	}
+
+	void merge(const BVHBin& other)
+	{
+		min = glm::min(min, other.min);
+		max = glm::max(max, other.max);
+		centerMin = glm::min(centerMin, other.centerMin);
+		centerMax = glm::max(centerMax, other.centerMax);
+		count += other.count;
+	}
+
+	// Half the surface area of the box, which is all the heuristic needs.
+	float area() const
+	{
+		if (count == 0)
+			return 0.0f;
+		glm::vec3 d = max - min;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+};
+
+struct SceneBVH
+{
+	std::vector<BVHNode> nodes;			// nodes[0] is the root. Children always come after their parent.
+	std::vector<int> order;				// The objects, in the order of the leaves
+	std::vector<int> objectLeaf;		// The leaf of every object
+	const TransformStore* store;		// Where the positions and radii are
+
+	double buildSeconds;
+
+	glm::vec3 center(int object) const
+	{
+		return glm::vec3(store->x[object], store->y[object], store->z[object]);
+	}
+
+	// Builds the tree from scratch, over all the objects in the store.
+	void build(const TransformStore& transforms)
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+		store = &transforms;
+		int n = transforms.count;
+		nodes.clear();
+		order.resize(n);
+		objectLeaf.resize(n);
+		for (int i = 0; i < n; i++)
+			order[i] = i;
+		if (n == 0)
+			return;
+
+		BVHNode root = { glm::vec3(0.0f), -1, glm::vec3(0.0f), -1, 0, n };
+		nodes.push_back(root);
+		BVHBin rootInfo = summarize(0, n);
+		setBounds(nodes[0], rootInfo);
+
+		// The top of the tree, one node at a time, each one binned by all the threads.
+		std::vector<std::pair<int, BVHBin> > top, tasks;
+		top.push_back(std::make_pair(0, rootInfo));
+		int taskSize = std::max(BVH_PARALLEL_GRAIN, n / (threadPool.size() * 4));
+		while (!top.empty())
+		{
+			std::pair<int, BVHBin> current = top.back();
+			top.pop_back();
+			if (current.second.count <= BVH_LEAF_SIZE)
+				continue;
+			if (current.second.count <= taskSize)
+			{
+				tasks.push_back(current);
+				continue;
+			}
+
+			BVHBin leftInfo, rightInfo;
+			split(nodes, current.first, current.second, leftInfo, rightInfo, true);
+			top.push_back(std::make_pair(nodes[current.first].left, leftInfo));
+			top.push_back(std::make_pair(nodes[current.first].left + 1, rightInfo));
+		}
+
+		// Then every task builds a whole subtree on its own, into its own list of nodes.
+		std::vector<std::vector<BVHNode> > subtrees(tasks.size());
+		threadPool.parallelFor((int)tasks.size(), [&](int t)
+		{
+			std::vector<BVHNode>& local = subtrees[t];
+			local.push_back(nodes[tasks[t].first]);
+			buildSubtree(local, tasks[t].second);
+		});
+
+		// And the subtrees are hung into the tree. Their roots replace the nodes they were made from.
+		for (unsigned int t = 0; t < tasks.size(); t++)
+		{
+			const std::vector<BVHNode>& local = subtrees[t];
+			int rootIndex = tasks[t].first;
+			int base = (int)nodes.size() - 1;		// Local node k > 0 goes to base + k
+			for (unsigned int k = 0; k < local.size(); k++)
+			{
+				BVHNode node = local[k];
+				if (node.left >= 0)
+					node.left += base;
+				if (k == 0)
+				{
+					node.parent = nodes[rootIndex].parent;
+					nodes[rootIndex] = node;
+				}
+				else
+				{
+					node.parent = (node.parent == 0) ? rootIndex : node.parent + base;
+					nodes.push_back(node);
+				}
+			}
+		}
+
+		for (unsigned int i = 0; i < nodes.size(); i++)
+		{
+			if (nodes[i].left < 0)
+			{
+				for (int k = nodes[i].first; k < nodes[i].first + nodes[i].count; k++)
+					objectLeaf[order[k]] = i;
+			}
+		}
+
+		buildSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+	}
+
+	BVHBin summarize(int first, int count) const
+	{
+		BVHBin info;
+		info.clear();
+		for (int k = first; k < first + count; k++)
+			info.add(center(order[k]), store->radius[order[k]]);
+		return info;
+	}
+
+	static void setBounds(BVHNode& node, const BVHBin& info)
+	{
+		node.min = info.min;
+		node.max = info.max;
+	}
+
+	// Splits the rest of a subtree, one node at a time. local[0] is its root.
+	void buildSubtree(std::vector<BVHNode>& local, const BVHBin& rootInfo)
+	{
+		std::vector<std::pair<int, BVHBin> > stack;
+		stack.push_back(std::make_pair(0, rootInfo));
+		while (!stack.empty())
+		{
+			std::pair<int, BVHBin> current = stack.back();
+			stack.pop_back();
+			if (current.second.count <= BVH_LEAF_SIZE)
+				continue;
+
+			BVHBin leftInfo, rightInfo;
+			split(local, current.first, current.second, leftInfo, rightInfo, false);
+			stack.push_back(std::make_pair(local[current.first].left, leftInfo));
+			stack.push_back(std::make_pair(local[current.first].left + 1, rightInfo));
+		}
+	}
+
+	// The bin of an object's center along the axis.
+	static int binOf(float value, float start, float scale)
+	{
+		return std::min(BVH_BINS - 1, std::max(0, (int)((value - start) * scale)));
+	}
+
+	// Splits a node in two by the surface area heuristic and adds the children to out.
+	// info describes the node's objects, and the children's come back in leftInfo and rightInfo.
+	void split(std::vector<BVHNode>& out, int node, const BVHBin& info, BVHBin& leftInfo, BVHBin& rightInfo, bool parallel)
+	{
+		int first = out[node].first;
+		int count = out[node].count;
+
+		glm::vec3 extent = info.centerMax - info.centerMin;
+		int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+		int middle;
+
+		if (extent[axis] <= 0.0f)
+		{
+			// All the centers are in the same place, so any split is as good as any other.
+			middle = first + count / 2;
+			leftInfo = summarize(first, middle - first);
+			rightInfo = summarize(middle, first + count - middle);
+		}
+		else
+		{
+			float start = info.centerMin[axis];
+			float scale = BVH_BINS / extent[axis];
+
+			BVHBin bins[BVH_BINS];
+			for (int b = 0; b < BVH_BINS; b++)
+				bins[b].clear();
+
+			if (parallel)
+			{
+				int pieces = (count + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+				std::vector<BVHBin> partial(pieces * BVH_BINS);
+				threadPool.parallelForRange(count, BVH_PARALLEL_GRAIN, [&](int begin, int end)
+				{
+					BVHBin* mine = &partial[(begin / BVH_PARALLEL_GRAIN) * BVH_BINS];
+					for (int b = 0; b < BVH_BINS; b++)
+						mine[b].clear();
+					for (int k = first + begin; k < first + end; k++)
+					{
+						glm::vec3 c = center(order[k]);
+						mine[binOf(c[axis], start, scale)].add(c, store->radius[order[k]]);
+					}
+				});
+				for (int p = 0; p < pieces; p++)
+				{
+					for (int b = 0; b < BVH_BINS; b++)
+						bins[b].merge(partial[p * BVH_BINS + b]);
+				}
+			}
+			else
+			{
+				for (int k = first; k < first + count; k++)
+				{
+					glm::vec3 c = center(order[k]);
+					bins[binOf(c[axis], start, scale)].add(c, store->radius[order[k]]);
+				}
+			}
+
+			// The cost of every split between two bins, from running unions from both ends.
+			BVHBin below[BVH_BINS], above[BVH_BINS];
+			below[0] = bins[0];
+			above[BVH_BINS - 1] = bins[BVH_BINS - 1];
+			for (int b = 1; b < BVH_BINS; b++)
+			{
+				below[b] = below[b - 1];
+				below[b].merge(bins[b]);
+				above[BVH_BINS - 1 - b] = above[BVH_BINS - b];
+				above[BVH_BINS - 1 - b].merge(bins[BVH_BINS - 1 - b]);
+			}
+
+			// The lowest and the highest center are in the first and the last bin, so both sides of every split have objects.
+			int best = 0;
+			float bestCost = FLT_MAX;
+			for (int b = 0; b < BVH_BINS - 1; b++)
+			{
+				float cost = below[b].area() * below[b].count + above[b + 1].area() * above[b + 1].count;
+				if (cost < bestCost && below[b].count > 0 && above[b + 1].count > 0)
+				{
+					bestCost = cost;
+					best = b;
+				}
+			}
+
+			leftInfo = below[best];
+			rightInfo = above[best + 1];
+			std::partition(order.begin() + first, order.begin() + first + count, [&](int object)
+			{
+				return binOf(center(object)[axis], start, scale) <= best;
+			});
+			middle = first + leftInfo.count;
+		}
+
+		int left = (int)out.size();
+		BVHNode child = { glm::vec3(0.0f), -1, glm::vec3(0.0f), node, first, middle - first };
+		setBounds(child, leftInfo);
+		out.push_back(child);
+		child.first = middle;
+		child.count = first + count - middle;
+		setBounds(child, rightInfo);
+		out.push_back(child);
+		out[node].left = left;
+	}
+
+	// Fits the boxes to an object that has moved: its leaf, and the nodes above it until one doesn't change.
+	void refit(int object)
+	{
+		int node = objectLeaf[object];
+		BVHBin info = summarize(nodes[node].first, nodes[node].count);
+		if (info.min == nodes[node].min && info.max == nodes[node].max)
+			return;
+		setBounds(nodes[node], info);
+
+		for (node = nodes[node].parent; node >= 0; node = nodes[node].parent)
+		{
+			const BVHNode& left = nodes[nodes[node].left];
+			const BVHNode& right = nodes[nodes[node].left + 1];
+			glm::vec3 min = glm::min(left.min, right.min);
+			glm::vec3 max = glm::max(left.max, right.max);
+			if (min == nodes[node].min && max == nodes[node].max)
+				return;
+			nodes[node].min = min;
+			nodes[node].max = max;
+		}
+	}
+
+	// 0 if the box is outside the planes, 2 if it is inside all of them, 1 if it crosses one.
+	static int classify(const BVHNode& node, const glm::vec4* planes)
+	{
+		glm::vec3 center = (node.min + node.max) * 0.5f;
+		glm::vec3 half = (node.max - node.min) * 0.5f;
+		int result = 2;
+		for (int p = 0; p < 6; p++)
+		{
+			float d = glm::dot(glm::vec3(planes[p]), center) + planes[p].w;
+			float r = fabs(planes[p].x) * half.x + fabs(planes[p].y) * half.y + fabs(planes[p].z) * half.z;
+			if (d + r < 0.0f)
+				return 0;
+			if (d - r < 0.0f)
+				result = 1;
+		}
+		return result;
+	}
+
+	// Picks up to target nodes that together cover the whole tree, by opening the biggest one until there are enough.
+	// These are the pieces the culling is spread over. roots needs room for target + 1.
+	int pieces(int* roots, int target) const
+	{
+		if (nodes.empty())
+			return 0;
+		int count = 1;
+		roots[0] = 0;
+		while (count < target)
+		{
+			int biggest = -1;
+			for (int i = 0; i < count; i++)
+			{
+				const BVHNode& node = nodes[roots[i]];
+				if (node.left >= 0 && (biggest < 0 || node.count > nodes[roots[biggest]].count))
+					biggest = i;
+			}
+			if (biggest < 0)
+				break;
+			int left = nodes[roots[biggest]].left;
+			roots[biggest] = left;
+			roots[count++] = left + 1;
+		}
+		return count;
+	}
+
+	// Calls visit(object, seenByCamera, seenByLight) for every object under node that is inside at least one of the
+	// two view volumes. The states are what is known about the node's parent, 1 if nothing is.
+	template<typename Visit>
+	void cull(int node, const glm::vec4* cameraPlanes, const glm::vec4* lightPlanes, Visit& visit,
+		int cameraState = 1, int lightState = 1) const
+	{
+		const BVHNode& n = nodes[node];
+		if (cameraState == 1)
+			cameraState = classify(n, cameraPlanes);
+		if (lightState == 1)
+			lightState = classify(n, lightPlanes);
+		if (cameraState == 0 && lightState == 0)
+			return;
+
+		// Nothing left to test, the objects can be taken as they are.
+		if (cameraState != 1 && lightState != 1)
+		{
+			for (int k = n.first; k < n.first + n.count; k++)
+				visit(order[k], cameraState == 2, lightState == 2);
+			return;
+		}
+
+		if (n.left >= 0)
+		{
+			cull(n.left, cameraPlanes, lightPlanes, visit, cameraState, lightState);
+			cull(n.left + 1, cameraPlanes, lightPlanes, visit, cameraState, lightState);
+			return;
+		}
+
+		for (int k = n.first; k < n.first + n.count; k++)
+		{
+			int object = order[k];
+			bool camera = cameraState == 2 || (cameraState == 1 && store->insideScalar(cameraPlanes, object));
+			bool light = lightState == 2 || (lightState == 1 && store->insideScalar(lightPlanes, object));
+			if (camera || light)
+				visit(object, camera, light);
+		}
+	}
+
+	// The same for a single view volume. Calls visit(object) for every object under node that is inside it.
+	template<typename Visit>
+	void cull(int node, const glm::vec4* planes, Visit& visit, int state = 1) const
+	{
+		const BVHNode& n = nodes[node];
+		if (state == 1)
+			state = classify(n, planes);
+		if (state == 0)
+			return;
+
+		if (state == 2)
+		{
+			for (int k = n.first; k < n.first + n.count; k++)
+				visit(order[k]);
+			return;
+		}
+
+		if (n.left >= 0)
+		{
+			cull(n.left, planes, visit, state);
+			cull(n.left + 1, planes, visit, state);
+			return;
+		}
+
+		for (int k = n.first; k < n.first + n.count; k++)
+		{
+			if (store->insideScalar(planes, order[k]))
+				visit(order[k]);
+		}
+	}
+
+};
+
+#endif _SCENE_BVH_H
@@ -0,0 +1,264 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: SceneFile.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+Description:
+A binary file for a whole scene, made to be mapped into memory and used as it is.
+A text format would have to be parsed object by object, which for a few hundred
+thousand objects takes seconds. Here everything is a flat array of fixed size
+records, so loading is mostly handing pointers around:
+
+	+--------+--------+----------+-----------+------------+--------+--------+
+	| Header | Meshes | Vertices | Instances | Transforms | Bounds | Lights |
+	+--------+--------+----------+-----------+------------+--------+--------+
+
+The header has the number of records in each array and where the array starts.
+The arrays start at multiples of 16 bytes, so they can be read in place.
+A mesh is a range of the vertex array. The vertices are stored exactly like
+VertexFormat, so the whole array goes to the GPU with one glBufferData straight
+from the mapped file, and every mesh gets a VAO pointing at its part of it.
+Every instance is one object of the scene: which mesh it uses, where it is (the
+transforms are translations, like everywhere else in this program), and the
+radius of its bounding sphere for the culling, so it doesn't have to be found
+from the vertices again. Nothing in a scene file moves, so all of it goes into
+the cached shadow map of the static objects (StaticShadowCache.h).
+
+The file is written by writeSceneFile(). Run with "--make-scene" to generate one.
+*/
+
+#ifndef _SCENE_FILE_H
+#define _SCENE_FILE_H
+
+#include "GLIncludes.h"
+#include "AssetPack.h"
+#include "Scene.h"
+
+// Uses stuff_for_drawing from BasicFunctions.h, so include this after it.
+
+#define SCENE_FILE_VERSION 1
+
+struct SceneFileHeader
+{
+	char magic[4];					// "SMSC"
+	uint32_t version;
+	uint32_t meshCount;
+	uint32_t vertexCount;
+	uint32_t instanceCount;
+	uint32_t lightCount;
+	// Where each array starts, from the start of the file
+	uint64_t meshOffset;
+	uint64_t vertexOffset;
+	uint64_t instanceOffset;
+	uint64_t transformOffset;
+	uint64_t boundsOffset;
+	uint64_t lightOffset;
+};
+
+struct SceneFileMesh
+{
+	uint32_t firstVertex;
+	uint32_t vertexCount;
+};
+
+struct SceneFileTransform
+{
+	float position[3];
+};
+
+struct SceneFileLight
+{
+	float position[3];
+	float intensity[3];
+};
+
+struct SceneFile
+{
+	MappedFile file;
+	const SceneFileHeader* header;
+	std::vector<stuff_for_drawing> meshes;
+	std::vector<SceneFileLight> lights;
+	GLuint vbo;
+	double seconds;
+
+	// The start of one of the arrays, or nullptr if it doesn't fit in the file.
+	const char* array(uint64_t offset, uint64_t count, size_t recordSize)
+	{
+		if (offset > file.size || count * recordSize > file.size - offset)
+			return nullptr;
+		return file.data + offset;
+	}
+
+	// Maps the file, and replaces the objects of the scene with its instances. Nothing here needs OpenGL.
+	// The file stays mapped until upload() has sent the vertices to the GPU.
+	bool load(const char* fileName)
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+		close();
+		if (!file.open(fileName))
+		{
+			std::cout << "Could not open " << fileName << "\n";
+			return false;
+		}
+
+		header = (const SceneFileHeader*)file.data;
+		const SceneFileMesh* meshRecords = nullptr;
+		const VertexFormat* vertices = nullptr;
+		const uint32_t* instances = nullptr;
+		const SceneFileTransform* transforms = nullptr;
+		const float* bounds = nullptr;
+		const SceneFileLight* lightRecords = nullptr;
+		if (file.size >= sizeof(SceneFileHeader) && memcmp(header->magic, "SMSC", 4) == 0 && header->version == SCENE_FILE_VERSION)
+		{
+			meshRecords = (const SceneFileMesh*)array(header->meshOffset, header->meshCount, sizeof(SceneFileMesh));
+			vertices = (const VertexFormat*)array(header->vertexOffset, header->vertexCount, sizeof(VertexFormat));
+			instances = (const uint32_t*)array(header->instanceOffset, header->instanceCount, sizeof(uint32_t));
+			transforms = (const SceneFileTransform*)array(header->transformOffset, header->instanceCount, sizeof(SceneFileTransform));
+			bounds = (const float*)array(header->boundsOffset, header->instanceCount, sizeof(float));
+			lightRecords = (const SceneFileLight*)array(header->lightOffset, header->lightCount, sizeof(SceneFileLight));
+		}
+		if (meshRecords == nullptr || vertices == nullptr || instances == nullptr || transforms == nullptr
+			|| bounds == nullptr || lightRecords == nullptr)
+		{
+			std::cout << fileName << " is not a valid scene file.\n";
+			close();
+			return false;
+		}
+
+		// Everything is built on the side first. The scene is only replaced once the whole file has turned out valid,
+		// so a broken file leaves the scene as it was.
+		// The meshes keep a copy of their vertices for the CPU rasterizer. There are only a few of them.
+		std::vector<stuff_for_drawing> newMeshes(header->meshCount);
+		for (uint32_t m = 0; m < header->meshCount; m++)
+		{
+			const SceneFileMesh& mesh = meshRecords[m];
+			if (mesh.firstVertex > header->vertexCount || mesh.vertexCount > header->vertexCount - mesh.firstVertex)
+			{
+				std::cout << fileName << ": mesh " << m << " is outside of the vertex array.\n";
+				close();
+				return false;
+			}
+			newMeshes[m].vertices.assign(vertices + mesh.firstVertex, vertices + mesh.firstVertex + mesh.vertexCount);
+			newMeshes[m].numberOfVertices = mesh.vertexCount;
+		}
+
+		// The instances become the objects of the scene. This is the only loop over all of them.
+		std::vector<SceneObject> objects(header->instanceCount);
+		for (uint32_t i = 0; i < header->instanceCount; i++)
+		{
+			uint32_t mesh = instances[i];
+			if (mesh >= header->meshCount)
+			{
+				std::cout << fileName << ": instance " << i << " uses a mesh that doesn't exist.\n";
+				close();
+				return false;
+			}
+			SceneObject& object = objects[i];
+			object.mesh = &newMeshes[mesh];
+			object.origin = glm::vec3(transforms[i].position[0], transforms[i].position[1], transforms[i].position[2]);
+			object.radius = bounds[i];
+			object.dynamic = false;
+			object.lods = nullptr;
+		}
+
+		// Swapping keeps the meshes where they are, so the objects still point at them.
+		meshes.swap(newMeshes);
+		scene.init();
+		scene.objects.swap(objects);
+
+		lights.assign(lightRecords, lightRecords + header->lightCount);
+
+		seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+		std::cout << "Loaded " << fileName << ": " << header->meshCount << " meshes, " << header->vertexCount << " vertices, "
+			<< header->instanceCount << " objects, " << header->lightCount << " lights in " << seconds * 1000.0 << "ms\n";
+		return true;
+	}
+
+	// Sends all the vertices to the GPU in one go, and unmaps the file.
+	void upload()
+	{
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, header->vertexCount * sizeof(VertexFormat), file.data + header->vertexOffset, GL_STATIC_DRAW);
+
+		const SceneFileMesh* meshRecords = (const SceneFileMesh*)(file.data + header->meshOffset);
+		for (uint32_t m = 0; m < header->meshCount; m++)
+			meshes[m].initSharedBuffer(vbo, meshRecords[m].firstVertex, meshRecords[m].vertexCount);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		close();
+	}
+
+	void close()
+	{
+		if (file.data != nullptr)
+			file.close();
+		header = nullptr;
+	}
+
+}sceneFile;
+
+// Writes one array at the next multiple of 16 bytes, and returns where it starts.
+template<typename T>
+uint64_t writeSceneArray(std::ofstream& out, const std::vector<T>& records)
+{
+	const char padding[16] = { 0 };
+	uint64_t offset = ((uint64_t)out.tellp() + 15) & ~(uint64_t)15;
+	out.write(padding, offset - (uint64_t)out.tellp());
+	if (!records.empty())
+		out.write((const char*)&records[0], records.size() * sizeof(T));
+	return offset;
+}
+
+// Writes a scene file. instances, transforms and bounds have one record per object.
+bool writeSceneFile(const char* fileName, const std::vector<SceneFileMesh>& meshes, const std::vector<VertexFormat>& vertices,
+	const std::vector<uint32_t>& instances, const std::vector<SceneFileTransform>& transforms, const std::vector<float>& bounds,
+	const std::vector<SceneFileLight>& lights)
+{
+	std::ofstream out(fileName, std::ios::out | std::ios::binary);
+	if (!out.good())
+		return false;
+
+	// The header is written twice, the second time with the offsets filled in.
+	SceneFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "SMSC", 4);
+	header.version = SCENE_FILE_VERSION;
+	header.meshCount = (uint32_t)meshes.size();
+	header.vertexCount = (uint32_t)vertices.size();
+	header.instanceCount = (uint32_t)instances.size();
+	header.lightCount = (uint32_t)lights.size();
+	out.write((const char*)&header, sizeof(header));
+
+	header.meshOffset = writeSceneArray(out, meshes);
+	header.vertexOffset = writeSceneArray(out, vertices);
+	header.instanceOffset = writeSceneArray(out, instances);
+	header.transformOffset = writeSceneArray(out, transforms);
+	header.boundsOffset = writeSceneArray(out, bounds);
+	header.lightOffset = writeSceneArray(out, lights);
+
+	out.seekp(0);
+	out.write((const char*)&header, sizeof(header));
+	return out.good();
+}
+
+#endif _SCENE_FILE_H
@@ -0,0 +1,288 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: ShaderReloader.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+Shader hot reloading. A worker thread watches the shader files, and when one of
+them is saved it recompiles the program that uses it. The worker has its own
+(hidden) GLFW window whose context shares objects with the main window, so the
+compile and link happen off the render thread. When the new program is ready,
+the worker places a fence after it. The render thread checks the fence without
+waiting, and only once it has passed, swaps the program handle. So a reload never
+stalls a frame, and a shader with errors just keeps the old program running.
+
+On Linux the files are watched with inotify. Everywhere else we compare the
+modification times of the files a few times per second.
+*/
+
+#ifndef _SHADER_RELOADER_H
+#define _SHADER_RELOADER_H
+
+#include "GLIncludes.h"
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+// Uses readShader() and createShader() from BasicFunctions.h, so include this after it.
+
+struct ShaderReloader
+{
+	// One program that is being watched, and the files it is built from.
+	struct WatchedProgram
+	{
+		std::string vertexFile;
+		std::string fragmentFile;
+		GLuint* handle;			// The global handle that gets swapped, e.g. &renderProgram
+		time_t vertexTime;		// Last modification times, used when polling
+		time_t fragmentTime;
+
+		bool dirty;				// Set by the watcher, cleared once the program has been recompiled
+		GLuint newProgram;		// Compiled by the worker, waiting for the fence
+		GLsync fence;
+	};
+
+	std::vector<WatchedProgram> programs;
+	GLFWwindow* context;		// Hidden window that shares its objects with the main window
+	std::thread worker;
+	std::mutex lock;			// Guards newProgram and fence of each watched program
+	std::atomic<bool> running;
+
+	void watch(std::string vertexFile, std::string fragmentFile, GLuint* handle)
+	{
+		WatchedProgram p;
+		p.vertexFile = vertexFile;
+		p.fragmentFile = fragmentFile;
+		p.handle = handle;
+		p.vertexTime = modifiedTime(vertexFile);
+		p.fragmentTime = modifiedTime(fragmentFile);
+		p.dirty = false;
+		p.newProgram = 0;
+		p.fence = 0;
+		programs.push_back(p);
+	}
+
+	// Must be called from the main thread, since GLFW only creates windows there.
+	void start(GLFWwindow* mainWindow)
+	{
+		glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+		context = glfwCreateWindow(1, 1, "Shader compiler", nullptr, mainWindow);
+		glfwWindowHint(GLFW_VISIBLE, GL_TRUE);
+
+		if (context == nullptr)
+		{
+			std::cout << "Could not create a shared context. Shader reloading is disabled.\n";
+			return;
+		}
+
+		running = true;
+		worker = std::thread(&ShaderReloader::run, this);
+	}
+
+	void stop()
+	{
+		running = false;
+		if (worker.joinable())
+			worker.join();
+
+		for (unsigned int i = 0; i < programs.size(); i++)
+		{
+			if (programs[i].fence != 0)
+			{
+				glDeleteSync(programs[i].fence);
+				glDeleteProgram(programs[i].newProgram);
+			}
+		}
+
+		if (context != nullptr)
+			glfwDestroyWindow(context);
+	}
+
+	// Called on the render thread once per frame. Swaps in every program whose fence has passed.
+	// Returns true if any of the handles changed, so the caller can fetch the uniform locations again.
+	bool swapReadyPrograms()
+	{
+		bool swapped = false;
+
+		// If the worker is busy with the lock, try again next frame instead of waiting.
+		if (!lock.try_lock())
+			return false;
+
+		for (unsigned int i = 0; i < programs.size(); i++)
+		{
+			WatchedProgram& p = programs[i];
+			if (p.fence == 0)
+				continue;
+
+			// A timeout of 0 only checks the state of the fence, it never blocks.
+			GLenum state = glClientWaitSync(p.fence, 0, 0);
+			if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED)
+				continue;
+
+			glDeleteSync(p.fence);
+			p.fence = 0;
+
+			glDeleteProgram(*p.handle);
+			*p.handle = p.newProgram;
+			p.newProgram = 0;
+			swapped = true;
+
+			std::cout << "Reloaded " << p.vertexFile << " + " << p.fragmentFile << "\n";
+		}
+
+		lock.unlock();
+		return swapped;
+	}
+
+	static time_t modifiedTime(const std::string& fileName)
+	{
+		struct stat info;
+		if (stat(fileName.c_str(), &info) != 0)
+			return 0;
+		return info.st_mtime;
+	}
+
+	// The worker thread
+	void run()
+	{
+		glfwMakeContextCurrent(context);
+
+#ifdef __linux__
+		// Watch the whole directory. Most editors save by writing a new file and renaming it over the old one,
+		// which a watch on the file itself would miss.
+		int notify = inotify_init1(IN_NONBLOCK);
+		int watchHandle = inotify_add_watch(notify, ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+		char events[4096];
+#endif
+
+		while (running)
+		{
+#ifdef __linux__
+			pollfd pfd = { notify, POLLIN, 0 };
+			// Wake up every 100ms to check if we should stop.
+			if (poll(&pfd, 1, 100) > 0)
+			{
+				int length = read(notify, events, sizeof(events));
+				for (int offset = 0; offset < length;)
+				{
+					inotify_event* e = (inotify_event*)(events + offset);
+					if (e->len > 0)
+						markChanged(e->name);
+					offset += sizeof(inotify_event) + e->len;
+				}
+			}
+#else
+			std::this_thread::sleep_for(std::chrono::milliseconds(250));
+			for (unsigned int i = 0; i < programs.size(); i++)
+			{
+				time_t vertexTime = modifiedTime(programs[i].vertexFile);
+				time_t fragmentTime = modifiedTime(programs[i].fragmentFile);
+				if (vertexTime != programs[i].vertexTime || fragmentTime != programs[i].fragmentTime)
+				{
+					programs[i].vertexTime = vertexTime;
+					programs[i].fragmentTime = fragmentTime;
+					programs[i].dirty = true;
+				}
+			}
+#endif
+			for (unsigned int i = 0; i < programs.size(); i++)
+			{
+				if (programs[i].dirty)
+				{
+					programs[i].dirty = false;
+					rebuild(programs[i]);
+				}
+			}
+		}
+
+#ifdef __linux__
+		inotify_rm_watch(notify, watchHandle);
+		close(notify);
+#endif
+		glfwMakeContextCurrent(nullptr);
+	}
+
+	void markChanged(const std::string& fileName)
+	{
+		for (unsigned int i = 0; i < programs.size(); i++)
+		{
+			if (programs[i].vertexFile == fileName || programs[i].fragmentFile == fileName)
+				programs[i].dirty = true;
+		}
+	}
+
+	// Compiles and links a new program on the worker thread. On failure the old program is kept.
+	void rebuild(WatchedProgram& p)
+	{
+		GLuint vertex = createShader(readShader(p.vertexFile), GL_VERTEX_SHADER);
+		GLuint fragment = createShader(readShader(p.fragmentFile), GL_FRAGMENT_SHADER);
+
+		if (vertex == 0 || fragment == 0)
+		{
+			glDeleteShader(vertex);
+			glDeleteShader(fragment);
+			return;
+		}
+
+		GLuint newProgram = glCreateProgram();
+		glAttachShader(newProgram, vertex);
+		glAttachShader(newProgram, fragment);
+		glLinkProgram(newProgram);
+
+		// The program keeps its own copy of the compiled code, so the shaders can go.
+		glDetachShader(newProgram, vertex);
+		glDetachShader(newProgram, fragment);
+		glDeleteShader(vertex);
+		glDeleteShader(fragment);
+
+		GLint isLinked = 0;
+		glGetProgramiv(newProgram, GL_LINK_STATUS, &isLinked);
+		if (isLinked == GL_FALSE)
+		{
+			char infolog[1024];
+			glGetProgramInfoLog(newProgram, 1024, NULL, infolog);
+			std::cout << "The program failed to link with the error:" << std::endl << infolog << std::endl;
+			glDeleteProgram(newProgram);
+			return;
+		}
+
+		// The fence is signaled once the GPU is done with everything we sent before it, including the link.
+		GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		// Flush so the fence actually reaches the GPU; otherwise the render thread could wait on it forever.
+		glFlush();
+
+		std::lock_guard<std::mutex> guard(lock);
+		// If a previous build is still waiting for its fence, this one replaces it.
+		if (p.fence != 0)
+		{
+			glDeleteSync(p.fence);
+			glDeleteProgram(p.newProgram);
+		}
+		p.newProgram = newProgram;
+		p.fence = fence;
+	}
+
+}shaderReloader;
+
+#endif _SHADER_RELOADER_H
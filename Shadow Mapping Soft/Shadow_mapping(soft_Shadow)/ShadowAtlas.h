@@ -0,0 +1,293 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: ShadowAtlas.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+Description:
+Shadows for many lights at once, all in one big depth texture (an atlas).
+
+Besides the main light, the scene can have any number of spot lights, each with
+its own shadow map. Giving every light its own 800x800 texture would make the
+memory grow with every light, and most of those pixels would be wasted on lights
+that only cover a few pixels of the screen. Instead every light gets a square
+tile of one 4096x4096 depth texture, and the size of the tile is picked again
+every frame from how big the light's area looks from the camera: a light right
+in front of the camera gets 1024x1024, one far away gets 128x128, and one that
+the camera can't see at all gets nothing and costs nothing.
+
+The tiles are all powers of two, so they can be packed without any search. They
+are sorted from the biggest to the smallest, and placed one after the other in
+Morton order (the order of a Z curve over the atlas, in steps of the smallest
+tile). Every tile is as big as or smaller than the ones before it, so it always
+starts where a tile of its size fits. If they don't fit, the biggest tiles are
+halved until they do, so the atlas never grows, the shadows just get blurrier.
+
+The first pass draws each light's shadow casters into its tile, with the viewport
+set to the tile. The second pass gets the lights in a uniform block: for each of
+them the matrix that takes a point from view space to its tile in the atlas, the
+light's position and color, and the corners of its tile, so the filter never
+reads the neighbouring tiles.
+
+Only the lights that cover the most of the screen get a tile, up to a budget
+(--shadow-budget). The others still light the scene through the clustered lights
+(ClusteredLights.h), but without shadows.
+
+Everything about the tiles is worked out on the update thread and put in the
+frame snapshot. The render thread only draws.
+*/
+
+#ifndef _SHADOW_ATLAS_H
+#define _SHADOW_ATLAS_H
+
+#include "GLIncludes.h"
+#include "Scene.h"
+
+#define ATLAS_SIZE 4096
+#define ATLAS_MAX_TILE 1024
+#define ATLAS_MIN_TILE 128
+// The size of the array in the AtlasBlock of LightFragShader.glsl.
+#define MAX_ATLAS_LIGHTS 64
+// Match the bindings in LightFragShader.glsl.
+#define ATLAS_TEXTURE_UNIT 4
+#define ATLAS_BLOCK_BINDING 2
+
+// A spot light with its shadow in the atlas.
+struct AtlasLight
+{
+	glm::vec3 position;
+	glm::vec3 target;			// Where it points
+	glm::vec3 color;
+	float range;				// How far it reaches, which is also the far plane of its shadow map
+	float fov;					// The angle of the cone, in radians
+};
+
+// Where a light is in the atlas this frame, and everything needed to draw it.
+struct AtlasTile
+{
+	int light;
+	int x, y, size;				// In texels
+	glm::mat4 PV;				// The light's projection * view, for drawing its casters
+	glm::mat4 viewToAtlas;		// From the camera's view space to the tile, for the second pass
+	glm::vec3 viewPosition;		// The light in the camera's view space
+	glm::vec3 color;
+	float range;
+	int firstDraw, drawCount;	// Its casters in the snapshot's atlas draw list
+};
+
+// The std140 layout of one light in the AtlasBlock.
+struct AtlasLightUniforms
+{
+	glm::mat4 ShadowMatrix;		// View space to atlas coordinates
+	glm::vec4 Position;			// In view space, with the range in w
+	glm::vec4 Color;
+	glm::vec4 Tile;				// The corners of the tile, in texture coordinates: lowest in xy, highest in zw
+};
+
+struct AtlasBlockUniforms
+{
+	int AtlasLightCount;
+	int padding[3];
+	AtlasLightUniforms AtlasLights[MAX_ATLAS_LIGHTS];
+};
+
+struct ShadowAtlas
+{
+	GLuint texture;
+	GLuint fbo;
+	bool usable;
+
+	// Only the update thread uses these.
+	std::vector<AtlasLight> lights;
+	std::vector<AtlasTile> candidates;	// Every light the camera can see, before the budget
+	std::vector<int> tileOfLight;		// The tile each light got in the last allocate(), -1 if none
+
+	void init()
+	{
+		usable = true;
+		GLfloat border[] = { 1.0f, 0.0f, 0.0f, 0.0f };
+
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, ATLAS_SIZE, ATLAS_SIZE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LESS);
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+		GLenum drawbuf[] = { GL_NONE };
+		glDrawBuffers(1, drawbuf);
+		glReadBuffer(GL_NONE);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			std::cout << "Shadow atlas framebuffer not created, the spot lights have no shadows.\n";
+			usable = false;
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	void release()
+	{
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &texture);
+		fbo = 0;
+		texture = 0;
+	}
+
+	// A sphere around the light's cone, from the light to its range.
+	static void bounds(const AtlasLight& light, glm::vec3& center, float& radius)
+	{
+		glm::vec3 direction = glm::normalize(light.target - light.position);
+		float halfAngle = light.fov * 0.5f;
+		center = light.position + direction * (light.range * 0.5f);
+		radius = glm::length(glm::vec2(light.range * 0.5f, light.range * tanf(halfAngle)));
+	}
+
+	// The tile size for a light: about as many texels across as the light's area covers pixels on the screen.
+	// focal is the [1][1] element of the camera's projection, screenSize the height of the window in pixels.
+	static int tileSize(const glm::vec3& viewCenter, float radius, float focal, int screenSize)
+	{
+		float distance = glm::length(viewCenter);
+		if (distance <= radius)
+			return ATLAS_MAX_TILE;
+		float pixels = radius / distance * focal * screenSize;
+		int size = ATLAS_MIN_TILE;
+		while (size < pixels && size < ATLAS_MAX_TILE)
+			size *= 2;
+		return size;
+	}
+
+	// The x and y of the n-th cell on a Z curve: the bits of n alternate between x and y.
+	static void mortonToXY(unsigned int n, int& x, int& y)
+	{
+		x = 0;
+		y = 0;
+		for (int bit = 0; bit < 16; bit++)
+		{
+			x |= ((n >> (2 * bit)) & 1) << bit;
+			y |= ((n >> (2 * bit + 1)) & 1) << bit;
+		}
+	}
+
+	// Picks and packs the tiles of the lights the camera can see, at most budget of them. Returns the number of tiles.
+	int allocate(const glm::mat4& view, const Frustum& camera, float focal, int screenSize, int budget, AtlasTile* tiles)
+	{
+		candidates.clear();
+		for (unsigned int i = 0; i < lights.size(); i++)
+		{
+			glm::vec3 center;
+			float radius;
+			bounds(lights[i], center, radius);
+			if (!camera.containsSphere(center, radius))
+				continue;
+
+			AtlasTile tile;
+			tile.light = i;
+			tile.size = tileSize(glm::vec3(view * glm::vec4(center, 1.0f)), radius, focal, screenSize);
+			candidates.push_back(tile);
+		}
+
+		// Biggest first, so the budget goes to the lights that cover the most of the screen,
+		// and every tile starts at a place a tile of its size fits.
+		std::sort(candidates.begin(), candidates.end(), [](const AtlasTile& a, const AtlasTile& b)
+		{
+			return a.size > b.size || (a.size == b.size && a.light < b.light);
+		});
+		int count = std::min((int)candidates.size(), std::min(budget, MAX_ATLAS_LIGHTS));
+		for (int t = 0; t < count; t++)
+			tiles[t] = candidates[t];
+
+		// Halve the biggest tiles until all of them fit. Sizes are in units of the smallest tile.
+		const int capacity = (ATLAS_SIZE / ATLAS_MIN_TILE) * (ATLAS_SIZE / ATLAS_MIN_TILE);
+		while (true)
+		{
+			int used = 0;
+			for (int t = 0; t < count; t++)
+				used += (tiles[t].size / ATLAS_MIN_TILE) * (tiles[t].size / ATLAS_MIN_TILE);
+			if (used <= capacity || tiles[0].size == ATLAS_MIN_TILE)
+				break;
+			int biggest = tiles[0].size;
+			for (int t = 0; t < count && tiles[t].size == biggest; t++)
+				tiles[t].size /= 2;
+		}
+
+		unsigned int cursor = 0;
+		int placed = 0;
+		for (int t = 0; t < count; t++)
+		{
+			unsigned int cells = (tiles[t].size / ATLAS_MIN_TILE) * (tiles[t].size / ATLAS_MIN_TILE);
+			if (cursor + cells > (unsigned int)capacity)
+				break;
+			AtlasTile& tile = tiles[placed++];
+			tile = tiles[t];
+			mortonToXY(cursor, tile.x, tile.y);
+			tile.x *= ATLAS_MIN_TILE;
+			tile.y *= ATLAS_MIN_TILE;
+			cursor += cells;
+			setMatrices(tile, lights[tile.light], view);
+		}
+
+		tileOfLight.assign(lights.size(), -1);
+		for (int t = 0; t < placed; t++)
+			tileOfLight[tiles[t].light] = t;
+		return placed;
+	}
+
+	static void setMatrices(AtlasTile& tile, const AtlasLight& light, const glm::mat4& view)
+	{
+		glm::vec3 direction = glm::normalize(light.target - light.position);
+		glm::vec3 up = fabs(direction.y) > 0.9f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+		glm::mat4 lightView = glm::lookAt(light.position, light.target, up);
+		glm::mat4 lightProjection = glm::perspective(light.fov, 1.0f, 0.1f, light.range);
+		tile.PV = lightProjection * lightView;
+
+		// Clip space to [0, 1] (the bias matrix), and then to the tile.
+		float scale = (float)tile.size / ATLAS_SIZE;
+		glm::mat4 toTile(1.0f);
+		toTile[0][0] = 0.5f * scale;
+		toTile[1][1] = 0.5f * scale;
+		toTile[2][2] = 0.5f;
+		toTile[3] = glm::vec4(0.5f * scale + (float)tile.x / ATLAS_SIZE, 0.5f * scale + (float)tile.y / ATLAS_SIZE, 0.5f, 1.0f);
+		tile.viewToAtlas = toTile * tile.PV * glm::inverse(view);
+		tile.viewPosition = glm::vec3(view * glm::vec4(light.position, 1.0f));
+		tile.color = light.color;
+		tile.range = light.range;
+	}
+
+	// What the second pass needs from a tile.
+	static void uniforms(const AtlasTile& tile, AtlasLightUniforms& out)
+	{
+		out.ShadowMatrix = tile.viewToAtlas;
+		out.Position = glm::vec4(tile.viewPosition, tile.range);
+		out.Color = glm::vec4(tile.color, 1.0f);
+		out.Tile = glm::vec4((float)tile.x / ATLAS_SIZE, (float)tile.y / ATLAS_SIZE,
+			(float)(tile.x + tile.size) / ATLAS_SIZE, (float)(tile.y + tile.size) / ATLAS_SIZE);
+	}
+
+}shadowAtlas;
+
+#endif _SHADOW_ATLAS_H
@@ -0,0 +1,141 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: StaticShadowCache.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+Description:
+A second shadow map that only has the objects that never move in it, so they
+don't have to be drawn into the shadow map every frame.
+
+Most of what casts shadows in a scene stays where it is: the ground, the walls,
+the furniture. Their depth from the light only changes when the light moves, so
+we draw them once into this cache and keep it. Every frame the cache is copied
+into the real shadow map, and only the objects that can move are drawn on top,
+with the normal depth test. The result is the same shadow map as drawing all of
+them, but the cost of a frame only grows with the moving objects.
+
+The copy is one glCopyImageSubData (OpenGL 4.3), which copies the texels as they
+are without drawing anything. Both textures have the same format, which it needs.
+Without it, the depth is copied with glBlitFramebuffer instead.
+
+The cache is drawn again whenever the light's matrix changes, or when the set of
+objects that don't move changes (the scene tells us with a version number).
+*/
+
+#ifndef _STATIC_SHADOW_CACHE_H
+#define _STATIC_SHADOW_CACHE_H
+
+#include "GLIncludes.h"
+#include "GLStateCache.h"
+
+struct StaticShadowCache
+{
+	GLuint texture;				// Same format and size as the shadow map
+	GLuint fbo;
+	int width, height;
+	bool copyImage;				// glCopyImageSubData is there, otherwise we blit
+	bool usable;				// False if the framebuffer could not be made
+
+	// What the cache was drawn with. It is only valid for the same light and the same static objects.
+	bool valid;
+	glm::mat4 lightMatrix;
+	unsigned int staticVersion;
+
+	int rebuilds;				// How many times the static objects were drawn again
+
+	void init(int w, int h)
+	{
+		width = w;
+		height = h;
+		usable = true;
+		valid = false;
+		rebuilds = 0;
+		copyImage = GLEW_ARB_copy_image != 0;
+
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32, width, height);
+		// Never sampled, only copied from.
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+		GLenum drawbuf[] = { GL_NONE };
+		glDrawBuffers(1, drawbuf);
+		glReadBuffer(GL_NONE);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			std::cout << "Static shadow cache framebuffer not created, drawing every object every frame.\n";
+			usable = false;
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	void release()
+	{
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &texture);
+		fbo = 0;
+		texture = 0;
+	}
+
+	// True if the static objects have to be drawn into the cache again before it can be used.
+	bool stale(const glm::mat4& light, unsigned int version) const
+	{
+		return !valid || version != staticVersion || light != lightMatrix;
+	}
+
+	// Binds the cache and clears it. Draw the static objects after this.
+	void begin()
+	{
+		glState.bindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glClear(GL_DEPTH_BUFFER_BIT);
+	}
+
+	// Remembers what the cache was drawn with.
+	void end(const glm::mat4& light, unsigned int version)
+	{
+		lightMatrix = light;
+		staticVersion = version;
+		valid = true;
+		rebuilds++;
+	}
+
+	// Copies the cache into the shadow map. shadowFbo has shadowMap as its depth attachment.
+	void copyTo(GLuint shadowMap, GLuint shadowFbo)
+	{
+		if (copyImage)
+		{
+			glCopyImageSubData(texture, GL_TEXTURE_2D, 0, 0, 0, 0, shadowMap, GL_TEXTURE_2D, 0, 0, 0, 0, width, height, 1);
+			return;
+		}
+
+		glState.bindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glState.bindFramebuffer(GL_DRAW_FRAMEBUFFER, shadowFbo);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+	}
+
+}staticShadowCache;
+
+#endif _STATIC_SHADOW_CACHE_H
@@ -0,0 +1,282 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: ThreadPool.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+A small pool of worker threads for the CPU side of the renderer. The threads are
+created once and sleep until there is work. parallelFor() runs a function for
+every index in a range, spread over all the workers and the calling thread, and
+returns when all of them are done.
+
+The work is balanced by work stealing. The range is cut into one piece per thread
+up front, and every thread has its own queue holding its piece. A thread takes
+indices from the front of its own queue, so most of the time it only touches its
+own data. When its queue is empty, it goes through the other queues and steals
+the back half of the first one that still has work. So a thread that got the
+cheap tiles (empty sky, say) ends up helping with the expensive ones.
+
+When every index is only a little work (transforming one object, say), going to
+the queue for each one would cost more than the work itself. parallelForRange()
+groups the indices into chunks of a given grain size, and each task runs a whole
+chunk, so the queues are only touched once per chunk.
+
+Only one thread can hand the pool work at a time, any other waits until the first
+parallelFor is done. So the update thread is the one that uses it every frame. The
+render thread only copies what the update thread computed, and only uses the pool
+for the CPU comparisons it runs when a key asks for them.
+A task must not call parallelFor itself, it would wait for itself forever.
+
+The function is not wrapped in a std::function, which goes to the heap when the
+lambda captures more than a couple of variables. The pool only keeps a pointer to
+it and a function that knows its type, so handing out work never allocates.
+*/
+
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include "GLIncludes.h"
+#include <condition_variable>
+
+struct ThreadPool
+{
+	// The indices one thread still has to run, from begin to end - 1.
+	struct WorkQueue
+	{
+		std::mutex lock;
+		int begin, end;
+	};
+
+	// The function of a parallelFor, and how to call it without knowing its type.
+	struct Task
+	{
+		const void* function;
+		void (*call)(const void* function, int index);
+	};
+
+	template<typename Function>
+	static void callFunction(const void* function, int index)
+	{
+		(*(const Function*)function)(index);
+	}
+
+	std::vector<std::thread> workers;
+	WorkQueue* queues;					// One per thread. Index 0 belongs to the calling thread.
+	std::mutex lock;
+	std::mutex callers;					// Held for the whole of a parallelFor, so two threads can't give the pool work at once
+	std::condition_variable wake;		// Signaled when there is new work (or when stopping)
+	std::condition_variable finished;	// Signaled when the last worker is done with the current work
+
+	Task task;
+	int busy;							// Workers still running the current task
+	unsigned int generation;			// Incremented for every parallelFor, so the workers can tell new work from old
+	bool stopping;
+
+	// threadCount includes the calling thread, so 1 means everything runs on the caller.
+	// A pool that is already running is stopped first, so its workers and queues don't leak.
+	void start(int threadCount)
+	{
+		if (queues != nullptr)
+			stop();
+
+		stopping = false;
+		generation = 0;
+		busy = 0;
+		task.function = nullptr;
+		if (threadCount <= 0)
+			threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+
+		queues = new WorkQueue[threadCount];
+		for (int i = 0; i < threadCount; i++)
+		{
+			queues[i].begin = 0;
+			queues[i].end = 0;
+		}
+
+		for (int i = 1; i < threadCount; i++)
+			workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (unsigned int i = 0; i < workers.size(); i++)
+			workers[i].join();
+		workers.clear();
+		delete[] queues;
+		queues = nullptr;
+	}
+
+	int size()
+	{
+		return (int)workers.size() + 1;
+	}
+
+	// Which thread of the pool this is, from 1 to size() - 1 for the workers. 0 for any other thread,
+	// which is the one that called parallelFor when it is inside a task.
+	int threadIndex()
+	{
+		std::thread::id self = std::this_thread::get_id();
+		for (unsigned int i = 0; i < workers.size(); i++)
+		{
+			if (workers[i].get_id() == self)
+				return i + 1;
+		}
+		return 0;
+	}
+
+	// Calls function(i) for every i from 0 to n-1 and waits until all of them are done.
+	template<typename Function>
+	void parallelFor(int n, const Function& function)
+	{
+		// With a single index there is nothing to share, so we don't wake anyone.
+		if (workers.empty() || n <= 1)
+		{
+			for (int i = 0; i < n; i++)
+				function(i);
+			return;
+		}
+
+		Task work = { &function, &callFunction<Function> };
+		run(n, work);
+	}
+
+	void run(int n, const Task& work)
+	{
+		std::lock_guard<std::mutex> callerGuard(callers);
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			task = work;
+			busy = (int)workers.size();
+			generation++;
+
+			// Give every thread an equal piece to start with.
+			int threads = size();
+			for (int i = 0; i < threads; i++)
+			{
+				std::lock_guard<std::mutex> queueGuard(queues[i].lock);
+				queues[i].begin = (int)((long long)n * i / threads);
+				queues[i].end = (int)((long long)n * (i + 1) / threads);
+			}
+		}
+		wake.notify_all();
+
+		// The caller helps instead of just waiting.
+		runTask(work, 0);
+
+		std::unique_lock<std::mutex> guard(lock);
+		while (busy > 0)
+			finished.wait(guard);
+		task.function = nullptr;
+	}
+
+	// Calls function(begin, end) for consecutive pieces of 0 to n-1, each at most grain indices long,
+	// and waits until all of them are done. The pieces are what gets shared and stolen.
+	template<typename Function>
+	void parallelForRange(int n, int grain, const Function& function)
+	{
+		grain = std::max(grain, 1);
+		int chunks = (n + grain - 1) / grain;
+		parallelFor(chunks, [&](int chunk)
+		{
+			function(chunk * grain, std::min(n, (chunk + 1) * grain));
+		});
+	}
+
+	// Takes the next index from the front of a thread's own queue. Returns false if it is empty.
+	bool takeOwn(int self, int& index)
+	{
+		WorkQueue& queue = queues[self];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		if (queue.begin >= queue.end)
+			return false;
+		index = queue.begin++;
+		return true;
+	}
+
+	// Moves the back half of another thread's queue into our own. Returns false if there was nothing left anywhere.
+	bool steal(int self)
+	{
+		int threads = size();
+		for (int offset = 1; offset < threads; offset++)
+		{
+			WorkQueue& victim = queues[(self + offset) % threads];
+			int begin, end;
+			{
+				std::lock_guard<std::mutex> guard(victim.lock);
+				int remaining = victim.end - victim.begin;
+				if (remaining <= 0)
+					continue;
+				begin = victim.end - (remaining + 1) / 2;
+				end = victim.end;
+				victim.end = begin;
+			}
+
+			// Only one lock at a time, so two threads stealing from each other can't deadlock.
+			std::lock_guard<std::mutex> guard(queues[self].lock);
+			queues[self].begin = begin;
+			queues[self].end = end;
+			return true;
+		}
+		return false;
+	}
+
+	void runTask(const Task& work, int self)
+	{
+		int index;
+		do
+		{
+			while (takeOwn(self, index))
+				work.call(work.function, index);
+		} while (steal(self));
+	}
+
+	void workerLoop(int self)
+	{
+		unsigned int seen = 0;
+		while (true)
+		{
+			Task current;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				while (!stopping && generation == seen)
+					wake.wait(guard);
+				if (stopping)
+					return;
+				seen = generation;
+				current = task;
+			}
+
+			runTask(current, self);
+
+			std::lock_guard<std::mutex> guard(lock);
+			if (--busy == 0)
+				finished.notify_one();
+		}
+	}
+
+}threadPool;
+
+#endif _THREAD_POOL_H
@@ -0,0 +1,300 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: TransformStore.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+Description:
+The positions of all the objects as a structure of arrays, and the SSE kernels
+that compute their matrices for a frame, 4 objects at a time.
+
+Every object needs four matrices a frame: MVP = PV * Model, ModelView = View *
+Model, the shadow matrix S * Model and the MVP of the light, plus the normal
+matrix. Done one object at a time with glm, that is four full 4x4 products and a
+3x3 inverse per object, and with a million objects it is most of the frame.
+
+But the model matrix of our objects is only a translation T. For any matrix M,
+the first three columns of M * T are the first three columns of M, and the last
+one is M times the position. So per object only one column of each product is
+new, and the other twelve numbers are the same for every object that frame.
+The normal matrix is the inverse transpose of the top left 3x3 of ModelView,
+which is the same as that of View, so it is the same for every object too. And
+since the view matrix is a rotation plus a translation, its inverse transpose is
+just itself, so we don't even need the inverse.
+
+The positions are stored as separate arrays of x, y and z (a structure of arrays),
+so one SSE load gets the x of 4 objects. Each row of a new column is then
+x * M[0] + y * M[1] + z * M[2] + M[3] for 4 objects at once. The results go out
+the same way, one array per row of each column.
+
+The culling tests the bounding spheres of the same 4 objects against the planes
+of both view volumes in the same loop, while the positions are still in registers.
+The sum for every value is done in the same order glm does it, so the results
+match the one object at a time version within float rounding. The compiler is
+free to fuse a multiply and an add in one version and not the other.
+*/
+
+#ifndef _TRANSFORM_STORE_H
+#define _TRANSFORM_STORE_H
+
+#include "GLIncludes.h"
+#include "FrameArena.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define TRANSFORM_STORE_SSE
+#include <emmintrin.h>
+#endif
+
+// The parts of the matrices that are the same for every object this frame.
+struct SharedTransforms
+{
+	glm::mat4 view;
+	glm::mat4 PV;
+	glm::mat4 lightPV;
+	glm::mat4 lightS;
+	glm::mat3 NormalMatrix;
+
+	void set(const glm::mat4& v, const glm::mat4& pv, const glm::mat4& lpv, const glm::mat4& ls)
+	{
+		view = v;
+		PV = pv;
+		lightPV = lpv;
+		lightS = ls;
+		NormalMatrix = normalMatrix(glm::mat3(view));
+	}
+
+	// The inverse transpose, or the matrix itself if it is a rotation (its columns are orthonormal),
+	// in which case the two are the same.
+	static glm::mat3 normalMatrix(const glm::mat3& m)
+	{
+		const float tolerance = 1e-5f;
+		bool rotation = true;
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+				rotation &= fabs(glm::dot(m[i], m[j]) - (i == j ? 1.0f : 0.0f)) < tolerance;
+		}
+		return rotation ? m : glm::transpose(glm::inverse(m));
+	}
+};
+
+struct TransformStore
+{
+	int count;
+	// One value per object, and a few more so the kernels can always read 4 at once.
+	std::vector<float> x, y, z, radius;
+
+	// This frame's last column of each product, one array per row. Set by allocateOutputs().
+	float* mvp[4];
+	float* modelView[4];
+	float* shadow[4];
+	float* lightMVP[4];
+
+	void resize(int n)
+	{
+		count = n;
+		x.assign(n + 4, 0.0f);
+		y.assign(n + 4, 0.0f);
+		z.assign(n + 4, 0.0f);
+		radius.assign(n + 4, 0.0f);
+	}
+
+	void set(int i, const glm::vec3& position, float r)
+	{
+		x[i] = position.x;
+		y[i] = position.y;
+		z[i] = position.z;
+		radius[i] = r;
+	}
+
+	// The output arrays live in the frame's arena.
+	void allocateOutputs(FrameArena& arena)
+	{
+		for (int row = 0; row < 4; row++)
+		{
+			mvp[row] = arena.allocateArray<float>(count + 4, 0);
+			modelView[row] = arena.allocateArray<float>(count + 4, 0);
+			shadow[row] = arena.allocateArray<float>(count + 4, 0);
+			lightMVP[row] = arena.allocateArray<float>(count + 4, 0);
+		}
+	}
+
+	// The matrices of object i, put together from the shared parts and its own column.
+	glm::mat4 model(int i) const
+	{
+		glm::mat4 m(1.0f);
+		m[3] = glm::vec4(x[i], y[i], z[i], 1.0f);
+		return m;
+	}
+
+	static glm::mat4 withColumn(const glm::mat4& shared, float* const column[4], int i)
+	{
+		glm::mat4 m = shared;
+		m[3] = glm::vec4(column[0][i], column[1][i], column[2][i], column[3][i]);
+		return m;
+	}
+
+	// Computes the new columns of the objects from begin to end - 1, and culls them against both sets of planes.
+	// The visible objects are added to the lists, in order. begin has to be a multiple of 4, see computeSSE().
+	void compute(int begin, int end, const SharedTransforms& shared, const glm::vec4* cameraPlanes, const glm::vec4* lightPlanes,
+		int* cameraVisible, int& cameraCount, int* lightVisible, int& lightCount)
+	{
+#ifdef TRANSFORM_STORE_SSE
+		computeSSE(begin, end, shared, cameraPlanes, lightPlanes, cameraVisible, cameraCount, lightVisible, lightCount);
+#else
+		computeScalar(begin, end, shared, cameraPlanes, lightPlanes, cameraVisible, cameraCount, lightVisible, lightCount);
+#endif
+	}
+
+	// The new columns of a single object. Same math in the same order as the SSE version.
+	void computeObject(int i, const SharedTransforms& shared)
+	{
+		const glm::mat4* matrices[4] = { &shared.PV, &shared.view, &shared.lightS, &shared.lightPV };
+		float** outputs[4] = { mvp, modelView, shadow, lightMVP };
+		for (int p = 0; p < 4; p++)
+		{
+			const glm::mat4& m = *matrices[p];
+			for (int row = 0; row < 4; row++)
+				outputs[p][row][i] = m[0][row] * x[i] + m[1][row] * y[i] + m[2][row] * z[i] + m[3][row];
+		}
+	}
+
+	// One object at a time, for machines without SSE.
+	void computeScalar(int begin, int end, const SharedTransforms& shared, const glm::vec4* cameraPlanes, const glm::vec4* lightPlanes,
+		int* cameraVisible, int& cameraCount, int* lightVisible, int& lightCount)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			computeObject(i, shared);
+
+			if (insideScalar(cameraPlanes, i))
+				cameraVisible[cameraCount++] = i;
+			if (insideScalar(lightPlanes, i))
+				lightVisible[lightCount++] = i;
+		}
+	}
+
+	// Same test as Frustum::containsSphere().
+	bool insideScalar(const glm::vec4* planes, int i) const
+	{
+		for (int p = 0; p < 6; p++)
+		{
+			if (planes[p].x * x[i] + planes[p].y * y[i] + planes[p].z * z[i] + planes[p].w < -radius[i])
+				return false;
+		}
+		return true;
+	}
+
+#ifdef TRANSFORM_STORE_SSE
+	// A matrix with every element in all 4 lanes, so the loop doesn't have to broadcast them again.
+	struct SplatMatrix
+	{
+		__m128 m[4][4];		// [column][row]
+
+		void set(const glm::mat4& source)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				for (int r = 0; r < 4; r++)
+					m[c][r] = _mm_set1_ps(source[c][r]);
+			}
+		}
+	};
+
+	static void column(const SplatMatrix& s, __m128 px, __m128 py, __m128 pz, float* const out[4], int i)
+	{
+		for (int r = 0; r < 4; r++)
+		{
+			__m128 v = _mm_mul_ps(s.m[0][r], px);
+			v = _mm_add_ps(v, _mm_mul_ps(s.m[1][r], py));
+			v = _mm_add_ps(v, _mm_mul_ps(s.m[2][r], pz));
+			v = _mm_add_ps(v, s.m[3][r]);
+			_mm_storeu_ps(out[r] + i, v);
+		}
+	}
+
+	// A bit for each of the 4 objects that is inside all 6 planes.
+	static int insideMask(const __m128 planes[6][4], __m128 px, __m128 py, __m128 pz, __m128 negativeRadius)
+	{
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < 6; p++)
+		{
+			__m128 d = _mm_mul_ps(planes[p][0], px);
+			d = _mm_add_ps(d, _mm_mul_ps(planes[p][1], py));
+			d = _mm_add_ps(d, _mm_mul_ps(planes[p][2], pz));
+			d = _mm_add_ps(d, planes[p][3]);
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(d, negativeRadius));
+		}
+		return _mm_movemask_ps(inside);
+	}
+
+	void computeSSE(int begin, int end, const SharedTransforms& shared, const glm::vec4* cameraPlanes, const glm::vec4* lightPlanes,
+		int* cameraVisible, int& cameraCount, int* lightVisible, int& lightCount)
+	{
+		SplatMatrix matrices[4];
+		matrices[0].set(shared.PV);
+		matrices[1].set(shared.view);
+		matrices[2].set(shared.lightS);
+		matrices[3].set(shared.lightPV);
+
+		__m128 camera[6][4], light[6][4];
+		for (int p = 0; p < 6; p++)
+		{
+			for (int k = 0; k < 4; k++)
+			{
+				camera[p][k] = _mm_set1_ps(cameraPlanes[p][k]);
+				light[p][k] = _mm_set1_ps(lightPlanes[p][k]);
+			}
+		}
+
+		// The last group writes all 4 lanes even when the range ends in the middle of it. The lanes past the end
+		// are the first objects of the next range, so two threads would write the same floats unless every range
+		// starts on a multiple of 4 (see SCENE_GRAIN_SIZE). After the last object they land in the padding.
+		for (int i = begin; i < end; i += 4)
+		{
+			__m128 px = _mm_loadu_ps(&x[i]);
+			__m128 py = _mm_loadu_ps(&y[i]);
+			__m128 pz = _mm_loadu_ps(&z[i]);
+			__m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&radius[i]));
+
+			column(matrices[0], px, py, pz, mvp, i);
+			column(matrices[1], px, py, pz, modelView, i);
+			column(matrices[2], px, py, pz, shadow, i);
+			column(matrices[3], px, py, pz, lightMVP, i);
+
+			// The lanes past the end belong to the next range, or to nothing.
+			int lanes = (1 << std::min(end - i, 4)) - 1;
+			int cameraMask = insideMask(camera, px, py, pz, negativeRadius) & lanes;
+			int lightMask = insideMask(light, px, py, pz, negativeRadius) & lanes;
+			for (int k = 0; k < 4; k++)
+			{
+				if (cameraMask & (1 << k))
+					cameraVisible[cameraCount++] = i + k;
+				if (lightMask & (1 << k))
+					lightVisible[lightCount++] = i + k;
+			}
+		}
+	}
+#endif
+
+};
+
+#endif _TRANSFORM_STORE_H
@@ -0,0 +1,91 @@
+/*
+Title: Shadow mapping (Soft Shadows)
+File Name: TripleBuffer.h
+Copyright  2015
+Original authors: Srinivasan Thiagarajan
+Written under the supervision of David I. Schwartz, Ph.D., and
+supported by a professional development seed grant from the B. Thomas
+Golisano College of Computing & Information Sciences
+(https://www.rit.edu/gccis) at the Rochester Institute of Technology.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or (at
+your option) any later version.
+
+This program is distributed in the hope that it will be useful, but
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Description:
+A triple buffer, to hand data from one thread to another without locks.
+One thread writes, the other reads, and neither ever waits for the other.
+
+There are three copies of the data. The writer owns one and fills it in, the
+reader owns another and reads from it, and the third is in the middle, holding
+the newest finished copy. When the writer is done, it swaps its copy with the
+middle one. When the reader wants new data, it swaps its copy with the middle
+one, if the middle one is newer than what it has. Both swaps are a single atomic
+exchange, so the two threads never touch the same copy at the same time.
+
+If the writer is faster, the copies the reader never got to are simply
+overwritten, so the reader always gets the newest one. If the reader is faster,
+it keeps the copy it has until a new one comes in.
+*/
+
+#ifndef _TRIPLE_BUFFER_H
+#define _TRIPLE_BUFFER_H
+
+#include "GLIncludes.h"
+
+template <typename T>
+struct TripleBuffer
+{
+	// The middle index, with this bit set when it holds a copy the reader hasn't taken yet.
+	static const int NEW_DATA = 4;
+
+	T buffers[3];
+	int writeIndex;					// Only used by the writer
+	int readIndex;					// Only used by the reader
+	std::atomic<int> middle;
+
+	void init()
+	{
+		writeIndex = 0;
+		middle = 1;
+		readIndex = 2;
+	}
+
+	// The copy the writer fills in. Nobody else looks at it until publish().
+	T& writeBuffer()
+	{
+		return buffers[writeIndex];
+	}
+
+	// Called by the writer when its copy is complete. Hands it to the middle and takes the old middle to write into.
+	void publish()
+	{
+		writeIndex = middle.exchange(writeIndex | NEW_DATA) & ~NEW_DATA;
+	}
+
+	// Called by the reader. Takes the newest copy if there is one. Returns false if nothing new came in.
+	bool acquire()
+	{
+		if ((middle.load() & NEW_DATA) == 0)
+			return false;
+		readIndex = middle.exchange(readIndex) & ~NEW_DATA;
+		return true;
+	}
+
+	// The copy the reader owns. Stays the same until the next acquire() that returns true.
+	const T& readBuffer() const
+	{
+		return buffers[readIndex];
+	}
+};
+
+#endif _TRIPLE_BUFFER_H
@@ -68,7 +68,11 @@ layout(location = 0) in vec3 in_position;	// Get in a vec3 for position
 layout(location = 1) in vec3 in_normal;
 layout(location = 2) in vec4 in_color;		// Get in a vec4 for color
 
-uniform mat4 MVP; // Our uniform MVP matrix to modify our position values
+// Our MVP matrix to modify our position values. Every draw binds its own copy from the frame data ring.
+layout(std140, binding = 1) uniform ObjectBlock
+{
+	mat4 MVP;
+};
 
 void main(void)
 {
@@ -54,9 +54,60 @@ Once the fragment has been determined to be in the blurry region, we further use
 offsets to sample the texels closer to the pixel. These values are then averaged and 
 used as shadow value for that pixel.
 
-Instructions: Use "1,2 and 3" to change the shadow.
+Temporal random sampling:
+Random sampling needs a lot of samples for a smooth penumbra. Instead of taking them all
+in one frame, we take a handful of them every frame, rotating the pattern each time, and
+blend the result with the shadow value we computed for the same surface in the last frame.
+To find that value we reproject the fragment with the previous frame's view-projection matrix
+and read it from a history buffer. The history stores the depth of the surface as well, so if
+the depths don't match (something else was on that pixel) the history is thrown away.
+After a few frames the result converges to the same soft shadow as the full random sampling.
+
+The matrices and the light are not set with glUniform*. They are written into a buffer that
+stays mapped for the whole program, and the shaders read them as uniform blocks (see FrameDataRing.h).
+
+The program runs on two threads. The main thread reads the input and updates the scene
+at a fixed rate, and hands a snapshot of it to the render thread, which owns the OpenGL
+context and draws the newest snapshot it has (see TripleBuffer.h). So the input keeps
+being read while the render thread waits on the GPU.
+
+Instructions: Use "1,2,3 and 4" to change the shadow.
 Use "w,a,s and d" to move the light source located on top ofthe object.
 Use "Space" and "LeftShift" to move the light source up or down respectively.
+Use "c" to render the shadow map on the CPU as well, and compare it with the one from the GPU.
+Run with "--cpu-shadow" to only time the CPU version, without opening a window.
+Run with "--bench-filters" to time the CPU versions of the three shadow filters.
+Use "v" to render the current view on the CPU and save it to cpu_frame.ppm.
+Run with "--cpu-render [1|2|3] [file]" to do that without a GPU, for example on a render farm.
+Run with "--shadow-quality [light radius] [rays]" to compare each technique with ray traced soft shadows.
+Run with "--bench-jobs [objects]" to time the per frame work on the objects (transforms, culling and
+draw lists) on 1 to all of the cores, and to check that a frame doesn't make the arenas grow (see FrameArena.h).
+Run with "--bench-transforms [objects]" to compare the SSE matrices and culling (see TransformStore.h) with
+doing it one object at a time with glm. A million objects if no number is given.
+Use "b" to switch between culling with the bounding volume hierarchy (see SceneBVH.h) and testing every
+object. Run with "--bench-bvh [objects]" to compare the two on scenes of 10 thousand objects and up.
+Use "h" to turn the depth pyramid early-out of the random sampling on and off. The window title shows
+how many fragments it saved from taking all the samples.
+Use "p" to start and stop recording the frames to capture_00000.png and so on (see FrameCapture.h).
+Run with "--capture [png|raw] [depth]" to record from the first frame, as PNG or PPM files, and the
+shadow map as well if "depth" is given.
+Use "m" to move the first sphere up and down. It is the only object that can move, so it is the only one
+drawn into the shadow map every frame. The rest is drawn once into a cached shadow map, which is copied
+into the real one every frame (see StaticShadowCache.h). Use "k" to turn the cache off and on, to compare.
+Run with "--lights [count]" to add that many spot lights in a ring around the scene, each with its shadow in
+a tile of one shared atlas (see ShadowAtlas.h). The lights of a scene file after the first are added the same way.
+Use "o" to give the light shadows in every direction, from a cube shadow map (see CubeShadowMap.h) instead of
+the shadow map in front of it. All six faces are drawn in one pass; "i" switches to drawing them in six
+passes, to compare. Press "o" again for the same from a dual paraboloid shadow map (see ParaboloidShadowMap.h),
+which only has two halves to draw instead of six faces. The window title shows how long the GPU takes for either.
+Run with "--point-lights [count]" to scatter that many small point lights over the ground. All the lights are
+sorted into clusters of the view volume first, so every pixel only goes through the lights that reach it (see
+ClusteredLights.h). Only the spot lights that cover the most of the screen get shadows, as many as
+"--shadow-budget [count]" allows (16 if not given).
+The spheres have coarser meshes for when they are far away. The camera pass picks one by how big the sphere
+is on the screen, the shadow passes by how big it is in the shadow map, and they are happy with a coarser one.
+Run with "--make-scene [file] [objects]" to write a scene file with that many spheres on a grid, and
+with "--scene [file]" to draw the objects from a scene file instead of the built-in ones (see SceneFile.h).
 
 References:
 OpenGL 4 Shading language Cookbook
@@ -65,12 +116,39 @@ OpenGL 4 Shading language Cookbook
 #pragma once
 #include "GLIncludes.h"
 #include "BasicFunctions.h"
+#include "ShaderReloader.h"
+#include "DepthPyramid.h"
+#include "FrameDataRing.h"
+#include "FrameCapture.h"
+#include "StaticShadowCache.h"
+#include "Scene.h"
+#include "SceneFile.h"
+#include "ShadowAtlas.h"
+#include "CubeShadowMap.h"
+#include "ParaboloidShadowMap.h"
+#include "ClusteredLights.h"
+#include "CPURasterizer.h"
+#include "CPUShadowFilters.h"
+#include "CPURenderer.h"
+#include "RayTracer.h"
+#include "TripleBuffer.h"
 
 #define PI 3.14159265
 #define WindowSize 800
 #define DIVISIONS 40
+// The size of the offset texture and the number of samples along each of its axes, see buildOffsetTex().
+#define OFFSET_TEX_SIZE 16
+#define OFFSET_SAMPLES_U 4
+#define OFFSET_SAMPLES_V 8
+// The spheres have this many levels of detail, each with fewer divisions than the one before (sphereDivisions).
+#define SPHERE_LODS 4
 #define TextureSize 800.0f
 #define speed 0.3f
+// Used by glPolygonOffset in the first pass, and by the CPU rasterizer to match it.
+#define PolygonOffsetFactor 10.0f
+#define PolygonOffsetUnits 15.0f
+// How many times per second the update thread reads the input and publishes a new frame.
+#define UpdateRate 120
 
 //Handle to the texture storing the depth
 GLuint depthTex;
@@ -81,43 +159,58 @@ GLuint fboHandle;
 
 GLuint shadowType;
 
+// In SPIR-V mode there are no subroutines. Each filter is its own program instead, specialized from the same SPIR-V.
+GLuint spirvRenderPrograms[4];
+
 glm::vec3 offsetTexSize;
+std::vector<float> offsetData;		// A copy of what is in offsetTex, for the CPU shadow filters
 glm::mat4 PV;
+glm::mat4 cameraView;
+glm::mat4 prevPV;		// The view-projection matrix used in the last frame. Used for reprojection.
+std::string sceneFileName;	// Given with --scene. Empty for the built-in scene.
+int movingObject = -1;		// The object "m" moves up and down, -1 if there is none
+int ringLights;				// Given with --lights
+// The coarser levels of the spheres, shared by both of them. Level 0 is each sphere's own mesh.
+// The divisions go into 360, so the rings of every level meet without a gap.
+const int sphereDivisions[SPHERE_LODS] = { DIVISIONS, 20, 12, 8 };
+stuff_for_drawing coarseSphere[SPHERE_LODS - 1];
+MeshLODs sphere1LODs, sphere2LODs;
+int scatteredLights;		// Given with --point-lights
+int shadowBudget = 16;		// Given with --shadow-budget. How many spot lights get a tile in the atlas.
+float animationTime;
 
 // A struct to hold the handle to the uniforms in the shader.
 struct shaderParams
 {
-	GLuint vec3_LightPos;
-	GLuint vec3_LightIntensity;
-	GLuint mat4_MVP;
-	GLuint mat4_ModelViewMatrix;
-	GLuint mat3_NormalMatrix;
-	GLuint mat4_ShadowMatrix;
+	// The rest of the uniforms are in the FrameBlock and ObjectBlock uniform blocks, which are fed from the frame data ring.
 	GLuint sub_shadow;
 	GLuint sampler_offsetTex;
-	GLuint vec3_offsetSize;
 
 	//Handles to subroutines in the shader
 	GLuint sub_func_basicShadow;
 	GLuint sub_func_PCFshadow;
 	GLuint sub_func_randomSamplingShadow;
+	GLuint sub_func_temporalSamplingShadow;
 
 	//This function retrieves the handle to the uniforms and stores it in the respective variables.
 	void initUniforms(GLuint programID)
 	{
 		glUseProgram(programID);
-		vec3_LightPos = glGetUniformLocation(programID, "pointLight.position");
-		vec3_LightIntensity = glGetUniformLocation(programID, "pointLight.Intensity");
-		mat4_MVP = glGetUniformLocation(programID, "MVP");
-		mat4_ModelViewMatrix = glGetUniformLocation(programID, "ModelViewMatrix");
-		mat3_NormalMatrix = glGetUniformLocation(programID, "NormalMatrix");
-		mat4_ShadowMatrix = glGetUniformLocation(programID, "ShadowMatrix");
 		sub_shadow = glGetUniformLocation(programID, "shadowSubUniform");
-		vec3_offsetSize = glGetUniformLocation(programID, "OffsetTexsize");
 
 		sub_func_basicShadow = glGetSubroutineIndex(programID, GL_FRAGMENT_SHADER, "basicShadow");
 		sub_func_PCFshadow = glGetSubroutineIndex(programID, GL_FRAGMENT_SHADER, "PCFshadow");
 		sub_func_randomSamplingShadow = glGetSubroutineIndex(programID, GL_FRAGMENT_SHADER, "randomSamplingShadow");
+		sub_func_temporalSamplingShadow = glGetSubroutineIndex(programID, GL_FRAGMENT_SHADER, "temporalSamplingShadow");
+	}
+
+	//SPIR-V programs have no subroutines. The "subroutines" are just the index of the program for that filter in spirvRenderPrograms.
+	void initSpirvUniforms()
+	{
+		sub_func_basicShadow = 0;
+		sub_func_PCFshadow = 1;
+		sub_func_randomSamplingShadow = 2;
+		sub_func_temporalSamplingShadow = 3;
 	}
 	
 }uniforms;
@@ -161,19 +254,188 @@ struct LightParams
 
 }light;
 
+// What the keys have changed, apart from the light. Only the update thread changes this.
+// The requests are counters, so the render thread can tell a new request from one it has already done,
+// even if it skipped the snapshots in between.
+struct ControlState
+{
+	int filter;						// 0 basic, 1 PCF, 2 random sampling, 3 temporal, like the keys 1 to 4
+	bool usePyramid;
+	unsigned int historyResets;		// Incremented whenever the temporal history is no longer valid
+	unsigned int compareRequests;	// "c": render the shadow map on the CPU and compare
+	unsigned int cpuFrameRequests;	// "v": render the frame on the CPU and save it
+	bool capturing;					// "p": record the frames to disk
+	bool animate;					// "m": move the dynamic sphere
+	bool cacheStaticShadows;		// "k": keep the objects that don't move in a cached shadow map
+	bool flatCulling;				// "b": test every object instead of walking the BVH
+	int omniShadows;				// "o": 0 shadows only in front of the light, 1 all around it from the cube shadow map,
+									// 2 from the dual paraboloid shadow map
+	bool cubeSixPasses;				// "i": draw the cube's faces one pass each instead of all in one
+}controls;
+
+// Everything needed to draw one frame. The update thread fills one in and publishes it,
+// and from then on nobody changes it, so the render thread can read it without any locks.
+struct FrameSnapshot
+{
+	LightParams light;
+	glm::mat4 PV;
+	glm::mat4 view;
+	// The objects that passed the culling, with their matrices. The meshes are in scene.objects, which never changes after setup.
+	// Their memory is in the snapshot's own arena, which is reset when the update thread fills the snapshot again.
+	FrameArena arena;
+	CameraDrawList cameraDraws;
+	ShadowDrawList shadowDraws;			// The objects that never move
+	ShadowDrawList dynamicShadowDraws;	// and the ones that can
+	unsigned int staticVersion;			// scene.staticVersion, changes when the objects that never move change
+	// The spot lights with a tile in the shadow atlas this frame, and the casters of all of them, one tile after the other.
+	AtlasTile atlasTiles[MAX_ATLAS_LIGHTS];
+	int atlasTileCount;
+	ShadowDrawList atlasDraws;
+	CubeDrawList cubeDraws;				// The objects within reach of the light, when it has a cube shadow map
+	// Every light the camera can see, in view space, for the clustered lighting.
+	ClusterLight clusterLights[MAX_CLUSTER_LIGHTS];
+	int clusterLightCount;
+	ControlState controls;
+
+	// The lists have to be told which arena to use when they are made.
+	FrameSnapshot() : cameraDraws(ArenaAllocator<CameraDraw>(&arena)), shadowDraws(ArenaAllocator<ShadowDraw>(&arena)),
+		dynamicShadowDraws(ArenaAllocator<ShadowDraw>(&arena)), atlasTileCount(0), atlasDraws(ArenaAllocator<ShadowDraw>(&arena)),
+		cubeDraws(ArenaAllocator<CubeDraw>(&arena)), clusterLightCount(0) {}
+};
+
+// Passes the snapshots from the update thread to the render thread.
+TripleBuffer<FrameSnapshot> frames;
+
+// Set by the render thread, read by the update thread to show in the window title.
+struct RenderStats
+{
+	std::atomic<int> framesRendered;
+	std::atomic<int> callsIssued;
+	std::atomic<int> callsElided;
+	std::atomic<unsigned int> fastFragments;
+	std::atomic<unsigned int> sampledFragments;
+	std::atomic<int> castersDrawn;		// Objects drawn into the shadow map in the last frame
+	std::atomic<int> casters;			// out of this many the light can see
+	std::atomic<int> omniMicroseconds;	// GPU time of the cube or dual paraboloid shadow map
+	std::atomic<int> omniFaces;			// The faces (or halves) of it drawn, over all the objects
+}renderStats;
+
+std::thread renderThread;
+std::atomic<bool> stopRendering;
+
+// A struct to hold everything needed for the temporal accumulation of the shadow.
+// The scene is rendered into an offscreen framebuffer with two color attachments: the final color
+// and the shadow history (shadow value + view depth). There are two history textures, one is read
+// from while the other is written to, and they are swapped every frame.
+struct TemporalParams
+{
+	GLuint fbo[2];			// One FBO for each history texture that can be written to
+	GLuint colorTex;		// The final image. Copied to the window at the end of the pass.
+	GLuint depthBuffer;
+	GLuint historyTex[2];
+	int current;			// Index of the history texture being written this frame
+
+	unsigned int frameIndex;		// Used to rotate the sampling pattern every frame
+	unsigned int framesAccumulated;	// Number of frames blended into the history since the last reset
+	float minHistoryWeight;			// Lower limit on the weight of the new frame, so the shadow can still react to changes
+
+	void initBuffers()
+	{
+		current = 0;
+		frameIndex = 0;
+		framesAccumulated = 0;
+		minHistoryWeight = 0.1f;
+
+		glGenTextures(1, &colorTex);
+		glBindTexture(GL_TEXTURE_2D, colorTex);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, WindowSize, WindowSize);
+
+		glGenRenderbuffers(1, &depthBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, WindowSize, WindowSize);
+
+		glGenTextures(2, historyTex);
+		glGenFramebuffers(2, fbo);
+		for (int i = 0; i < 2; i++)
+		{
+			// The history needs the full float precision for the depth comparison.
+			glBindTexture(GL_TEXTURE_2D, historyTex[i]);
+			glTexStorage2D(GL_TEXTURE_2D, 1, GL_RG32F, WindowSize, WindowSize);
+			// Linear filtering lets us reproject to positions between pixels.
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, fbo[i]);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTex, 0);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, historyTex[i], 0);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+
+			GLenum drawbuf[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+			glDrawBuffers(2, drawbuf);
+
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+				std::cout << "Temporal frame buffer not created. \n" << glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		}
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	//Call this whenever the old shadow values are no longer valid (the light moved or the shadow type changed).
+	void reset()
+	{
+		framesAccumulated = 0;
+	}
+
+	//The weight of the new frame. 1/n gives an exact average of the first n frames, after that it becomes a moving average.
+	float historyWeight()
+	{
+		return std::max(1.0f / (framesAccumulated + 1.0f), minHistoryWeight);
+	}
+
+	//Binds the framebuffer that writes into the current history, and the previous history for reading.
+	void begin()
+	{
+		glState.bindFramebuffer(GL_FRAMEBUFFER, fbo[current]);
+		glState.bindTexture(2, GL_TEXTURE_2D, historyTex[1 - current]);
+	}
+
+	//Copies the image to the window and swaps the history textures.
+	void end()
+	{
+		glState.bindFramebuffer(GL_READ_FRAMEBUFFER, fbo[current]);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glState.bindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, WindowSize, WindowSize, 0, 0, WindowSize, WindowSize, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glState.bindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		current = 1 - current;
+		frameIndex++;
+		framesAccumulated++;
+	}
+
+}temporal;
+
 
 float jitter()
 {
 	return ((float)rand() / (float) RAND_MAX) - 0.5f;
 }
 
-//Function to build the offset texture
-GLuint buildOffsetTex(int size, int samplesU, int samplesV)
+//The name of the offset data in the asset pack. It depends on the size of the texture.
+std::string offsetTexAssetName(int size, int samplesU, int samplesV)
 {
+	return "offsetTex_" + std::to_string(size) + "x" + std::to_string(samplesU) + "x" + std::to_string(samplesV) + ".bin";
+}
 
+//Function to generate the random offsets stored in the offset texture
+void generateOffsetData(int size, int samplesU, int samplesV, std::vector<float>& buffer)
+{
 	int samples = samplesU * samplesV;
 	int bufSize = size * size * samples * 2;
-	float* data = new float[bufSize];
+	buffer.resize(bufSize);
+	float* data = &buffer[0];
 	int x1, x2, y1, y2;
 
 	for (int i = 0; i < size; i++)
@@ -210,6 +472,34 @@ GLuint buildOffsetTex(int size, int samplesU, int samplesV)
 			}
 		}
 	}
+}
+
+//Use the offsets from the asset pack if they are there, otherwise generate new ones.
+void loadOffsetData(int size, int samplesU, int samplesV, std::vector<float>& buffer)
+{
+	int samples = samplesU * samplesV;
+	size_t bufSize = size * size * samples * 2;
+
+	AssetView packed = assetPack.find(offsetTexAssetName(size, samplesU, samplesV));
+	if (packed.data != nullptr && packed.size == bufSize * sizeof(float))
+	{
+		const float* data = (const float*)packed.data;
+		buffer.assign(data, data + bufSize);
+	}
+	else
+	{
+		generateOffsetData(size, samplesU, samplesV, buffer);
+	}
+}
+
+//Function to build the offset texture
+GLuint buildOffsetTex(int size, int samplesU, int samplesV)
+{
+	int samples = samplesU * samplesV;
+
+	// Keep the data around, the CPU shadow filters read it as well.
+	loadOffsetData(size, samplesU, samplesV, offsetData);
+	const float* data = &offsetData[0];
 
 	glActiveTexture(GL_TEXTURE1);
 	GLuint texID;
@@ -221,30 +511,29 @@ GLuint buildOffsetTex(int size, int samplesU, int samplesV)
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
-	delete[] data;
-
 	return texID;
 }
 
-//This function sets up the geometry we will render. 
-void createGeometry()
+// The vertices of a sphere around the origin, with the given number of divisions in both directions.
+void buildSphereVertices(int divisions, float radius, std::vector<VertexFormat>& vertices)
 {
-	std::vector<VertexFormat> vertices;
+	vertices.clear();
+	// 6 vertices for every square of the grid. Reserved up front so the vector doesn't grow one copy at a time.
+	vertices.reserve(divisions * divisions * 6);
 
-	float radius = 0.5f;
 	float pitch, yaw;
 	yaw = 0.0f;
 	pitch = 0.0f;
 	int i, j;
-	float pitchDelta = 360 / DIVISIONS;
-	float yawDelta = 360 / DIVISIONS;
+	float pitchDelta = 360 / divisions;
+	float yawDelta = 360 / divisions;
 	glm::vec4 color(0.3f, 0.2f, 0.7f, 2.0f);
 
 	VertexFormat p1, p2, p3, p4;
 
-	for (i = 0; i < DIVISIONS; i++)
+	for (i = 0; i < divisions; i++)
 	{
-		for (j = 0; j < DIVISIONS; j++)
+		for (j = 0; j < divisions; j++)
 		{
 			p1.position.x = radius * sin((pitch)* PI / 180.0) * cos((yaw)* PI / 180.0);
 			p1.position.y = radius * sin((pitch)* PI / 180.0) * sin((yaw)* PI / 180.0);;
@@ -283,14 +572,51 @@ void createGeometry()
 
 		pitch += pitchDelta;
 	}
+}
 
-	sphere1.base.initBuffer(vertices.size(), &vertices[0]);
-	sphere2.base.initBuffer(vertices.size(), &vertices[0]);
+//This function builds the geometry we will render, on the CPU side only.
+void buildGeometry()
+{
+	float radius = 0.5f;
+	buildSphereVertices(DIVISIONS, radius, sphere1.base.vertices);
+
+	// Both spheres have the same shape.
+	sphere2.base.vertices = sphere1.base.vertices;
+
+	// The coarser levels, which both spheres share.
+	sphere1LODs.count = SPHERE_LODS;
+	sphere1LODs.levels[0] = &sphere1.base;
+	sphere1LODs.segments[0] = sphereDivisions[0];
+	for (int l = 1; l < SPHERE_LODS; l++)
+	{
+		buildSphereVertices(sphereDivisions[l], radius, coarseSphere[l - 1].vertices);
+		sphere1LODs.levels[l] = &coarseSphere[l - 1];
+		sphere1LODs.segments[l] = sphereDivisions[l];
+	}
+	sphere2LODs = sphere1LODs;
+	sphere2LODs.levels[0] = &sphere2.base;
 
 	sphere1.origin = glm::vec3(0.0f);
 	sphere2.origin = glm::vec3(-1.0f, 0.0f, -2.0f);
 	sphere1.radius = radius;
 	sphere2.radius = radius;
+
+	plane.buildVertices();
+
+	scene.init();
+	movingObject = scene.add(&sphere1.base, sphere1.origin, true, &sphere1LODs);
+	scene.add(&sphere2.base, sphere2.origin, false, &sphere2LODs);
+	scene.add(&plane.base, plane.origin);
+}
+
+//This function sends the geometry to the GPU.
+void createGeometry()
+{
+	sphere1.base.initBuffer(sphere1.base.vertices.size(), &sphere1.base.vertices[0]);
+	sphere2.base.initBuffer(sphere2.base.vertices.size(), &sphere2.base.vertices[0]);
+	for (int l = 0; l < SPHERE_LODS - 1; l++)
+		coarseSphere[l].initBuffer(coarseSphere[l].vertices.size(), &coarseSphere[l].vertices[0]);
+	plane.initBuffer();
 }
 
 void setFrameBUffer()
@@ -337,103 +663,1122 @@ void setFrameBUffer()
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+// Sets up the camera. The matrices of the objects are computed every frame, by the scene. No OpenGL here.
+void initCamera()
+{
+	glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 1.0f, 3.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 proj = glm::perspective(45.0f, 800.0f / 800.0f, 0.1f, 100.0f);
+
+	PV = proj * view;
+	prevPV = PV;
+	cameraView = view;
+}
+
+
+// Copies the current state of the scene into a snapshot. The transforms, the culling and the draw lists
+// are done here, spread over the thread pool.
+void captureFrame(FrameSnapshot& frame)
+{
+	// Nobody reads this snapshot any more, so everything the last frame put in its arena can go.
+	forgetArenaMemory(frame.cameraDraws);
+	forgetArenaMemory(frame.shadowDraws);
+	forgetArenaMemory(frame.dynamicShadowDraws);
+	forgetArenaMemory(frame.atlasDraws);
+	forgetArenaMemory(frame.cubeDraws);
+	frame.arena.reset();
+
+	frame.light = light;
+	frame.PV = PV;
+	frame.view = cameraView;
+	frame.controls = controls;
+	frame.staticVersion = scene.staticVersion;
+	scene.useBVH = !controls.flatCulling;
+
+	// Both from the [1][1] of the projection and half the height of the target, the window and the shadow map.
+	float focal = (PV * glm::inverse(cameraView))[1][1];
+	scene.setLODScales(fabsf(focal) * WindowSize * 0.5f, fabsf(light.Projection[1][1]) * TextureSize * 0.5f);
+	scene.update(cameraView, PV, light.Projection * light.View, light.S);
+	scene.buildDrawLists(frame.cameraDraws, frame.shadowDraws, frame.dynamicShadowDraws);
+	// A cube face sees 90 degrees, so its [1][1] is 1. A paraboloid half squeezes a whole hemisphere into its map,
+	// which near the middle is half as many texels per unit.
+	if (controls.omniShadows == 1)
+		scene.cullPointLight(light.position, CUBE_FAR, Scene::cubeFaces, CUBE_SHADOW_SIZE * 0.5f, frame.cubeDraws);
+	else if (controls.omniShadows == 2)
+		scene.cullPointLight(light.position, CUBE_FAR, Scene::paraboloidHalves, PARABOLOID_SIZE * 0.25f, frame.cubeDraws);
+
+	// The tiles of the spot lights, sized by how much of the screen they cover, and the casters of each one.
+	Frustum camera;
+	camera.fromMatrix(PV);
+	frame.atlasTileCount = shadowAtlas.allocate(cameraView, camera, focal, WindowSize, shadowBudget, frame.atlasTiles);
+	for (int t = 0; t < frame.atlasTileCount; t++)
+	{
+		AtlasTile& tile = frame.atlasTiles[t];
+		tile.firstDraw = (int)frame.atlasDraws.size();
+		const AtlasLight& spot = shadowAtlas.lights[tile.light];
+		scene.cullFrustum(tile.PV, tile.size * 0.5f / tanf(spot.fov * 0.5f), frame.atlasDraws);
+		tile.drawCount = (int)frame.atlasDraws.size() - tile.firstDraw;
+	}
+
+	// All the lights the camera can see go to the clusters, the spot lights first so they are the last to be dropped.
+	int lightCount = 0;
+	for (unsigned int i = 0; i < shadowAtlas.lights.size() && lightCount < MAX_CLUSTER_LIGHTS; i++)
+	{
+		const AtlasLight& spot = shadowAtlas.lights[i];
+		glm::vec3 center;
+		float radius;
+		ShadowAtlas::bounds(spot, center, radius);
+		if (!camera.containsSphere(center, radius))
+			continue;
+		int tile = shadowAtlas.usable ? shadowAtlas.tileOfLight[i] : -1;
+		ClusteredLights::spotLight(spot.position, spot.target, spot.color, spot.range, spot.fov, tile, cameraView,
+			frame.clusterLights[lightCount++]);
+	}
+	for (unsigned int i = 0; i < clusteredLights.pointLights.size() && lightCount < MAX_CLUSTER_LIGHTS; i++)
+	{
+		const PointLightSource& point = clusteredLights.pointLights[i];
+		if (camera.containsSphere(point.position, point.range))
+			ClusteredLights::pointLight(point, cameraView, frame.clusterLights[lightCount++]);
+	}
+	frame.clusterLightCount = lightCount;
+}
+
+// Puts count spot lights in a ring around the middle of the scene, all pointing at the middle, each in its own color.
+void addRingLights(int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		float angle = 2.0f * (float)PI * i / count;
+		AtlasLight spot;
+		spot.position = glm::vec3(6.0f * cosf(angle), 5.0f, 6.0f * sinf(angle));
+		spot.target = glm::vec3(0.0f);
+		spot.color = 0.6f * glm::vec3(0.5f + 0.5f * cosf(angle), 0.5f + 0.5f * cosf(angle - 2.094f), 0.5f + 0.5f * cosf(angle + 2.094f));
+		spot.range = 20.0f;
+		spot.fov = 0.8f;
+		shadowAtlas.lights.push_back(spot);
+	}
+}
+
+// Scatters count small point lights over the ground, each in its own color. A hash picks the places,
+// so the same count always gives the same lights.
+void addScatteredLights(int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		PointLightSource point;
+		float u = ShadowRayTracer::hashToUnit(i * 3 + 1);
+		float v = ShadowRayTracer::hashToUnit(i * 3 + 2);
+		float w = ShadowRayTracer::hashToUnit(i * 3 + 3);
+		point.position = glm::vec3(u * 20.0f - 10.0f, 0.5f + w, v * 20.0f - 10.0f);
+		point.color = 0.5f * glm::vec3(0.5f + 0.5f * cosf(6.283f * w), 0.5f + 0.5f * cosf(6.283f * w - 2.094f), 0.5f + 0.5f * cosf(6.283f * w + 2.094f));
+		point.range = 3.0f;
+		clusteredLights.pointLights.push_back(point);
+	}
+}
+
 void setup()
 {
+	// The shaders were submitted in init(), and the driver compiles them while we build everything else.
+	double startTime = glfwGetTime();
+
 	setFrameBUffer();
 
+	depthPyramid.init(TextureSize, TextureSize);
+	staticShadowCache.init(TextureSize, TextureSize);
+	shadowAtlas.init();
+	cubeShadow.init();
+	paraboloidShadow.init();
+	clusteredLights.init();
+	omniTimer.init();
+	// Enough for a few hundred objects. It grows if a frame needs more.
+	frameRing.init(64 * 1024);
+	frameCapture.init(WindowSize, WindowSize, (int)TextureSize, (int)TextureSize);
+
+	buildGeometry();
+
 	createGeometry();
 
-	plane.initBuffer();
+	// A scene file replaces the objects of the built-in scene. The spheres and the plane are still made,
+	// the ray traced comparison uses them.
+	if (!sceneFileName.empty() && sceneFile.load(sceneFileName.c_str()))
+	{
+		sceneFile.upload();
+		movingObject = -1;
+	}
 	
-	glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 1.0f, 3.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-	glm::mat4 proj = glm::perspective(45.0f, 800.0f / 800.0f, 0.1f, 100.0f);
+	initCamera();
 
-	PV = proj * view;
+	light.initMatrices();
+	if (!sceneFile.lights.empty())
+	{
+		const SceneFileLight& first = sceneFile.lights[0];
+		light.position = glm::vec3(first.position[0], first.position[1], first.position[2]);
+		light.Intensity = glm::vec3(first.intensity[0], first.intensity[1], first.intensity[2]);
+		light.recaliberate();
+	}
 
-	sphere1.MVP = PV * glm::translate(glm::mat4(1), sphere1.origin);
-	sphere1.ModelView = view * glm::translate(glm::mat4(1), sphere1.origin);
-	sphere1.NormalMatrix = glm::transpose(glm::inverse( glm::mat3(sphere1.ModelView)));
+	// The other lights of the scene file shine straight down, with their shadows in the atlas.
+	for (unsigned int i = 1; i < sceneFile.lights.size(); i++)
+	{
+		const SceneFileLight& source = sceneFile.lights[i];
+		AtlasLight spot;
+		spot.position = glm::vec3(source.position[0], source.position[1], source.position[2]);
+		spot.target = glm::vec3(spot.position.x, 0.0f, spot.position.z);
+		spot.color = glm::vec3(source.intensity[0], source.intensity[1], source.intensity[2]);
+		spot.range = std::max(2.0f * spot.position.y, 10.0f);
+		spot.fov = 1.2f;
+		shadowAtlas.lights.push_back(spot);
+	}
+	addRingLights(ringLights);
+	addScatteredLights(scatteredLights);
 
-	sphere2.MVP = PV * glm::translate(glm::mat4(1), sphere2.origin);
-	sphere2.ModelView = view * glm::translate(glm::mat4(1), sphere2.origin);
-	sphere2.NormalMatrix = glm::transpose(glm::inverse(glm::mat3(sphere2.ModelView)));
+	offsetTex = buildOffsetTex(OFFSET_TEX_SIZE, OFFSET_SAMPLES_U, OFFSET_SAMPLES_V);
+	offsetTexSize = glm::vec3(OFFSET_TEX_SIZE, OFFSET_SAMPLES_U, OFFSET_SAMPLES_V);
 
-	plane.MVP = PV * glm::translate(glm::mat4(1), plane.origin);
-	plane.ModelView = view * glm::translate(glm::mat4(1), plane.origin);
-	plane.NormalMatrix = glm::transpose(glm::inverse(glm::mat3(plane.ModelView)));
+	temporal.initBuffers();
 
-	light.initMatrices();
+	// Everything else is ready, now we need the shaders.
+	std::cout << "Shaders " << (pendingProgramsReady() ? "were" : "were not") << " done before the rest of setup."
+		<< (parallelShaderCompile ? " (parallel compile)\n" : "\n");
+	finishPrograms();
+	std::cout << "Setup took " << (glfwGetTime() - startTime) * 1000.0 << "ms\n";
 
-	uniforms.initUniforms(renderProgram);
+	if (spirvShaders)
+		uniforms.initSpirvUniforms();
+	else
+		uniforms.initUniforms(renderProgram);
 
-	offsetTex = buildOffsetTex(16, 4, 8);
-	offsetTexSize = glm::vec3(16, 4, 8);
+	// Setup bound all sorts of things without going through the state cache.
+	glState.invalidate();
 
 	shadowType = uniforms.sub_func_basicShadow;
+	controls.usePyramid = true;
+	controls.cacheStaticShadows = true;
+	frames.init();
 }
 
 // Functions called between every frame. game logic
 #pragma region util_functions
 
-// This runs once every physics timestep.
+// This runs once every physics timestep, on the update thread.
+// Moves the dynamic sphere if "m" is on, and hands the current state to the render thread.
 void update()
 {
+	if (controls.animate && movingObject >= 0)
+	{
+		animationTime += 1.0f / UpdateRate;
+		scene.move(movingObject, sphere1.origin + glm::vec3(0.0f, 0.75f * (1.0f - cosf(animationTime * 2.0f)), 0.0f));
+		// The temporal filter expects the shadows to stay where they are.
+		controls.historyResets++;
+	}
+
+	captureFrame(frames.writeBuffer());
+	frames.publish();
 }
 
-void firstDrawPass()
+// Draws shadow casters into the framebuffer that is bound.
+void drawShadowCasters(const ShadowDraw* draws, int count)
 {
-	glUseProgram(program);
+	// The MVPs were computed by the update thread, we only copy them into the ring. That is too little work
+	// to hand to the thread pool, which would make us wait whenever the update thread is using it.
+	GLsizeiptr stride = frameRing.aligned(sizeof(ShadowObjectUniforms));
+	GLintptr offset;
+	char* data = frameRing.allocate(stride * count, offset);
+	for (int i = 0; i < count; i++)
+		((ShadowObjectUniforms*)(data + stride * i))->MVP = draws[i].MVP;
+	frameRing.flush(offset, stride * count);
+
+	for (int i = 0; i < count; i++)
+	{
+		const stuff_for_drawing* mesh = scene.meshOf(draws[i].object, draws[i].lod);
+		glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BLOCK_BINDING, frameRing.buffer, offset + stride * i, sizeof(ShadowObjectUniforms));
+		glState.bindVertexArray(mesh->vao);
+		glDrawArrays(GL_TRIANGLES, 0, mesh->numberOfVertices);
+	}
+}
+
+void drawShadowCasters(const ShadowDrawList& draws)
+{
+	if (!draws.empty())
+		drawShadowCasters(&draws[0], (int)draws.size());
+}
+
+// Draws the casters around the light into the layered framebuffer that is bound, with its program.
+// The block of the whole pass goes first, then the model matrix and faces of every object. The geometry shader does the rest.
+void drawLayeredShadow(const FrameSnapshot& frame, const void* block, GLsizeiptr blockSize, GLuint blockBinding)
+{
+	int count = (int)frame.cubeDraws.size();
+	GLsizeiptr headerSize = frameRing.aligned(blockSize);
+	GLsizeiptr stride = frameRing.aligned(sizeof(CubeObjectUniforms));
+	GLintptr offset;
+	char* data = frameRing.allocate(headerSize + stride * count, offset);
+	memcpy(data, block, blockSize);
+	for (int i = 0; i < count; i++)
+	{
+		CubeObjectUniforms* object = (CubeObjectUniforms*)(data + headerSize + stride * i);
+		object->Model = frame.cubeDraws[i].Model;
+		object->FaceMask = (int)frame.cubeDraws[i].faces;
+	}
+	frameRing.flush(offset, headerSize + stride * count);
+
+	glBindBufferRange(GL_UNIFORM_BUFFER, blockBinding, frameRing.buffer, offset, blockSize);
+	for (int i = 0; i < count; i++)
+	{
+		const stuff_for_drawing* mesh = scene.meshOf(frame.cubeDraws[i].object, frame.cubeDraws[i].lod);
+		glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BLOCK_BINDING, frameRing.buffer, offset + headerSize + stride * i, sizeof(CubeObjectUniforms));
+		glState.bindVertexArray(mesh->vao);
+		glDrawArrays(GL_TRIANGLES, 0, mesh->numberOfVertices);
+	}
+}
+
+// Draws the casters around the light into the cube shadow map. Normally all six faces in one layered pass,
+// with "i" one pass per face, the way it would be done without the geometry shader.
+void drawCubeShadow(const FrameSnapshot& frame)
+{
+	int count = (int)frame.cubeDraws.size();
+	const CubeDraw* draws = count > 0 ? &frame.cubeDraws[0] : nullptr;
+	glm::mat4 facePV[6];
+	CubeShadowMap::faceMatrices(frame.light.position, facePV);
+
+	glViewport(0, 0, CUBE_SHADOW_SIZE, CUBE_SHADOW_SIZE);
+	omniTimer.begin(frame.controls.cubeSixPasses ? OMNI_CUBE_SIX_PASSES : OMNI_CUBE_SINGLE_PASS);
+	if (!frame.controls.cubeSixPasses)
+	{
+		glState.useProgram(cubeShadow.layeredProgram);
+		glState.bindFramebuffer(GL_FRAMEBUFFER, cubeShadow.layeredFbo);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		drawLayeredShadow(frame, facePV, sizeof(facePV), CUBE_BLOCK_BINDING);
+	}
+	else
+	{
+		// Each face is a pass of its own, like the light's shadow map, with the objects that are in it.
+		GLsizeiptr stride = frameRing.aligned(sizeof(ShadowObjectUniforms));
+		for (int f = 0; f < 6; f++)
+		{
+			GLintptr offset;
+			char* data = frameRing.allocate(stride * count, offset);
+			int faceCount = 0;
+			for (int i = 0; i < count; i++)
+			{
+				if (draws[i].faces & (1u << f))
+					((ShadowObjectUniforms*)(data + stride * faceCount++))->MVP = facePV[f] * draws[i].Model;
+			}
+			frameRing.flush(offset, stride * faceCount);
+
+			glState.useProgram(program);
+			glState.bindFramebuffer(GL_FRAMEBUFFER, cubeShadow.faceFbos[f]);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			int slot = 0;
+			for (int i = 0; i < count; i++)
+			{
+				if ((draws[i].faces & (1u << f)) == 0)
+					continue;
+				const stuff_for_drawing* mesh = scene.meshOf(draws[i].object, draws[i].lod);
+				glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BLOCK_BINDING, frameRing.buffer, offset + stride * slot++, sizeof(ShadowObjectUniforms));
+				glState.bindVertexArray(mesh->vao);
+				glDrawArrays(GL_TRIANGLES, 0, mesh->numberOfVertices);
+			}
+		}
+	}
+	omniTimer.end();
+
+	// The passes after this one expect the program of the light's shadow map.
+	glState.useProgram(program);
+}
+
+// Draws the casters around the light into both halves of the dual paraboloid shadow map, in one layered pass.
+void drawParaboloidShadow(const FrameSnapshot& frame)
+{
+	ParaboloidUniforms block;
+	block.LightPosition = glm::vec4(frame.light.position, 1.0f);
+	block.Depth = ParaboloidShadowMap::depthParams();
+
+	glViewport(0, 0, PARABOLOID_SIZE, PARABOLOID_SIZE);
+	omniTimer.begin(OMNI_PARABOLOID);
+	glState.useProgram(paraboloidShadow.program);
+	glState.bindFramebuffer(GL_FRAMEBUFFER, paraboloidShadow.fbo);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	// Cuts the triangles at the edge of each half.
+	glEnable(GL_CLIP_DISTANCE0);
+	drawLayeredShadow(frame, &block, sizeof(block), PARABOLOID_BLOCK_BINDING);
+	glDisable(GL_CLIP_DISTANCE0);
+	omniTimer.end();
+
+	glState.useProgram(program);
+}
+
+// Where the light's shadow comes from this frame: 0 its own shadow map, 1 the cube shadow map, 2 the dual paraboloid one.
+int omniShadowMode(const ControlState& state)
+{
+	if (state.omniShadows == 1 && cubeShadow.ready())
+		return 1;
+	if (state.omniShadows == 2 && paraboloidShadow.ready())
+		return 2;
+	return 0;
+}
+
+void firstDrawPass(const FrameSnapshot& frame)
+{
+	glState.useProgram(program);
 
 	// GL_Polygonoffset displaces the depth value by an offest which is computed using the values we give as parameters.
 	// the first parameter is multiplied by the depth slope and the second parameter is multiplied by "r" which is the smallest value to imply a change in depth.
 	// Commenting out the two lines below would produce "shadow acne".
 	glEnable(GL_POLYGON_OFFSET_FILL);
-	glPolygonOffset(10.0f, 15.0f);
+	glPolygonOffset(PolygonOffsetFactor, PolygonOffsetUnits);
 	
 	//Render from the perspective of the camera
-	glBindFramebuffer(GL_FRAMEBUFFER, fboHandle);
-	glClear(GL_DEPTH_BUFFER_BIT);
 	//glClearDepth(0.5f);
 	glViewport(0, 0, WindowSize, WindowSize);
 	{
 		glCullFace(GL_FRONT);
-		glm::mat4 MVP;
-		glm::mat4 PV = light.Projection * light.View;
 
-		//Plane
-		MVP = PV * (glm::translate(glm::mat4(1), plane.origin));
-		glUniformMatrix4fv(uniMVP, 1, GL_FALSE, glm::value_ptr(MVP));
-		glBindVertexArray(plane.base.vao);
-		glBindBuffer(GL_ARRAY_BUFFER, plane.base.vbo);
-		glDrawArrays(GL_TRIANGLES, 0, plane.numberOfVertices);
+		// With the shadows all around the light, its own shadow map isn't read, so it isn't drawn either.
+		int omni = omniShadowMode(frame.controls);
+		if (omni != 0)
+		{
+			if (omni == 1)
+				drawCubeShadow(frame);
+			else
+				drawParaboloidShadow(frame);
 
-		//Sphere1
-		MVP = PV * (glm::translate(glm::mat4(1), sphere1.origin));
-		glUniformMatrix4fv(uniMVP, 1, GL_FALSE, glm::value_ptr(MVP));
-		glBindVertexArray(sphere1.base.vao);
-		glBindBuffer(GL_ARRAY_BUFFER, sphere1.base.vbo);
-		glDrawArrays(GL_TRIANGLES, 0, sphere1.base.numberOfVertices);
+			int faces = 0;
+			for (unsigned int i = 0; i < frame.cubeDraws.size(); i++)
+			{
+				for (unsigned int f = frame.cubeDraws[i].faces; f != 0; f &= f - 1)
+					faces++;
+			}
+			renderStats.omniFaces = faces;
+			renderStats.omniMicroseconds = (int)(omniTimer.lastMilliseconds * 1000.0);
+			renderStats.castersDrawn = (int)frame.cubeDraws.size();
+			renderStats.casters = (int)frame.cubeDraws.size();
+		}
+		else
+		{
+			int drawn = (int)frame.dynamicShadowDraws.size();
+			if (frame.controls.cacheStaticShadows && staticShadowCache.usable)
+			{
+				// The objects that never move only have to be drawn again when the light has moved.
+				if (staticShadowCache.stale(frame.light.S, frame.staticVersion))
+				{
+					staticShadowCache.begin();
+					drawShadowCasters(frame.shadowDraws);
+					staticShadowCache.end(frame.light.S, frame.staticVersion);
+					drawn += (int)frame.shadowDraws.size();
+				}
+				staticShadowCache.copyTo(depthTex, fboHandle);
+				glState.bindFramebuffer(GL_FRAMEBUFFER, fboHandle);
+			}
+			else
+			{
+				glState.bindFramebuffer(GL_FRAMEBUFFER, fboHandle);
+				glClear(GL_DEPTH_BUFFER_BIT);
+				drawShadowCasters(frame.shadowDraws);
+				drawn += (int)frame.shadowDraws.size();
+			}
 
-		//Sphere2
-		MVP = PV * (glm::translate(glm::mat4(1), sphere2.origin));
-		glUniformMatrix4fv(uniMVP, 1, GL_FALSE, glm::value_ptr(MVP));
-		glBindVertexArray(sphere2.base.vao);
-		glBindBuffer(GL_ARRAY_BUFFER, sphere2.base.vbo);
-		glDrawArrays(GL_TRIANGLES, 0, sphere2.base.numberOfVertices);
+			// The objects that can move, on top of the others.
+			drawShadowCasters(frame.dynamicShadowDraws);
 
+			renderStats.castersDrawn = drawn;
+			renderStats.casters = (int)(frame.shadowDraws.size() + frame.dynamicShadowDraws.size());
+		}
+
+		// The spot lights, each into its own tile of the atlas.
+		if (frame.atlasTileCount > 0 && shadowAtlas.usable)
+		{
+			glState.bindFramebuffer(GL_FRAMEBUFFER, shadowAtlas.fbo);
+			glViewport(0, 0, ATLAS_SIZE, ATLAS_SIZE);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			for (int t = 0; t < frame.atlasTileCount; t++)
+			{
+				const AtlasTile& tile = frame.atlasTiles[t];
+				glViewport(tile.x, tile.y, tile.size, tile.size);
+				if (tile.drawCount > 0)
+					drawShadowCasters(&frame.atlasDraws[tile.firstDraw], tile.drawCount);
+			}
+		}
 	}
 
 	glDisable(GL_POLYGON_OFFSET_FILL);
 }
 
-void secondDrawPass()
+// The same draw calls as firstDrawPass(), but for the CPU rasterizer.
+void gatherShadowCasters(std::vector<RasterMesh>& meshes, const FrameSnapshot& frame)
+{
+	const ShadowDrawList* lists[] = { &frame.shadowDraws, &frame.dynamicShadowDraws };
+	for (int l = 0; l < 2; l++)
+	{
+		for (unsigned int i = 0; i < lists[l]->size(); i++)
+		{
+			const ShadowDraw& draw = (*lists[l])[i];
+			// The CPU renderer is the reference, so it always uses the finest level of the mesh.
+			const stuff_for_drawing* source = scene.objects[draw.object].mesh;
+			RasterMesh mesh;
+			mesh.vertices = &source->vertices[0];
+			mesh.numberOfVertices = source->vertices.size();
+			mesh.MVP = draw.MVP;
+			meshes.push_back(mesh);
+		}
+	}
+}
+
+// Renders the shadow map on the CPU a number of times and prints how fast it was.
+void benchmarkCPUShadowMap(const FrameSnapshot& frame)
 {
+	std::vector<RasterMesh> meshes;
+	gatherShadowCasters(meshes, frame);
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	cpuRasterizer.init((int)TextureSize, (int)TextureSize);
+	cpuRasterizer.offsetFactor = PolygonOffsetFactor;
+	cpuRasterizer.offsetUnits = PolygonOffsetUnits;
+
+	// The first run allocates the bins, so it is not counted.
+	cpuRasterizer.render(meshes);
+
+	const int runs = 20;
+	double total = 0.0, best = 1e9;
+	for (int i = 0; i < runs; i++)
+	{
+		cpuRasterizer.render(meshes);
+		total += cpuRasterizer.stats.seconds;
+		best = std::min(best, cpuRasterizer.stats.seconds);
+	}
+
+	CPURasterizer::Stats& stats = cpuRasterizer.stats;
+	std::cout << "CPU shadow map (" << threadPool.size() << " threads): " << stats.triangles << " triangles, "
+		<< stats.trianglesDrawn << " after clipping and culling, " << stats.pixelsCovered << " pixels covered, "
+		<< stats.pixelsWritten << " written\n";
+	std::cout << "  " << total / runs * 1000.0 << "ms average, " << best * 1000.0 << "ms best, "
+		<< stats.triangles / best / 1e6 << " million triangles/s, " << stats.pixelsCovered / best / 1e6 << " million pixels/s\n";
+}
+
+// Compares the CPU shadow map with depthTex. Needs the GL context.
+void compareCPUShadowMap(const FrameSnapshot& frame)
+{
+	benchmarkCPUShadowMap(frame);
+
+	// Draw the first pass again so depthTex is from the same light position as the CPU version.
+	firstDrawPass(frame);
+
+	std::vector<float> gpuDepth((int)TextureSize * (int)TextureSize);
+	glState.bindTexture(0, GL_TEXTURE_2D, depthTex);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, &gpuDepth[0]);
+
+	// Pixels along the edges of the triangles can go either way, and the polygon offset is a little different
+	// on every driver, so we count how many pixels are close instead of expecting an exact match.
+	const float tolerance = 1e-4f;
+	int mismatched = 0;
+	double totalError = 0.0;
+	float maxError = 0.0f;
+	for (int y = 0; y < (int)TextureSize; y++)
+	{
+		for (int x = 0; x < (int)TextureSize; x++)
+		{
+			float error = fabs(cpuRasterizer.at(x, y) - gpuDepth[y * (int)TextureSize + x]);
+			totalError += error;
+			maxError = std::max(maxError, error);
+			if (error > tolerance)
+				mismatched++;
+		}
+	}
+
+	std::cout << "  Compared with the GPU: " << mismatched << " of " << gpuDepth.size() << " pixels differ by more than "
+		<< tolerance << " (" << 100.0 * mismatched / gpuDepth.size() << "%), average error " << totalError / gpuDepth.size()
+		<< ", largest " << maxError << "\n";
+}
+
+// Times the CPU versions of the shadow filters on a grid of points on the plane, in the shadow map from the CPU rasterizer.
+// A tap is one textureProj, so one for the basic shadow, 4 for PCF and samplesDiv2 * 2 for random sampling.
+void benchmarkShadowFilters(const FrameSnapshot& frame)
+{
+	benchmarkCPUShadowMap(frame);
+	ShadowDepthImage image = { &cpuRasterizer.depth[0], cpuRasterizer.width, cpuRasterizer.height, cpuRasterizer.stride };
+
+	RandomSamplingParams params = { &offsetData[0], (int)offsetTexSize.x, (int)offsetTexSize.z, 0.004f };
+
+	// The points are spread over the part of the plane around the spheres, so we get lit, shadowed and penumbra fragments.
+	const int gridSize = 1024;
+	ShadowQueries queries;
+	queries.resize(gridSize * gridSize);
+	glm::mat4 shadowMat = frame.light.S * glm::translate(glm::mat4(1), plane.origin);
+	for (int y = 0; y < gridSize; y++)
+	{
+		for (int x = 0; x < gridSize; x++)
+		{
+			glm::vec3 position(-3.0f + 6.0f * x / gridSize, 0.0f, -4.0f + 6.0f * y / gridSize);
+			queries.set(y * gridSize + x, shadowMat * glm::vec4(position, 1.0f), x, y);
+		}
+	}
+
+	std::vector<float> results(queries.size());
+	std::vector<float> reference(queries.size());
+	const int batch = 4096;
+	int batches = (queries.size() + batch - 1) / batch;
+
+	const char* names[3] = { "basic", "PCF", "random sampling" };
+	int taps[3] = { 1, 4, params.samplesDiv2 * 2 };
+	for (int filter = 0; filter < 3; filter++)
+	{
+		auto run = [&](int first, int count, float* out)
+		{
+			if (filter == 0)
+				basicShadowCPU(image, queries, first, count, out);
+			else if (filter == 1)
+				PCFshadowCPU(image, queries, first, count, out);
+			else
+				randomSamplingShadowCPU(image, params, queries, first, count, out);
+		};
+
+		auto startTime = std::chrono::high_resolution_clock::now();
+		run(0, queries.size(), &results[0]);
+		double single = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+
+		startTime = std::chrono::high_resolution_clock::now();
+		threadPool.parallelFor(batches, [&](int b)
+		{
+			run(b * batch, std::min(batch, queries.size() - b * batch), &results[0]);
+		});
+		double threaded = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+
+		// Check the fast version against the one written like the shader.
+		startTime = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < queries.size(); i++)
+		{
+			glm::vec4 coord(queries.x[i], queries.y[i], queries.z[i], queries.w[i]);
+			if (filter == 0)
+				reference[i] = basicShadowReference(image, coord);
+			else if (filter == 1)
+				reference[i] = PCFshadowReference(image, coord);
+			else
+				reference[i] = randomSamplingShadowReference(image, params, coord, queries.pixelX[i], queries.pixelY[i]);
+		}
+		double scalar = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+
+		float maxError = 0.0f;
+		for (int i = 0; i < queries.size(); i++)
+			maxError = std::max(maxError, (float)fabs(results[i] - reference[i]));
+
+		double totalTaps = (double)queries.size() * taps[filter];
+		std::cout << names[filter] << ": " << totalTaps / scalar / 1e6 << " million taps/s reference, "
+			<< totalTaps / single / 1e6 << " SIMD, " << totalTaps / threaded / 1e6 << " SIMD on " << threadPool.size()
+			<< " threads. Largest difference from the reference: " << maxError << "\n";
+	}
+}
+
+// The same draw calls as secondDrawPass(), for the CPU renderer.
+void gatherCameraDrawCalls(std::vector<CPUDrawCall>& drawCalls, const FrameSnapshot& frame)
+{
+	for (unsigned int i = 0; i < frame.cameraDraws.size(); i++)
+	{
+		const CameraDraw& source = frame.cameraDraws[i];
+		// Always the finest level, like gatherShadowCasters().
+		const stuff_for_drawing* mesh = scene.objects[source.object].mesh;
+		CPUDrawCall draw;
+		draw.vertices = &mesh->vertices[0];
+		draw.numberOfVertices = mesh->vertices.size();
+		draw.MVP = source.MVP;
+		draw.ModelView = source.ModelView;
+		draw.NormalMatrix = source.NormalMatrix;
+		draw.ShadowMatrix = source.ShadowMatrix;
+		drawCalls.push_back(draw);
+	}
+}
+
+// Renders a whole frame on the CPU, both passes.
+// filter is 0 for basic, 1 for PCF and 2 for random sampling, which takes samplesDiv2 * 2 samples.
+void renderFrameOnCPU(const FrameSnapshot& frame, int filter, int samplesDiv2)
+{
+	// First pass: the shadow map
+	std::vector<RasterMesh> casters;
+	gatherShadowCasters(casters, frame);
+	cpuRasterizer.init((int)TextureSize, (int)TextureSize);
+	cpuRasterizer.offsetFactor = PolygonOffsetFactor;
+	cpuRasterizer.offsetUnits = PolygonOffsetUnits;
+	cpuRasterizer.render(casters);
+
+	// Second pass: the scene from the camera
+	std::vector<CPUDrawCall> drawCalls;
+	gatherCameraDrawCalls(drawCalls, frame);
+	cpuRenderer.init(WindowSize, WindowSize);
+	cpuRenderer.filter = filter;
+	cpuRenderer.lightPosition = frame.light.position;
+	cpuRenderer.lightIntensity = frame.light.Intensity;
+	ShadowDepthImage shadowMap = { &cpuRasterizer.depth[0], cpuRasterizer.width, cpuRasterizer.height, cpuRasterizer.stride };
+	cpuRenderer.shadowMap = shadowMap;
+	RandomSamplingParams randomSampling = { &offsetData[0], (int)offsetTexSize.x, samplesDiv2, 0.004f };
+	cpuRenderer.randomSampling = randomSampling;
+	cpuRenderer.render(drawCalls);
+}
+
+// Renders a frame on the CPU and writes it to a PPM file.
+void saveFrameOnCPU(const FrameSnapshot& frame, int filter, const char* fileName)
+{
+	renderFrameOnCPU(frame, filter, (int)offsetTexSize.z);
+
+	std::cout << "CPU frame (" << threadPool.size() << " threads): shadow map " << cpuRasterizer.stats.seconds * 1000.0
+		<< "ms, camera pass " << cpuRenderer.seconds * 1000.0 << "ms, " << cpuRenderer.pixelsShaded << " pixels shaded\n";
+
+	if (cpuRenderer.writePPM(fileName))
+		std::cout << "Saved " << fileName << "\n";
+}
+
+// Ray traces the real soft shadow of a disk light, then renders the frame with every technique on the CPU,
+// and shows how far each one is from the real thing against how long the CPU renderer took for it.
+// The time is CPU time, which only says how the techniques compare, not how fast they are on the GPU.
+// The results go to shadow_quality.csv as well, for plotting elsewhere.
+void compareShadowQuality(const FrameSnapshot& frame, float lightRadius, int lightSamples)
+{
+	rayTracer.init(WindowSize, WindowSize);
+	RaySphere sphere = { sphere1.origin, sphere1.radius };
+	rayTracer.spheres.push_back(sphere);
+	sphere.center = sphere2.origin;
+	sphere.radius = sphere2.radius;
+	rayTracer.spheres.push_back(sphere);
+	rayTracer.planeHeight = plane.origin.y;
+	rayTracer.planeExtent = 10.0f;
+	rayTracer.inversePV = glm::inverse(frame.PV);
+	rayTracer.lightPosition = frame.light.position;
+	rayTracer.lightRadius = lightRadius;
+	rayTracer.lightSamples = lightSamples;
+	rayTracer.render();
+	std::cout << "Ray traced the reference with a light of radius " << lightRadius << " and " << lightSamples * lightSamples
+		<< " rays per pixel in " << rayTracer.seconds * 1000.0 << "ms\n";
+
+	struct Technique
+	{
+		const char* name;
+		int filter;
+		int samplesDiv2;
+		double cpuMs;			// Shadow map and camera pass of the CPU renderer
+		double rmse;
+		double meanError;
+	};
+	Technique techniques[] = {
+		{ "basic", 0, 0, 0.0, 0.0, 0.0 },
+		{ "PCF", 1, 0, 0.0, 0.0, 0.0 },
+		{ "random 8 samples", 2, 4, 0.0, 0.0, 0.0 },
+		{ "random 16 samples", 2, 8, 0.0, 0.0, 0.0 },
+		{ "random 32 samples", 2, 16, 0.0, 0.0, 0.0 },
+	};
+	const int count = sizeof(techniques) / sizeof(techniques[0]);
+
+	for (int t = 0; t < count; t++)
+	{
+		// The best of a few runs, so a hiccup on the machine doesn't count against a technique.
+		techniques[t].cpuMs = 1e9;
+		for (int run = 0; run < 3; run++)
+		{
+			renderFrameOnCPU(frame, techniques[t].filter, techniques[t].samplesDiv2);
+			techniques[t].cpuMs = std::min(techniques[t].cpuMs, (cpuRasterizer.stats.seconds + cpuRenderer.seconds) * 1000.0);
+		}
+
+		// Only pixels where both see a lit surface count. The silhouettes of the spheres differ a little,
+		// since the rasterizer draws them with triangles.
+		double squared = 0.0, absolute = 0.0;
+		int pixels = 0;
+		for (int i = 0; i < WindowSize * WindowSize; i++)
+		{
+			float reference = rayTracer.visibility[i];
+			float value = cpuRenderer.shadowValues[i];
+			if (reference < 0.0f || value < 0.0f)
+				continue;
+			squared += (value - reference) * (value - reference);
+			absolute += fabs(value - reference);
+			pixels++;
+		}
+		techniques[t].rmse = sqrt(squared / std::max(pixels, 1));
+		techniques[t].meanError = absolute / std::max(pixels, 1);
+	}
+
+	std::ofstream csv("shadow_quality.csv");
+	csv << "technique,cpu_milliseconds,rmse,mean_error\n";
+	for (int t = 0; t < count; t++)
+	{
+		csv << techniques[t].name << "," << techniques[t].cpuMs << "," << techniques[t].rmse << "," << techniques[t].meanError << "\n";
+		std::cout << t + 1 << ": " << techniques[t].name << " - " << techniques[t].cpuMs << "ms CPU time, RMS error " << techniques[t].rmse
+			<< ", mean error " << techniques[t].meanError << "\n";
+	}
+
+	// A small text plot of the error against the CPU time. Each technique is drawn as its number.
+	const int plotWidth = 60, plotHeight = 16;
+	double maxMs = 0.0, maxError = 0.0;
+	for (int t = 0; t < count; t++)
+	{
+		maxMs = std::max(maxMs, techniques[t].cpuMs);
+		maxError = std::max(maxError, techniques[t].rmse);
+	}
+
+	std::vector<std::string> plot(plotHeight, std::string(plotWidth, ' '));
+	for (int t = 0; t < count; t++)
+	{
+		int x = std::min(plotWidth - 1, (int)(techniques[t].cpuMs / maxMs * (plotWidth - 1)));
+		int y = std::min(plotHeight - 1, (int)(techniques[t].rmse / maxError * (plotHeight - 1)));
+		plot[plotHeight - 1 - y][x] = '1' + t;
+	}
+
+	std::cout << "\nRMS error (up to " << maxError << ")\n";
+	for (int row = 0; row < plotHeight; row++)
+		std::cout << "|" << plot[row] << "\n";
+	std::cout << "+" << std::string(plotWidth, '-') << " CPU time (up to " << maxMs << "ms)\n";
+	std::cout << "Saved shadow_quality.csv\n";
+}
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+// Every call to operator new (and so every std::vector growth, std::string, ...) counts here. This replaces
+// operator new for the whole program, drivers and all, so it is only there in builds that ask for it.
+std::atomic<long long> heapAllocations(0);
+
+void* operator new(size_t size)
+{
+	heapAllocations++;
+	void* memory = malloc(size > 0 ? size : 1);
+	if (memory == nullptr)
+		throw std::bad_alloc();
+	return memory;
+}
+
+void operator delete(void* memory) throw()
+{
+	free(memory);
+}
+
+// C++14 compilers call this one when they know the size, so it has to go to free() as well.
+void operator delete(void* memory, size_t) throw()
+{
+	free(memory);
+}
+#endif
+
+// Times the work update() does on every object, on a scene with many spheres, with 1 thread and then
+// with every thread count up to the number of cores, so we can see how well it scales.
+void benchmarkSceneUpdate(int objectCount)
+{
+	// A grid of spheres on the plane, a little bit jittered, so some of them are outside of each view.
+	scene.init();
+	int side = (int)ceil(sqrt((double)objectCount));
+	for (int i = 0; i < objectCount; i++)
+	{
+		glm::vec3 origin((i % side) * 1.5f - side * 0.75f, 0.0f, (i / side) * 1.5f - side * 0.75f);
+		origin += glm::vec3(jitter(), jitter(), jitter());
+		scene.add(&sphere1.base, origin);
+	}
+
+	FrameSnapshot frame;
+
+	int cores = std::max(1, (int)std::thread::hardware_concurrency());
+	double single = 0.0;
+	std::cout << "Scene update for " << objectCount << " objects, in chunks of " << scene.grainSize << ":\n";
+	for (int threads = 1; threads <= cores; threads++)
+	{
+		threadPool.stop();
+		threadPool.start(threads);
+
+		// The first frames grow the arenas, so they are not counted.
+		for (int i = 0; i < 3; i++)
+			captureFrame(frame);
+
+		const int runs = 20;
+		double best = 1e9;
+		for (int i = 0; i < runs; i++)
+		{
+			auto startTime = std::chrono::high_resolution_clock::now();
+			captureFrame(frame);
+			best = std::min(best, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count());
+		}
+		if (threads == 1)
+			single = best;
+
+		std::cout << "  " << threads << (threads == 1 ? " thread:  " : " threads: ") << best * 1000.0 << "ms, "
+			<< objectCount / best / 1e6 << " million objects/s, " << single / best << "x, " << frame.cameraDraws.size()
+			<< " camera draws, " << frame.shadowDraws.size() + frame.dynamicShadowDraws.size() << " shadow draws\n";
+	}
+
+	threadPool.stop();
+	threadPool.start(0);
+
+	// Once the arenas have grown to what a frame needs, a frame should not go to the heap at all.
+	// The work stealing hands out the chunks a little differently every frame, so it takes a few frames
+	// until every thread's sub-arena has seen its biggest share.
+	for (int i = 0; i < 10; i++)
+		captureFrame(frame);
+	const int frames = 100;
+	size_t blocksBefore = scene.arena.blockCount() + frame.arena.blockCount();
+#ifdef COUNT_HEAP_ALLOCATIONS
+	long long before = heapAllocations;
+#endif
+	for (int i = 0; i < frames; i++)
+		captureFrame(frame);
+	size_t blocks = scene.arena.blockCount() + frame.arena.blockCount() - blocksBefore;
+	std::cout << "  Arena blocks allocated in " << frames << " frames after warming up: " << blocks << " ("
+		<< (scene.arena.capacity() + frame.arena.capacity()) / 1024 << "KB in the arenas)\n";
+#ifdef COUNT_HEAP_ALLOCATIONS
+	std::cout << "  Heap allocations in those frames: " << heapAllocations - before << "\n";
+#endif
+}
+
+// Times the matrices and the culling of every object, done one object at a time with glm the way Scene::update()
+// used to, and with the SSE kernels of the TransformStore. Also checks that both give the same matrices, within float rounding.
+void benchmarkTransforms(int objectCount)
+{
+	// The BVH would only compute the matrices of the visible objects.
+	scene.init();
+	scene.useBVH = false;
+	int side = (int)ceil(sqrt((double)objectCount));
+	for (int i = 0; i < objectCount; i++)
+	{
+		glm::vec3 origin((i % side) * 1.5f - side * 0.75f, 0.0f, (i / side) * 1.5f - side * 0.75f);
+		origin += glm::vec3(jitter(), jitter(), jitter());
+		scene.add(&sphere1.base, origin);
+	}
+
+	glm::mat4 lightPV = light.Projection * light.View;
+	Frustum camera, shadow;
+	camera.fromMatrix(PV);
+	shadow.fromMatrix(lightPV);
+
+	// Both versions on one thread first, so we only compare the math.
+	threadPool.stop();
+	threadPool.start(1);
+
+	std::vector<ObjectTransform> reference(objectCount);
+	int referenceCamera = 0, referenceLight = 0;
+	const int runs = 5;
+	double scalar = 1e9;
+	for (int r = 0; r < runs; r++)
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+		referenceCamera = 0;
+		referenceLight = 0;
+		for (int i = 0; i < objectCount; i++)
+		{
+			const SceneObject& object = scene.objects[i];
+			ObjectTransform& t = reference[i];
+			t.Model = glm::translate(glm::mat4(1), object.origin);
+			t.MVP = PV * t.Model;
+			t.ModelView = cameraView * t.Model;
+			t.NormalMatrix = glm::transpose(glm::inverse(glm::mat3(t.ModelView)));
+			t.ShadowMatrix = light.S * t.Model;
+			t.LightMVP = lightPV * t.Model;
+			referenceCamera += camera.containsSphere(object.origin, object.radius);
+			referenceLight += shadow.containsSphere(object.origin, object.radius);
+		}
+		scalar = std::min(scalar, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count());
+	}
+
+	// The first update copies the positions into the store and grows the arena, so it is not counted.
+	scene.update(cameraView, PV, lightPV, light.S);
+	double batched = 1e9;
+	for (int r = 0; r < runs; r++)
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+		scene.update(cameraView, PV, lightPV, light.S);
+		batched = std::min(batched, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count());
+	}
+
+	// The largest difference in any matrix of any object.
+	const TransformStore& store = scene.transforms;
+	float difference = 0.0f;
+	for (int i = 0; i < objectCount; i++)
+	{
+		const ObjectTransform& t = reference[i];
+		glm::mat4 batchedMatrices[5] = { store.model(i), TransformStore::withColumn(scene.shared.PV, store.mvp, i),
+			TransformStore::withColumn(scene.shared.view, store.modelView, i), TransformStore::withColumn(scene.shared.lightS, store.shadow, i),
+			TransformStore::withColumn(scene.shared.lightPV, store.lightMVP, i) };
+		const glm::mat4* referenceMatrices[5] = { &t.Model, &t.MVP, &t.ModelView, &t.ShadowMatrix, &t.LightMVP };
+		for (int m = 0; m < 5; m++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				for (int r = 0; r < 4; r++)
+					difference = std::max(difference, fabsf(batchedMatrices[m][c][r] - (*referenceMatrices[m])[c][r]));
+			}
+		}
+		for (int c = 0; c < 3; c++)
+		{
+			for (int r = 0; r < 3; r++)
+				difference = std::max(difference, fabsf(scene.shared.NormalMatrix[c][r] - t.NormalMatrix[c][r]));
+		}
+	}
+
+	int batchedCamera = 0, batchedLight = 0;
+	for (int c = 0; c < scene.chunkCount; c++)
+	{
+		batchedCamera += scene.chunks[c].cameraCount;
+		batchedLight += scene.chunks[c].lightCount;
+	}
+
+	// And the batched version on all the threads.
+	threadPool.stop();
+	threadPool.start(0);
+	scene.update(cameraView, PV, lightPV, light.S);
+	double threaded = 1e9;
+	for (int r = 0; r < runs; r++)
+	{
+		auto startTime = std::chrono::high_resolution_clock::now();
+		scene.update(cameraView, PV, lightPV, light.S);
+		threaded = std::min(threaded, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count());
+	}
+
+	std::cout << "Matrices and culling for " << objectCount << " objects:\n";
+	std::cout << "  glm, one object at a time: " << scalar * 1000.0 << "ms, " << objectCount / scalar / 1e6 << " million objects/s, "
+		<< referenceCamera << " seen by the camera, " << referenceLight << " by the light\n";
+	std::cout << "  TransformStore, 1 thread:  " << batched * 1000.0 << "ms, " << objectCount / batched / 1e6 << " million objects/s, "
+		<< scalar / batched << "x, " << batchedCamera << " seen by the camera, " << batchedLight << " by the light\n";
+	std::cout << "  TransformStore, " << threadPool.size() << (threadPool.size() == 1 ? " thread:  " : " threads: ") << threaded * 1000.0 << "ms, "
+		<< objectCount / threaded / 1e6 << " million objects/s, " << scalar / threaded << "x\n";
+	std::cout << "  Largest difference between the two: " << difference << "\n";
+}
+
+// Builds the BVH, and culls with it and by testing every object, on scenes from 10 thousand objects up to objectCount
+// (ten times more each time), to see how each one grows with the size of the scene.
+void benchmarkBVH(int objectCount)
+{
+	glm::mat4 lightPV = light.Projection * light.View;
+	std::cout << "Culling and matrices with and without the BVH, " << threadPool.size() << " threads:\n";
+
+	for (int size = std::min(10000, objectCount); ; size = std::min(size * 10, objectCount))
+	{
+		scene.init();
+		int side = (int)ceil(sqrt((double)size));
+		for (int i = 0; i < size; i++)
+		{
+			glm::vec3 origin((i % side) * 1.5f - side * 0.75f, 0.0f, (i / side) * 1.5f - side * 0.75f);
+			origin += glm::vec3(jitter(), jitter(), jitter());
+			scene.add(&sphere1.base, origin);
+		}
+		// The first update copies the objects into the store and builds the tree.
+		scene.update(cameraView, PV, lightPV, light.S);
+
+		threadPool.stop();
+		threadPool.start(1);
+		scene.bvh.build(scene.transforms);
+		double buildSingle = scene.bvh.buildSeconds;
+		threadPool.stop();
+		threadPool.start(0);
+		scene.bvh.build(scene.transforms);
+		double build = scene.bvh.buildSeconds;
+
+		// Both ways, and what they found, sorted so they can be compared. Camera draws are even, shadow draws odd.
+		double update[2];
+		std::vector<int> visible[2];
+		int cameraCount = 0, lightCount = 0;
+		for (int mode = 0; mode < 2; mode++)
+		{
+			scene.useBVH = (mode == 1);
+			scene.update(cameraView, PV, lightPV, light.S);
+			update[mode] = 1e9;
+			for (int r = 0; r < 10; r++)
+			{
+				auto startTime = std::chrono::high_resolution_clock::now();
+				scene.update(cameraView, PV, lightPV, light.S);
+				update[mode] = std::min(update[mode], std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count());
+			}
+
+			cameraCount = 0;
+			lightCount = 0;
+			for (int c = 0; c < scene.chunkCount; c++)
+			{
+				const ChunkVisibility& chunk = scene.chunks[c];
+				for (int k = 0; k < chunk.cameraCount; k++)
+					visible[mode].push_back(chunk.camera[k] * 2);
+				for (int k = 0; k < chunk.lightCount; k++)
+					visible[mode].push_back(chunk.light[k] * 2 + 1);
+				cameraCount += chunk.cameraCount;
+				lightCount += chunk.lightCount;
+			}
+			std::sort(visible[mode].begin(), visible[mode].end());
+		}
+
+		// Move 1% of the objects a little, each followed by a refit.
+		int moved = std::max(1, size / 100);
+		auto startTime = std::chrono::high_resolution_clock::now();
+		for (int k = 0; k < moved; k++)
+		{
+			int i = (int)((k * 7919LL) % size);
+			scene.move(i, scene.objects[i].origin + glm::vec3(0.0f, 0.5f, 0.0f));
+		}
+		double refit = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+
+		std::cout << "  " << size << " objects: build " << build * 1000.0 << "ms (" << buildSingle * 1000.0 << "ms on 1 thread), "
+			<< scene.bvh.nodes.size() << " nodes\n"
+			<< "    every object " << update[0] * 1000.0 << "ms, BVH " << update[1] * 1000.0 << "ms (" << update[0] / update[1] << "x), "
+			<< cameraCount << " seen by the camera, " << lightCount << " by the light, "
+			<< (visible[0] == visible[1] ? "same objects" : "NOT the same objects") << "\n"
+			<< "    refit after moving " << moved << " objects: " << refit * 1000.0 << "ms\n";
+
+		if (size == objectCount)
+			break;
+	}
+}
+
+// Writes a scene file with the plane and objectCount spheres on a grid around it, and the light where it starts.
+// Uses the meshes made by buildGeometry().
+bool generateSceneFile(const char* fileName, int objectCount)
+{
+	const stuff_for_drawing* shapes[] = { &plane.base, &sphere1.base };
+	std::vector<SceneFileMesh> meshes;
+	std::vector<VertexFormat> vertices;
+	float radius[2];
+	for (int m = 0; m < 2; m++)
+	{
+		SceneFileMesh mesh = { (uint32_t)vertices.size(), (uint32_t)shapes[m]->vertices.size() };
+		meshes.push_back(mesh);
+		vertices.insert(vertices.end(), shapes[m]->vertices.begin(), shapes[m]->vertices.end());
+		radius[m] = 0.0f;
+		for (unsigned int i = 0; i < shapes[m]->vertices.size(); i++)
+			radius[m] = std::max(radius[m], glm::length(shapes[m]->vertices[i].position));
+	}
+
+	std::vector<uint32_t> instances(objectCount + 1);
+	std::vector<SceneFileTransform> transforms(objectCount + 1);
+	std::vector<float> bounds(objectCount + 1);
+	instances[0] = 0;
+	transforms[0].position[0] = plane.origin.x;
+	transforms[0].position[1] = plane.origin.y;
+	transforms[0].position[2] = plane.origin.z;
+	bounds[0] = radius[0];
+
+	// The same jittered grid as --bench-jobs.
+	int side = (int)ceil(sqrt((double)std::max(objectCount, 1)));
+	for (int i = 0; i < objectCount; i++)
+	{
+		glm::vec3 origin((i % side) * 1.5f - side * 0.75f, 0.0f, (i / side) * 1.5f - side * 0.75f);
+		origin += glm::vec3(jitter(), jitter(), jitter());
+		instances[i + 1] = 1;
+		transforms[i + 1].position[0] = origin.x;
+		transforms[i + 1].position[1] = origin.y;
+		transforms[i + 1].position[2] = origin.z;
+		bounds[i + 1] = radius[1];
+	}
+
+	LightParams defaults;
+	defaults.initMatrices();
+	SceneFileLight sceneLight = { { defaults.position.x, defaults.position.y, defaults.position.z },
+		{ defaults.Intensity.x, defaults.Intensity.y, defaults.Intensity.z } };
+	std::vector<SceneFileLight> lights(1, sceneLight);
+
+	if (!writeSceneFile(fileName, meshes, vertices, instances, transforms, bounds, lights))
+	{
+		std::cout << "Could not write " << fileName << "\n";
+		return false;
+	}
+	std::cout << "Wrote " << fileName << " with " << objectCount + 1 << " objects\n";
+	return true;
+}
+
+void secondDrawPass(const FrameSnapshot& frame)
+{
+	// In the temporal mode we render into our own framebuffer, so the shadow values can be kept for the next frame.
+	bool temporalMode = (shadowType == uniforms.sub_func_temporalSamplingShadow);
+
+	if (temporalMode)
+		temporal.begin();
+	else
+		glState.bindFramebuffer(GL_FRAMEBUFFER, 0);
 	// This function acts on the frabe buffer currently in use. 
 	// So if we use this statement before unbinding the framebuffer, it will clear the depth texture attached to it and also all the data we had stored in it.
-	glClear(GL_DEPTH_BUFFER_BIT);			
-	glUseProgram(renderProgram);
+	glClear(GL_DEPTH_BUFFER_BIT | (temporalMode ? GL_COLOR_BUFFER_BIT : 0));
+	glState.useProgram(spirvShaders ? spirvRenderPrograms[shadowType] : renderProgram);
 	
 	//Rendering to the main window.
 	// We have to calculate the shadow matrix for each game object and pass it into the shader
@@ -442,53 +1787,79 @@ void secondDrawPass()
 		glCullFace(GL_BACK);
 		
 		//load the two textures: the shadow map and offsetTexture
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, depthTex);
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, offsetTex);
-
-		//Set the subroutine 
-		glUniformSubroutinesuiv(GL_FRAGMENT_SHADER, 1, &shadowType);
-		glUniform3fv(uniforms.vec3_LightPos, 1, glm::value_ptr(light.position));
-		glUniform3fv(uniforms.vec3_LightIntensity, 1, glm::value_ptr(light.Intensity));
-		glUniform3fv(uniforms.vec3_offsetSize, 1, glm::value_ptr(offsetTexSize));
-
-		glm::mat4 shadowMat;
-		
-		//Sphere1
-		glUniformMatrix4fv(uniforms.mat4_MVP, 1, GL_FALSE, glm::value_ptr(sphere1.MVP));
-		glUniformMatrix4fv(uniforms.mat4_ModelViewMatrix, 1, GL_FALSE, glm::value_ptr(sphere1.ModelView));
-		glUniformMatrix3fv(uniforms.mat3_NormalMatrix, 1, GL_FALSE, glm::value_ptr(sphere1.NormalMatrix));
-		shadowMat = light.S * glm::translate(glm::mat4(1), sphere1.origin);	//Calculating the shadow matrix
-		glUniformMatrix4fv(uniforms.mat4_ShadowMatrix, 1, GL_FALSE, glm::value_ptr(shadowMat));
-		glBindVertexArray(sphere1.base.vao);
-		glBindBuffer(GL_ARRAY_BUFFER, sphere1.base.vbo);
-		glDrawArrays(GL_TRIANGLES, 0, sphere1.base.numberOfVertices);
-
-		//Sphere2
-		glUniformMatrix4fv(uniforms.mat4_MVP, 1, GL_FALSE, glm::value_ptr(sphere2.MVP));
-		glUniformMatrix4fv(uniforms.mat4_ModelViewMatrix, 1, GL_FALSE, glm::value_ptr(sphere2.ModelView));
-		glUniformMatrix3fv(uniforms.mat3_NormalMatrix, 1, GL_FALSE, glm::value_ptr(sphere2.NormalMatrix));
-		shadowMat = light.S * glm::translate(glm::mat4(1), sphere2.origin);
-		glUniformMatrix4fv(uniforms.mat4_ShadowMatrix, 1, GL_FALSE, glm::value_ptr(shadowMat));
-		glBindVertexArray(sphere2.base.vao);
-		glBindBuffer(GL_ARRAY_BUFFER, sphere2.base.vbo);
-		glDrawArrays(GL_TRIANGLES, 0, sphere2.base.numberOfVertices);
-
-		//Plane
-		glUniformMatrix4fv(uniforms.mat4_MVP, 1, GL_FALSE, glm::value_ptr(plane.MVP));
-		glUniformMatrix4fv(uniforms.mat4_ModelViewMatrix, 1, GL_FALSE, glm::value_ptr(plane.ModelView));
-		glUniformMatrix3fv(uniforms.mat3_NormalMatrix, 1, GL_FALSE, glm::value_ptr(plane.NormalMatrix));
-		shadowMat = light.S * glm::translate(glm::mat4(1), plane.origin);
-		glUniformMatrix4fv(uniforms.mat4_ShadowMatrix, 1, GL_FALSE, glm::value_ptr(shadowMat));
-		glBindVertexArray(plane.base.vao);
-		glBindBuffer(GL_ARRAY_BUFFER, plane.base.vbo);
-		glDrawArrays(GL_TRIANGLES, 0, plane.numberOfVertices);
+		//These only change when the textures are recreated, so after the first frame the state cache skips them.
+		glState.bindTexture(0, GL_TEXTURE_2D, depthTex);
+		glState.bindTexture(1, GL_TEXTURE_3D, offsetTex);
+		glState.bindTexture(PYRAMID_TEXTURE_UNIT, GL_TEXTURE_2D, depthPyramid.texture);
+		glState.bindTexture(ATLAS_TEXTURE_UNIT, GL_TEXTURE_2D, shadowAtlas.texture);
+		glState.bindTexture(CUBE_TEXTURE_UNIT, GL_TEXTURE_CUBE_MAP, cubeShadow.texture);
+		glState.bindTexture(PARABOLOID_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, paraboloidShadow.texture);
+
+		//Set the subroutine. The SPIR-V programs have the filter built in, so they don't need one.
+		if (!spirvShaders)
+			glState.fragmentSubroutine(shadowType);
+
+		// The frame's block first, then the spot lights, then one slot per object, written straight into the mapped buffer.
+		// The matrices were computed by the update thread, so this is only a copy, done here rather than on the thread
+		// pool so the render thread never waits for the update thread to be done with the pool.
+		int count = (int)frame.cameraDraws.size();
+		GLsizeiptr frameSize = frameRing.aligned(sizeof(FrameUniforms));
+		GLsizeiptr headerSize = frameSize + frameRing.aligned(sizeof(AtlasBlockUniforms));
+		GLsizeiptr stride = frameRing.aligned(sizeof(ObjectUniforms));
+		GLintptr offset;
+		char* data = frameRing.allocate(headerSize + stride * count, offset);
+
+		FrameUniforms frameData;
+		frameData.lightPosition = glm::vec4(frame.light.position, 0.0f);
+		frameData.lightIntensity = glm::vec4(frame.light.Intensity, 0.0f);
+		frameData.offsetTexSize = offsetTexSize;
+		frameData.frameIndex = temporal.frameIndex;
+		frameData.historyWeight = temporal.historyWeight();
+		frameData.usePyramid = depthPyramid.active() ? 1 : 0;
+		frameData.omniShadows = omniShadowMode(frame.controls);
+		frameData.omniFilter = frame.controls.filter;
+		frameData.viewToLight = glm::translate(glm::mat4(1.0f), -frame.light.position) * glm::inverse(frame.view);
+		frameData.cubeDepth = CubeShadowMap::depthParams();
+		frameData.paraboloidDepth = ParaboloidShadowMap::depthParams();
+		frameData.clusterScale = ClusteredLights::scale(WindowSize);
+		memcpy(data, &frameData, sizeof(frameData));
+
+		// Only the lights in use are written, the shader doesn't read past the count.
+		AtlasBlockUniforms* atlasData = (AtlasBlockUniforms*)(data + frameSize);
+		atlasData->AtlasLightCount = shadowAtlas.usable ? frame.atlasTileCount : 0;
+		for (int t = 0; t < atlasData->AtlasLightCount; t++)
+			ShadowAtlas::uniforms(frame.atlasTiles[t], atlasData->AtlasLights[t]);
+
+		for (int i = 0; i < count; i++)
+		{
+			const CameraDraw& draw = frame.cameraDraws[i];
+			ObjectUniforms* object = (ObjectUniforms*)(data + headerSize + stride * i);
+			object->MVP = draw.MVP;
+			object->ModelViewMatrix = draw.ModelView;
+			for (int c = 0; c < 3; c++)
+				object->NormalMatrix[c] = glm::vec4(draw.NormalMatrix[c], 0.0f);
+			object->ShadowMatrix = draw.ShadowMatrix;
+			object->PrevMVP = prevPV * draw.Model;
+		}
+		frameRing.flush(offset, headerSize + stride * count);
+
+		glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, frameRing.buffer, offset, sizeof(FrameUniforms));
+		glBindBufferRange(GL_UNIFORM_BUFFER, ATLAS_BLOCK_BINDING, frameRing.buffer, offset + frameSize, sizeof(AtlasBlockUniforms));
+		for (int i = 0; i < count; i++)
+		{
+			const stuff_for_drawing* mesh = scene.meshOf(frame.cameraDraws[i].object, frame.cameraDraws[i].lod);
+			glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BLOCK_BINDING, frameRing.buffer, offset + headerSize + stride * i, sizeof(ObjectUniforms));
+			glState.bindVertexArray(mesh->vao);
+			glDrawArrays(GL_TRIANGLES, 0, mesh->numberOfVertices);
+		}
 	}
+
+	if (temporalMode)
+		temporal.end();
 }
 
 // This function runs every frame
-void renderScene()
+void renderScene(const FrameSnapshot& frame)
 {
 	// Clear the color buffer and the depth buffer
 	glClear(GL_COLOR_BUFFER_BIT);
@@ -496,13 +1867,110 @@ void renderScene()
 	// Clear the screen to white
 	glClearColor(1.0, 1.0, 1.0, 1.0);
 
-	firstDrawPass();
+	firstDrawPass(frame);
+
+	// Only the random sampling uses the pyramid, so the other filters don't pay for building it.
+	if (depthPyramid.active() && shadowType == uniforms.sub_func_randomSamplingShadow)
+		depthPyramid.build(depthTex);
+
+	// The lights' view space positions are this frame's, so they are sorted again every frame.
+	clusteredLights.build(frame.clusterLights, frame.clusterLightCount, frame.PV * glm::inverse(frame.view));
+
+	depthPyramid.beginFrame();
+	secondDrawPass(frame);
+	depthPyramid.endFrame();
 
-	secondDrawPass();
+	// Remember this frame's camera for the reprojection in the next frame.
+	prevPV = frame.PV;
+
+	glState.endFrame();
 }
 
 #pragma endregion Helper_functions
 
+// Called after the shader reloader swapped in new programs. The uniform locations and subroutine
+// indices can change after a relink, so all of them are fetched again.
+// shadowType is picked again from the snapshot at the start of every frame, so it doesn't need fixing here.
+void refreshProgramHandles()
+{
+	uniforms.initUniforms(renderProgram);
+	temporal.reset();
+
+	// The new programs may reuse the names of the old ones, so the cached uniforms are no longer valid.
+	glState.invalidate();
+}
+
+// The render thread. It owns the GL context, and draws the newest snapshot the update thread has published.
+// If there is no new one yet, it draws the last one again, which still lets the temporal filter converge.
+void renderLoop()
+{
+	glfwMakeContextCurrent(window);
+
+	// The requests that have been done already. The counters start at 0, so there is nothing to do at first.
+	unsigned int historyResets = 0, compareRequests = 0, cpuFrameRequests = 0;
+
+	while (!stopRendering)
+	{
+		frames.acquire();
+		const FrameSnapshot& frame = frames.readBuffer();
+		// The region of the ring this frame writes to. Waits if the GPU is still reading it from 3 frames ago.
+		frameRing.beginFrame();
+
+		// Swap in any shaders that finished recompiling in the background.
+		if (shaderReloader.swapReadyPrograms())
+			refreshProgramHandles();
+
+		GLuint subroutines[] = { uniforms.sub_func_basicShadow, uniforms.sub_func_PCFshadow,
+			uniforms.sub_func_randomSamplingShadow, uniforms.sub_func_temporalSamplingShadow };
+		shadowType = subroutines[frame.controls.filter];
+		depthPyramid.enabled = frame.controls.usePyramid;
+
+		if (frame.controls.historyResets != historyResets)
+		{
+			historyResets = frame.controls.historyResets;
+			temporal.reset();
+		}
+		// The CPU tools run here too, so they never use the CPU rasterizer at the same time.
+		if (frame.controls.compareRequests != compareRequests)
+		{
+			compareRequests = frame.controls.compareRequests;
+			compareCPUShadowMap(frame);
+		}
+		if (frame.controls.cpuFrameRequests != cpuFrameRequests)
+		{
+			cpuFrameRequests = frame.controls.cpuFrameRequests;
+			// The temporal filter needs the frames before, so the CPU draws it as random sampling.
+			saveFrameOnCPU(frame, std::min(frame.controls.filter, 2), "cpu_frame.ppm");
+		}
+		if (frame.controls.capturing != frameCapture.active)
+		{
+			if (frame.controls.capturing)
+				frameCapture.start();
+			else
+				frameCapture.stop();
+		}
+
+		renderScene(frame);
+		frameRing.endFrame();
+		// Queues the copy of the finished frame. The pixels reach the disk a few frames later.
+		frameCapture.record(depthTex);
+
+		// Swaps the back buffer to the front buffer
+		// Remember, you're rendering to the back buffer, then once rendering is complete, you're moving the back buffer to the front so it can be displayed.
+		glfwSwapBuffers(window);
+
+		renderStats.callsIssued = glState.lastIssued;
+		renderStats.callsElided = glState.lastElided;
+		renderStats.fastFragments = depthPyramid.fastFragments;
+		renderStats.sampledFragments = depthPyramid.fastFragments + depthPyramid.fullFragments;
+		renderStats.framesRendered++;
+	}
+
+	glfwMakeContextCurrent(nullptr);
+}
+
+// Called from glfwPollEvents() on the update thread. It only changes the update thread's copy of the scene,
+// the render thread sees the changes in the next snapshot.
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
 	//This set of controls are used to move the light source 
@@ -524,19 +1992,292 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 			light.position = glm::vec3(0.1f, 10, 0);
 
 		if (key == GLFW_KEY_1)
-			shadowType = uniforms.sub_func_basicShadow;
+			controls.filter = 0;
 		if (key == GLFW_KEY_2)
-			shadowType = uniforms.sub_func_PCFshadow;
+			controls.filter = 1;
 		if (key == GLFW_KEY_3)
-			shadowType = uniforms.sub_func_randomSamplingShadow;
+			controls.filter = 2;
+		if (key == GLFW_KEY_4)
+			controls.filter = 3;
+
+		if (key == GLFW_KEY_H && action == GLFW_PRESS)
+		{
+			controls.usePyramid = !controls.usePyramid;
+			std::cout << "Depth pyramid early-out " << (controls.usePyramid ? "on" : "off") << "\n";
+		}
+		// These need the render thread, so they are requested and it runs them before its next frame.
+		if (key == GLFW_KEY_C && action == GLFW_PRESS)
+			controls.compareRequests++;
+		if (key == GLFW_KEY_V && action == GLFW_PRESS)
+			controls.cpuFrameRequests++;
+		if (key == GLFW_KEY_P && action == GLFW_PRESS)
+			controls.capturing = !controls.capturing;
+		if (key == GLFW_KEY_M && action == GLFW_PRESS)
+			controls.animate = !controls.animate;
+		if (key == GLFW_KEY_B && action == GLFW_PRESS)
+		{
+			controls.flatCulling = !controls.flatCulling;
+			std::cout << "Culling " << (controls.flatCulling ? "every object" : "with the BVH") << "\n";
+		}
+		if (key == GLFW_KEY_K && action == GLFW_PRESS)
+		{
+			controls.cacheStaticShadows = !controls.cacheStaticShadows;
+			std::cout << "Static shadow cache " << (controls.cacheStaticShadows ? "on" : "off") << "\n";
+		}
+		if (key == GLFW_KEY_O && action == GLFW_PRESS)
+		{
+			controls.omniShadows = (controls.omniShadows + 1) % 3;
+			const char* modes[] = { "in front of the light", "in every direction, from the cube shadow map",
+				"in every direction, from the dual paraboloid shadow map" };
+			std::cout << "Shadows " << modes[controls.omniShadows] << "\n";
+		}
+		if (key == GLFW_KEY_I && action == GLFW_PRESS)
+		{
+			controls.cubeSixPasses = !controls.cubeSixPasses;
+			std::cout << "Cube shadow map drawn in " << (controls.cubeSixPasses ? "six passes" : "one layered pass") << "\n";
+		}
 
 		//Once the light source is changed, the matrices need to be recalculated
 		light.recaliberate();
+		//The shadows have moved, so the accumulated history is no longer valid
+		controls.historyResets++;
+	}
+}
+
+// Puts the shaders and the generated offsets into one pack file.
+// Run the program with "--pack" to create it.
+int buildAssetPack(const char* fileName)
+{
+	const char* shaders[] = { "VertexShader.glsl", "FragmentShader.glsl", "LightVertexShader.glsl", "LightFragShader.glsl", "DepthPyramid.glsl",
+		"CubeShadowVertexShader.glsl", "CubeShadowGeometryShader.glsl", "ParaboloidGeometryShader.glsl",
+		"ClusterLights.glsl" };
+	std::vector<AssetSource> assets;
+
+	for (int i = 0; i < 9; i++)
+	{
+		assets.push_back(AssetSource());
+		// Shaders are stored as they are so they can be handed to the driver straight from the mapped file.
+		if (!loadAssetSource(shaders[i], false, assets.back()))
+			return 1;
+	}
+
+	// The SPIR-V versions are only there if the build step that compiles them ran.
+	const char* spirvShaderFiles[] = { "VertexShader.spv", "FragmentShader.spv", "LightVertexShader.spv", "LightFragShader.spv" };
+	for (int i = 0; i < 4; i++)
+	{
+		AssetSource spirv;
+		if (std::ifstream(spirvShaderFiles[i]).good() && loadAssetSource(spirvShaderFiles[i], false, spirv))
+			assets.push_back(spirv);
+	}
+
+	std::vector<float> offsets;
+	generateOffsetData(OFFSET_TEX_SIZE, OFFSET_SAMPLES_U, OFFSET_SAMPLES_V, offsets);
+	assets.push_back(AssetSource());
+	assets.back().name = offsetTexAssetName(OFFSET_TEX_SIZE, OFFSET_SAMPLES_U, OFFSET_SAMPLES_V);
+	assets.back().data.assign((const char*)&offsets[0], (const char*)&offsets[0] + offsets.size() * sizeof(float));
+	assets.back().tryCompress = true;
+
+	if (!writeAssetPack(fileName, assets))
+	{
+		std::cout << "Could not write " << fileName << "\n";
+		return 1;
+	}
+	std::cout << "Wrote " << assets.size() << " assets to " << fileName << "\n";
+	return 0;
+}
+
+// Loads the precompiled SPIR-V shaders. The render program is specialized once for every filter,
+// with the number of samples and the kernel radius as constants, so the driver can unroll the sampling loops.
+// The .spv files only exist if the build step that compiles them ran. If any of them is missing,
+// everything falls back to the GLSL sources.
+void submitSpirvPrograms()
+{
+	float kernelRadius = 0.004f;
+	GLuint constantIds[] = { 0, 1, 2 };		// ShadowFilter, SamplesDiv2, KernelRadius
+	GLuint constantValues[3];
+	constantValues[1] = OFFSET_SAMPLES_V;	// Same as the z of offsetTexSize
+	memcpy(&constantValues[2], &kernelRadius, sizeof(float));
+
+	size_t firstPending = pendingPrograms.size();
+	bool found = true;
+	program = submitSpirvProgram("VertexShader.spv", "FragmentShader.spv", 0, nullptr, nullptr);
+	found &= (program != 0);
+	for (GLuint filter = 0; filter < 4 && found; filter++)
+	{
+		constantValues[0] = filter;
+		spirvRenderPrograms[filter] = submitSpirvProgram("LightVertexShader.spv", "LightFragShader.spv", 3, constantIds, constantValues);
+		found &= (spirvRenderPrograms[filter] != 0);
+	}
+
+	if (!found)
+	{
+		std::cout << "The SPIR-V shaders are missing, using GLSL instead.\n";
+		for (size_t i = firstPending; i < pendingPrograms.size(); i++)
+		{
+			glDeleteProgram(pendingPrograms[i].program);
+			for (int s = 0; s < pendingPrograms[i].shaderCount; s++)
+				glDeleteShader(pendingPrograms[i].shaders[s]);
+		}
+		pendingPrograms.resize(firstPending);
+		for (int filter = 0; filter < 4; filter++)
+			spirvRenderPrograms[filter] = 0;
+		spirvShaders = false;
+		submitGlslPrograms();
+		return;
 	}
+	renderProgram = spirvRenderPrograms[0];
 }
 
-void main()
+int main(int argc, char** argv)
 {
+	// Worker threads for everything done on the CPU. 0 means one per core.
+	threadPool.start(0);
+
+	bool captureAtStart = false, capturePNG = true, captureDepth = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::string(argv[i]) == "--pack")
+		{
+			int result = buildAssetPack("assets.pak");
+			threadPool.stop();
+			return result;
+		}
+		// Time the CPU shadow map without opening a window. Nothing here needs OpenGL.
+		if (std::string(argv[i]) == "--cpu-shadow")
+		{
+			buildGeometry();
+			initCamera();
+			light.initMatrices();
+			FrameSnapshot frame;
+			captureFrame(frame);
+			benchmarkCPUShadowMap(frame);
+			threadPool.stop();
+			return 0;
+		}
+		// Render one frame on the CPU and save it, without a window or OpenGL.
+		// Optionally followed by the filter (1, 2 or 3, like the keys) and the file name.
+		if (std::string(argv[i]) == "--cpu-render")
+		{
+			int filter = (i + 1 < argc) ? atoi(argv[i + 1]) : 1;
+			const char* fileName = (i + 2 < argc) ? argv[i + 2] : "cpu_frame.ppm";
+			buildGeometry();
+			initCamera();
+			light.initMatrices();
+			loadOffsetData(OFFSET_TEX_SIZE, OFFSET_SAMPLES_U, OFFSET_SAMPLES_V, offsetData);
+			offsetTexSize = glm::vec3(OFFSET_TEX_SIZE, OFFSET_SAMPLES_U, OFFSET_SAMPLES_V);
+			FrameSnapshot frame;
+			captureFrame(frame);
+			saveFrameOnCPU(frame, std::min(std::max(filter, 1), 3) - 1, fileName);
+			threadPool.stop();
+			return 0;
+		}
+		// Compare every technique with ray traced soft shadows.
+		// Optionally followed by the radius of the light and the number of rays along each side of the light.
+		if (std::string(argv[i]) == "--shadow-quality")
+		{
+			float lightRadius = (i + 1 < argc) ? (float)atof(argv[i + 1]) : 1.0f;
+			int lightSamples = (i + 2 < argc) ? atoi(argv[i + 2]) : 16;
+			buildGeometry();
+			initCamera();
+			light.initMatrices();
+			loadOffsetData(OFFSET_TEX_SIZE, OFFSET_SAMPLES_U, OFFSET_SAMPLES_V, offsetData);
+			offsetTexSize = glm::vec3(OFFSET_TEX_SIZE, OFFSET_SAMPLES_U, OFFSET_SAMPLES_V);
+			FrameSnapshot frame;
+			captureFrame(frame);
+			compareShadowQuality(frame, lightRadius, std::max(lightSamples, 1));
+			threadPool.stop();
+			return 0;
+		}
+		// Time the CPU versions of the shadow filters, also without a window.
+		if (std::string(argv[i]) == "--bench-filters")
+		{
+			buildGeometry();
+			initCamera();
+			light.initMatrices();
+			loadOffsetData(OFFSET_TEX_SIZE, OFFSET_SAMPLES_U, OFFSET_SAMPLES_V, offsetData);
+			offsetTexSize = glm::vec3(OFFSET_TEX_SIZE, OFFSET_SAMPLES_U, OFFSET_SAMPLES_V);
+			FrameSnapshot frame;
+			captureFrame(frame);
+			benchmarkShadowFilters(frame);
+			threadPool.stop();
+			return 0;
+		}
+		// Time the per frame work on the objects with more and more threads, also without a window.
+		if (std::string(argv[i]) == "--bench-jobs")
+		{
+			int objectCount = (i + 1 < argc) ? atoi(argv[i + 1]) : 100000;
+			buildGeometry();
+			initCamera();
+			light.initMatrices();
+			benchmarkSceneUpdate(std::max(objectCount, 1));
+			threadPool.stop();
+			return 0;
+		}
+		// Compare the batched matrices with glm, also without a window.
+		if (std::string(argv[i]) == "--bench-transforms")
+		{
+			int objectCount = (i + 1 < argc) ? atoi(argv[i + 1]) : 1000000;
+			buildGeometry();
+			initCamera();
+			light.initMatrices();
+			benchmarkTransforms(std::max(objectCount, 1));
+			threadPool.stop();
+			return 0;
+		}
+		// Compare the culling with and without the BVH, also without a window.
+		if (std::string(argv[i]) == "--bench-bvh")
+		{
+			int objectCount = (i + 1 < argc) ? atoi(argv[i + 1]) : 1000000;
+			buildGeometry();
+			initCamera();
+			light.initMatrices();
+			benchmarkBVH(std::max(objectCount, 1));
+			threadPool.stop();
+			return 0;
+		}
+		// Spot lights with their shadows in the atlas, added in setup().
+		if (std::string(argv[i]) == "--lights")
+			ringLights = (i + 1 < argc) ? std::max(atoi(argv[i + 1]), 0) : 8;
+		// Point lights without shadows, added in setup().
+		if (std::string(argv[i]) == "--point-lights")
+			scatteredLights = (i + 1 < argc) ? std::max(atoi(argv[i + 1]), 0) : 256;
+		if (std::string(argv[i]) == "--shadow-budget")
+			shadowBudget = (i + 1 < argc) ? std::min(std::max(atoi(argv[i + 1]), 0), MAX_ATLAS_LIGHTS) : 16;
+		// Write a scene file, without opening a window.
+		if (std::string(argv[i]) == "--make-scene")
+		{
+			const char* fileName = (i + 1 < argc) ? argv[i + 1] : "scene.bin";
+			int objectCount = (i + 2 < argc) ? atoi(argv[i + 2]) : 100000;
+			buildGeometry();
+			bool written = generateSceneFile(fileName, std::max(objectCount, 0));
+			threadPool.stop();
+			return written ? 0 : 1;
+		}
+		if (std::string(argv[i]) == "--scene" && i + 1 < argc)
+			sceneFileName = argv[++i];
+		// Record every frame from the start, for example for a regression run.
+		if (std::string(argv[i]) == "--capture")
+		{
+			captureAtStart = true;
+			while (i + 1 < argc && (std::string(argv[i + 1]) == "png" || std::string(argv[i + 1]) == "raw" || std::string(argv[i + 1]) == "depth"))
+			{
+				i++;
+				if (std::string(argv[i]) == "depth")
+					captureDepth = true;
+				else
+					capturePNG = (std::string(argv[i]) == "png");
+			}
+		}
+		// Load the shaders from the .spv files compiled at build time instead of the GLSL.
+		if (std::string(argv[i]) == "--spirv")
+			spirvShaders = true;
+	}
+
+	// Everything is loaded from the pack if there is one. Loose files are used for anything it doesn't have.
+	if (assetPack.open("assets.pak"))
+		std::cout << "Loading assets from assets.pak\n";
+
 	glfwInit();
 
 	// Creates a window given (width, height, title, monitorPtr, windowPtr).
@@ -546,7 +2287,13 @@ void main()
 	std::cout << "This example produces soft shadows.\n";
 	std::cout << "Use 'w' 'a' 's' 'd' to move the light source in x-z plane.\n";
 	std::cout << "you can also use 'left shift' and 'Space' to move the light source higher or lower.\n";
-	std::cout << "Use '1' for Hard shadows.\nUse '1' for soft shadows using PFC.\nUse '1' for soft shadows with random sampling.";
+	std::cout << "Use '1' for Hard shadows.\nUse '1' for soft shadows using PFC.\nUse '1' for soft shadows with random sampling.\nUse '4' for soft shadows with temporal random sampling.\n";
+	std::cout << "Use 'c' to render the shadow map on the CPU and compare it with the GPU.\n";
+	std::cout << "Use 'v' to render the frame on the CPU and save it to cpu_frame.ppm.\n";
+	std::cout << "Use 'h' to turn the depth pyramid early-out of the random sampling on and off.\n";
+	std::cout << "Use 'p' to start and stop recording the frames to disk.\n";
+	std::cout << "Use 'o' for shadows in every direction from a cube shadow map, again for a dual paraboloid one, and once more to go back.\n";
+	std::cout << "Use 'i' to draw the faces of the cube shadow map in one pass or six.\n";
 	// Makes the OpenGL context current for the created window.
 	glfwMakeContextCurrent(window);
 
@@ -558,35 +2305,113 @@ void main()
 
 	// Initializes most things needed before the main loop
 	init();
+	if (spirvShaders)
+		submitSpirvPrograms();
 
 	glfwSetKeyCallback(window, key_callback);
 
 	setup();
 
-	// Enter the main loop.
-	while (!glfwWindowShouldClose(window))
+	frameCapture.png = capturePNG;
+	frameCapture.captureDepth = captureDepth;
+	controls.capturing = captureAtStart;
+
+	// Recompile the shaders whenever one of the files is saved.
+	// This works on the GLSL files, so it is off when the shaders come from SPIR-V.
+	if (!spirvShaders)
 	{
-		// Call to update() which will update the gameobjects.
-		update();
+		shaderReloader.watch("VertexShader.glsl", "FragmentShader.glsl", &program);
+		shaderReloader.watch("LightVertexShader.glsl", "LightFragShader.glsl", &renderProgram);
+		shaderReloader.start(window);
+	}
 
-		// Call the render function.
-		renderScene();
+	// Hand the GL context over to the render thread. From here on, this thread only reads the input and updates the scene.
+	// GLFW can only poll events on the main thread, so it is the render thread that moves.
+	update();
+	glfwMakeContextCurrent(nullptr);
+	stopRendering = false;
+	renderThread = std::thread(renderLoop);
 
-		// Swaps the back buffer to the front buffer
-		// Remember, you're rendering to the back buffer, then once rendering is complete, you're moving the back buffer to the front so it can be displayed.
-		glfwSwapBuffers(window);
+	double lastTitleUpdate = glfwGetTime();
+	int lastFramesRendered = 0;
+	int updatesSinceTitleUpdate = 0;
+	auto updateInterval = std::chrono::microseconds(1000000 / UpdateRate);
+	auto nextUpdate = std::chrono::steady_clock::now();
 
+	// Enter the main loop.
+	while (!glfwWindowShouldClose(window))
+	{
 		// Checks to see if any events are pending and then processes them.
 		glfwPollEvents();
+
+		// Call to update() which will publish the new state of the scene.
+		update();
+		updatesSinceTitleUpdate++;
+
+		// Once a second, show the frame rate and how many GL calls the state cache skipped in the window title.
+		if (glfwGetTime() - lastTitleUpdate > 1.0)
+		{
+			int framesRendered = renderStats.framesRendered;
+			std::string title = "Shadow Mapping - " + std::to_string(framesRendered - lastFramesRendered) + " fps, "
+				+ std::to_string(updatesSinceTitleUpdate) + " updates/s - GL calls per frame: "
+				+ std::to_string(renderStats.callsIssued) + " made, " + std::to_string(renderStats.callsElided) + " skipped";
+			// How many fragments the depth pyramid let skip the taps, in the last frame read back.
+			unsigned int sampled = renderStats.sampledFragments;
+			if (sampled > 0)
+				title += " - fast path: " + std::to_string(renderStats.fastFragments * 100ull / sampled) + "% of "
+					+ std::to_string(sampled) + " fragments";
+			title += " - shadow casters drawn: " + std::to_string(renderStats.castersDrawn) + " of " + std::to_string(renderStats.casters);
+			if (controls.omniShadows == 1)
+				title += " - cube map: " + std::to_string(renderStats.omniMicroseconds) + "us on the GPU in "
+					+ (controls.cubeSixPasses ? "6 passes" : "1 pass") + ", " + std::to_string(renderStats.omniFaces) + " faces drawn";
+			else if (controls.omniShadows == 2)
+				title += " - dual paraboloid: " + std::to_string(renderStats.omniMicroseconds) + "us on the GPU, "
+					+ std::to_string(renderStats.omniFaces) + " halves drawn";
+			glfwSetWindowTitle(window, title.c_str());
+			lastTitleUpdate = glfwGetTime();
+			lastFramesRendered = framesRendered;
+			updatesSinceTitleUpdate = 0;
+		}
+
+		// Wait for the next timestep. If we fell behind, start counting again from now instead of catching up.
+		nextUpdate += updateInterval;
+		auto now = std::chrono::steady_clock::now();
+		if (nextUpdate < now)
+			nextUpdate = now;
+		std::this_thread::sleep_until(nextUpdate);
 	}
 
+	// Take the context back for the cleanup.
+	stopRendering = true;
+	renderThread.join();
+	glfwMakeContextCurrent(window);
+
+	std::cout << "Frame data ring: the CPU waited for the GPU in " << frameRing.stalls << " of " << frameRing.frames << " frames\n";
+	frameRing.release();
+	std::cout << "Static shadow cache: drawn " << staticShadowCache.rebuilds << " times\n";
+	staticShadowCache.release();
+	shadowAtlas.release();
+	omniTimer.printTimes();
+	omniTimer.release();
+	cubeShadow.release();
+	paraboloidShadow.release();
+	clusteredLights.release();
+	// Writes out the frames that are still on their way.
+	frameCapture.release();
+
 	// After the program is over, cleanup your data!
+	shaderReloader.stop();
+	threadPool.stop();
 	glDeleteShader(vertex_shader);
 	glDeleteShader(fragment_shader);
 	glDeleteProgram(program);
 	// Note: If at any point you stop using a "program" or shaders, you should free the data up then and there.
 
 
+	assetPack.close();
+
 	// Frees up GLFW memory
 	glfwTerminate();
+
+	return 0;
 }
\ No newline at end of file